@@ -2,25 +2,52 @@
 // Verify that all records in a DiskHashTable are unique, even accross buckets.
 //
 #include <iostream>
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <random>
 #include <set>
 #include <sstream>
 
 #include "dreid.h"
+#include "dht_cache.h"
+#include "dht_tiers.h"
+#include "lz4block.h"
+#include "sorted_run.h"
 
 void usage(std::string prog)
 {
     std::cout << "DiskHashTable Utility\n"
               << "usage:\n"
               << '\t' << prog << " verify <path_to_dht_root> <dht_base_name> [options]\n"
+              << '\t' << prog << " rehash <path_to_dht_root> <level> <dht_base_name> [split_recs]\n"
+              << '\t' << prog << " stats <path_to_dht_root> <level> <dht_base_name> [probe_cnt]\n"
               << '\t' << prog << " test [options]\n"
               << "note: there are no options yet\n"
               << std::endl;
     exit(1);
 }
 
+// the sorted runs of a bucket, oldest first
+std::vector<std::string> bucket_runs(const std::string& fspec)
+{
+    std::vector<std::string> runs;
+    std::filesystem::path bucket(fspec);
+    std::string lead = bucket.filename().string() + ".r";
+    for (auto& entry : std::filesystem::directory_iterator(bucket.parent_path()))
+    {
+        std::string fname = entry.path().filename().string();
+        if (fname.rfind(lead, 0) == 0 && !fname.ends_with(".tmp"))
+            runs.push_back(entry.path().string());
+    }
+    std::sort(runs.begin(), runs.end());    // the sequence is zero-padded
+    return runs;
+}
+
 void command_verify(int argc, char **argv)
 {
     if (argc < 4)
@@ -29,6 +56,7 @@ void command_verify(int argc, char **argv)
     std::set<dreid::PositionPacked> cache;
     int rec_cnt(0);
     int dupe_cnt(0);
+    int shadow_cnt(0);
 
     std::filesystem::path path(argv[2]);
     if (!std::filesystem::exists(path))
@@ -41,37 +69,74 @@ void command_verify(int argc, char **argv)
     std::string max_buck;
     int frec_min(999999999);
     int frec_max(-1);
-    int buckets = 1 << (4 * BUCKET_ID_WIDTH );
-    for (int i = 0; i < buckets; i++)
+    dreid::BucketIdList buckets = dreid::DiskHashTable::list_buckets(path, base);
+    if (buckets.empty())
+    {
+        std::cerr << path << " has no buckets for " << base << std::endl;
+        exit(2);
+    }
+    for (auto& bucket : buckets)
     {
-        char bucket[BUCKET_ID_WIDTH + 1];
-        std::sprintf(bucket, "%0*x", BUCKET_ID_WIDTH, i);
-
         std::string fspec = dreid::DiskHashTable::get_bucket_fspec(path, base, bucket);
-        if (!std::filesystem::exists(fspec))
+        int frec_cnt(0);
+        // An LSM bucket is its runs, oldest first, then its log. A key
+        // in an older source is shadowed by the newer copy, but a key
+        // twice in one source, or in two buckets, is a duplicate.
+        std::set<dreid::PositionPacked> in_bucket;
+        std::set<dreid::PositionPacked> in_source;
+        auto add = [&](const dreid::PositionPacked& pp)
         {
-            std::cerr << fspec << " does not exist" << std::endl;
-            exit(2);
+            if (!in_source.insert(pp).second)
+                dupe_cnt++;
+            else if (!in_bucket.insert(pp).second)
+                shadow_cnt++;
+            else if (!cache.insert(pp).second)
+                dupe_cnt++;
+            else
+                frec_cnt++;
+            if ((++rec_cnt % 1000) == 0 )
+                std::cout << fspec << ':' << cache.size() << ' ' << dupe_cnt << ' ' << frec_cnt << '\r' << std::flush;
+        };
+
+        const size_t rec_len(sizeof(dreid::PositionPacked) + sizeof(dreid::PosInfo));
+        std::vector<unsigned char> buff(RUN_BLOCK_RECS * rec_len);
+        for (auto& run_fspec : bucket_runs(fspec))
+        {
+            dreid::SortedRun run(run_fspec, sizeof(dreid::PositionPacked), sizeof(dreid::PosInfo));
+            if (!run.load())
+            {
+                std::cerr << "Error reading sorted run " << run_fspec << " - skipped" << std::endl;
+                continue;
+            }
+            in_source.clear();
+            for (size_t blk(0); blk < run.block_cnt(); ++blk)
+            {
+                size_t cnt = run.read_block(blk, buff.data());
+                for (size_t i(0); i < cnt; ++i)
+                {
+                    dreid::PositionPacked pp;
+                    std::memcpy(&pp, buff.data() + i * rec_len, sizeof(pp));
+                    add(pp);
+                }
+            }
         }
+
         std::FILE *fp = std::fopen( fspec.c_str(), "r" );
         if ( fp == nullptr )
         {
             std::cerr << "Error opening bucket file " << fspec << ' ' << errno << " - terminating" << std::endl;
             exit(errno);
         }
+        // a columnar bucket file holds just the keys
+        bool columnar = std::filesystem::exists(fspec + ".v");
         dreid::PositionPacked pp;
         dreid::PosInfo pi;
-        int frec_cnt(0);
+        in_source.clear();
         while (std::fread(&pp, sizeof(dreid::PositionPacked), 1, fp) == 1)
         {
-            std::fread(&pi, sizeof(dreid::PosInfo), 1, fp);
-            frec_cnt++;
-            if (cache.contains(pp))
-                dupe_cnt++;
-            else
-                cache.insert(pp);
-            if ((++rec_cnt % 1000) == 0 )
-                std::cout << fspec << ':' << cache.size() << ' ' << dupe_cnt << ' ' << frec_cnt << '\r' << std::flush;
+            if (!columnar)
+                std::fread(&pi, sizeof(dreid::PosInfo), 1, fp);
+            add(pp);
         }
         std::fclose(fp);
         std::cout << std::endl;
@@ -90,8 +155,889 @@ void command_verify(int argc, char **argv)
               << cache.size() << ' '
               << min_buck << ':' << frec_min << ' '
               << max_buck << ':' << frec_max << ' '
-              << (frec_max - frec_min)
-              << std::endl;
+              << (frec_max - frec_min);
+    if (dupe_cnt != 0 || shadow_cnt != 0)
+        std::cout << " duplicates " << dupe_cnt << " shadowed " << shadow_cnt;
+    std::cout << std::endl;
+}
+
+// work out the record layout of an existing table
+void table_layout(const std::string& root, int level, const std::string& base, size_t& key_len, size_t& val_len)
+{
+    std::stringstream ss;
+    ss << root << level << '/' << base << '/';
+    dreid::DhtManifestHeader hdr;
+    if (dreid::DiskHashTable::read_manifest_header(ss.str(), base, hdr))
+    {
+        key_len = hdr.key_len;
+        val_len = hdr.val_len;
+    }
+    else
+    {
+        // no manifest - the reference tables hold bare PosRefRec keys
+        bool is_ref = base.size() > 4 && base.substr(base.size() - 4) == "_ref";
+        key_len = (is_ref) ? sizeof(dreid::PosRefRec) : sizeof(dreid::PositionPacked);
+        val_len = (is_ref) ? 0 : sizeof(dreid::PosInfo);
+    }
+}
+
+// split the oversized buckets of an existing table
+void command_rehash(int argc, char **argv)
+{
+    if (argc < 5)
+        usage(argv[0]);
+
+    std::string root(argv[2]);
+    int level = std::atoi(argv[3]);
+    std::string base(argv[4]);
+    size_t key_len, val_len;
+    table_layout(root, level, base, key_len, val_len);
+
+    dreid::DiskHashTable dht;
+    dht.open(root, base, level, key_len, val_len);
+    if (argc > 5)
+        dht.set_split_threshold(std::atol(argv[5]));
+    size_t splits = dht.rehash();
+    std::cout << base << ": " << dht.size() << " records, "
+              << splits << " buckets split" << std::endl;
+}
+
+// Bucket size distribution, the biggest buckets, and (with probe_cnt)
+// the cost of probe_cnt searches for keys in the table and as many
+// for keys that aren't.
+void command_stats(int argc, char **argv)
+{
+    if (argc < 5)
+        usage(argv[0]);
+
+    std::string root(argv[2]);
+    int level = std::atoi(argv[3]);
+    std::string base(argv[4]);
+    size_t probe_cnt = (argc > 5) ? std::atol(argv[5]) : 0;
+    size_t key_len, val_len;
+    table_layout(root, level, base, key_len, val_len);
+
+    dreid::DiskHashTable dht;
+    dht.open(root, base, level, key_len, val_len);
+    std::vector<dreid::DhtBucketStats> buckets = dht.bucket_stats();
+    if (buckets.empty())
+    {
+        std::cerr << base << " has no buckets" << std::endl;
+        exit(2);
+    }
+
+    double mean = double(dht.size()) / buckets.size();
+    double var(0);
+    size_t runs(0);
+    for (auto& b : buckets)
+    {
+        var  += (b.rec_cnt - mean) * (b.rec_cnt - mean);
+        runs += b.run_cnt;
+    }
+    std::sort(buckets.begin(), buckets.end(), [](auto& a, auto& b) { return a.rec_cnt > b.rec_cnt; });
+    std::cout << base << ": " << dht.size() << " records in " << buckets.size() << " buckets";
+    if (runs != 0)
+        std::cout << " (" << runs << " sorted runs)";
+    std::cout << '\n'
+              << "bucket records: min " << buckets.back().rec_cnt
+              << " max " << buckets.front().rec_cnt
+              << " mean " << mean
+              << " stddev " << std::sqrt(var / buckets.size()) << '\n'
+              << "size histogram (records: buckets)\n";
+    std::vector<size_t> hist = dht.size_histogram();
+    for (size_t i(0); i < hist.size(); ++i)
+        if (hist[i] != 0)
+            std::cout << "  " << (i == 0 ? 0 : (1UL << i)) << '-' << (2UL << i) - 1 << ": " << hist[i] << '\n';
+    std::cout << "largest buckets\n";
+    for (size_t i(0); i < buckets.size() && i < 10; ++i)
+        std::cout << "  " << buckets[i].id << ": " << buckets[i].rec_cnt << '\n';
+
+    if (probe_cnt != 0)
+    {
+        // sample evenly spaced keys, then make absent ones by flipping a bit
+        std::vector<unsigned char> keys;
+        size_t step = std::max(dht.size() / probe_cnt, (size_t)1);
+        size_t seen(0);
+        dht.for_each_block([&](dreid::ucharptr_c recs, size_t cnt)
+        {
+            for (size_t i(0); i < cnt; ++i, ++seen)
+                if (seen % step == 0 && keys.size() < probe_cnt * key_len)
+                    keys.insert(keys.end(), recs + i * (key_len + val_len), recs + i * (key_len + val_len) + key_len);
+        });
+        size_t hit_cnt = keys.size() / key_len;
+        for (size_t i(0); i < hit_cnt; ++i)
+        {
+            keys.insert(keys.end(), keys.begin() + i * key_len, keys.begin() + (i + 1) * key_len);
+            keys[keys.size() - 1] ^= 0x80;
+        }
+        std::vector<unsigned char> val(val_len + 1);
+        dht.reset_stats();
+        for (size_t i(0); i < keys.size() / key_len; ++i)
+            dht.search(keys.data() + i * key_len, val.data());
+        dreid::DhtStats st = dht.stats();
+        double n = std::max(st.searches, (uint64_t)1);
+        std::cout << "probes: " << st.searches << " searches, " << st.hits << " hits, " << st.misses << " misses\n"
+                  << "  per search: " << st.recs_compared / n << " records compared, "
+                  << st.bytes_read / n << " bytes read, "
+                  << st.run_probes / n << " runs probed, "
+                  << st.bloom_skips / n << " runs skipped\n"
+                  << "  file opens " << st.opens << ", lock waits " << st.lock_waits
+                  << " (" << st.lock_wait_ns / 1000000.0 << " ms)\n";
+    }
+    std::cout << std::flush;
+}
+
+// copy the files of a table whose names pass keep to dir
+void copy_files(const std::string& from, const std::string& to, bool (*keep)(const std::string&))
+{
+    std::filesystem::create_directories(to);
+    for (auto& entry : std::filesystem::directory_iterator(from))
+        if (keep(entry.path().filename().string()))
+            std::filesystem::copy_file(entry.path(), to + entry.path().filename().string(),
+                                       std::filesystem::copy_options::overwrite_existing);
+}
+
+bool is_log(const std::string& fname)
+{
+    return fname.find('.') == std::string::npos;
+}
+
+bool is_run(const std::string& fname)
+{
+    return fname.find(".r") != std::string::npos;
+}
+
+// every key 0..cnt-1 is found with its id and distance, and iterating
+// the table gives each of them exactly once
+void check_table(dreid::dht<dreid::PositionPacked, dreid::PosInfo>& dht, int cnt, int odd_distance)
+{
+    dreid::PositionPacked pp;
+    dreid::PosInfo pi;
+    std::memset(&pp, 0x00, sizeof(pp));
+    assert(dht.size() == (size_t)cnt);
+    for (int i = 0; i < cnt; ++i)
+    {
+        pp.lo = i;
+        assert(dht.search(pp, pi));
+        assert(pi.id == (uint32_t)i);
+        assert(pi.distance == ((i & 1) ? odd_distance : 0));
+    }
+    pp.lo = cnt;
+    assert(!dht.search(pp, pi));
+    std::set<uint64_t> seen;
+    dht.parallel_for_each([&](dreid::PositionPacked& k, dreid::PosInfo& v)
+    {
+        static std::mutex mtx;
+        std::lock_guard<std::mutex> lock(mtx);
+        assert(seen.insert(k.lo).second);
+    }, 4);
+    assert(seen.size() == (size_t)cnt);
+}
+
+// LSM tables - records survive compaction, merging and reopening, and
+// what is left of a compaction or merge cut short by a crash is dropped
+void test_lsm()
+{
+    typedef dreid::dht<dreid::PositionPacked, dreid::PosInfo> table_t;
+    const std::string root("/home/codefool/tmp/");
+    const std::string dir(root + "889/lsm/");
+    const std::string save(root + "889/save/");
+    const int cnt(20000);
+    dreid::PositionPacked pp;
+    dreid::PosInfo pi;
+    std::memset(&pp, 0x00, sizeof(pp));
+    std::memset(&pi, 0x00, sizeof(pi));
+    std::filesystem::remove_all(root + "889");
+
+    auto add = [&](table_t& dht, int from, int to)
+    {
+        for (int i = from; i < to; ++i)
+        {
+            pp.lo = pi.id = i;
+            pi.distance = 0;
+            assert(dht.insert(pp, pi));
+        }
+        // odd records are updated
+        for (int i = from | 1; i < to; i += 2)
+        {
+            pp.lo = pi.id = i;
+            pi.distance = 7;
+            assert(dht.update(pp, pi));
+        }
+    };
+
+    // compaction only runs when asked to
+    BeginDummyScope
+        table_t dht;
+        dht.set_storage_mode(dreid::DHT_STORAGE_LSM);
+        dht.set_lsm_options(1024*1024, 1, 10);
+        dht.open(root, "lsm", 889);
+        add(dht, 0, cnt / 2);
+        dht.flush();
+        check_table(dht, cnt / 2, 7);
+        // the logs are compacted into runs, but are back on reopen as
+        // if we died before truncating them
+        copy_files(dir, save, is_log);
+        assert(dht.compact());
+        check_table(dht, cnt / 2, 7);
+    EndDummyScope
+    std::filesystem::remove(dir + "lsm.mf");
+    copy_files(save, dir, is_log);
+    std::filesystem::remove_all(save);
+
+    BeginDummyScope
+        table_t dht;
+        dht.open(root, "lsm", 889);
+        assert(dht.storage_mode() == dreid::DHT_STORAGE_LSM);
+        check_table(dht, cnt / 2, 7);
+        // the runs are merged into one, but the old ones are back on
+        // reopen as if we died before removing them
+        copy_files(dir, save, is_run);
+        add(dht, cnt / 2, cnt);
+        assert(dht.compact());
+        check_table(dht, cnt, 7);
+    EndDummyScope
+    std::filesystem::remove(dir + "lsm.mf");
+    copy_files(save, dir, is_run);
+
+    BeginDummyScope
+        table_t dht;
+        dht.open(root, "lsm", 889);
+        check_table(dht, cnt, 7);
+    EndDummyScope
+    // and from the manifest
+    BeginDummyScope
+        table_t dht;
+        dht.open(root, "lsm", 889);
+        check_table(dht, cnt, 7);
+    EndDummyScope
+    std::filesystem::remove_all(root + "889");
+    std::cout << "lsm ok" << std::endl;
+}
+
+// buckets by the key's first bytes, as hex
+std::string key_hasher(dreid::ucharptr_c key, size_t keylen)
+{
+    std::stringstream ss;
+    ss << std::hex << std::setfill('0');
+    for (size_t i = 0; i < keylen && i < 8; ++i)
+        ss << std::setw(2) << (int)key[i];
+    return ss.str();
+}
+
+// a table only opens with the hasher it was built with
+void test_hasher()
+{
+    typedef dreid::dht<dreid::PositionPacked, dreid::PosInfo> table_t;
+    const std::string root("/home/codefool/tmp/");
+    dreid::PositionPacked pp;
+    dreid::PosInfo pi;
+    std::memset(&pp, 0x00, sizeof(pp));
+    std::memset(&pi, 0x00, sizeof(pi));
+    std::filesystem::remove_all(root + "891");
+    BeginDummyScope
+        table_t dht;
+        assert(!dht.set_hasher(key_hasher, ""));
+        assert(!dht.set_hasher(key_hasher, "seventeen chars.."));
+        assert(dht.set_hasher(key_hasher, "key"));
+        assert(dht.open(root, "hasher", 891));
+        for (int i = 0; i < 1000; ++i)
+        {
+            pp.lo = pi.id = i;
+            assert(dht.insert(pp, pi));
+        }
+    EndDummyScope
+    BeginDummyScope
+        table_t dht;
+        assert(!dht.open(root, "hasher", 891));
+    EndDummyScope
+    BeginDummyScope
+        table_t dht;
+        dht.set_hasher(key_hasher, "key");
+        assert(dht.open(root, "hasher", 891));
+        assert(dht.size() == 1000);
+        pp.lo = 999;
+        assert(dht.search(pp, pi) && pi.id == 999);
+    EndDummyScope
+    std::filesystem::remove_all(root + "891");
+    std::cout << "hasher ok" << std::endl;
+}
+
+// Columnar tables - records are found, updated by key and by handle,
+// split, iterated and reopened with keys and values in separate files
+void test_columns()
+{
+    typedef dreid::dht<dreid::PositionPacked, dreid::PosInfo> table_t;
+    const std::string root("/home/codefool/tmp/");
+    const std::string dir(root + "894/col/");
+    const int cnt(20000);
+    const size_t split_recs(12);
+    dreid::PositionPacked pp;
+    dreid::PosInfo pi;
+    std::memset(&pp, 0x00, sizeof(pp));
+    std::memset(&pi, 0x00, sizeof(pi));
+    std::filesystem::remove_all(root + "894");
+    BeginDummyScope
+        table_t dht;
+        dht.set_storage_mode(dreid::DHT_STORAGE_COLUMNS);
+        dht.set_split_threshold(split_recs);
+        dht.open(root, "col", 894);
+        std::vector<dreid::DiskHashTable::Handle> handles(cnt);
+        for (int i = 0; i < cnt; ++i)
+        {
+            pp.lo = pi.id = i;
+            pi.distance = 0;
+            assert(dht.insert_or_get(pp, pi, handles[i]));
+        }
+        // odd records are updated, every other one through its handle -
+        // which goes stale if its bucket has split since
+        size_t by_handle(0);
+        for (int i = 1; i < cnt; i += 2)
+        {
+            pp.lo = pi.id = i;
+            pi.distance = 7;
+            if (i % 4 == 3 && dht.update(handles[i], pi))
+                by_handle++;
+            else
+                assert(dht.update(pp, pi));
+        }
+        assert(by_handle > 0 && by_handle < (size_t)cnt / 4);
+        size_t split_cnt(0);
+        for (auto& b : dht.bucket_stats())
+        {
+            assert(b.rec_cnt <= split_recs);
+            split_cnt += b.id.size() > BUCKET_ID_WIDTH;
+        }
+        assert(split_cnt > 0);
+        check_table(dht, cnt, 7);
+        assert(dht.flush());
+        check_table(dht, cnt, 7);
+    EndDummyScope
+    // every bucket has its value file, and nothing is left of the splits
+    size_t keys(0), vals(0);
+    for (auto& entry : std::filesystem::directory_iterator(dir))
+    {
+        std::string fname = entry.path().filename().string();
+        if (fname.ends_with(".v"))
+            vals += entry.file_size();
+        else if (is_log(fname))
+            keys += entry.file_size();
+    }
+    assert(keys == cnt * sizeof(dreid::PositionPacked));
+    assert(vals == cnt * sizeof(dreid::PosInfo));
+    // from the manifest, and by scanning the buckets
+    for (bool manifest : { true, false })
+    {
+        if (!manifest)
+            std::filesystem::remove(dir + "col.mf");
+        table_t dht;
+        dht.open(root, "col", 894);
+        assert(dht.storage_mode() == dreid::DHT_STORAGE_COLUMNS);
+        check_table(dht, cnt, 7);
+    }
+    std::filesystem::remove_all(root + "894");
+    std::cout << "columns ok" << std::endl;
+}
+
+// Records are updated in place through the handle insert_or_get gives
+// back, until a split, compaction or reopen moves them. From then on
+// the handle update fails, changes nothing, and an update by key does
+// the job.
+void test_handles()
+{
+    typedef dreid::dht<dreid::PositionPacked, dreid::PosInfo> table_t;
+    typedef dreid::DiskHashTable::Handle handle_t;
+    const std::string root("/home/codefool/tmp/");
+    const int cnt(2000);
+    std::vector<handle_t> handles(cnt);
+    dreid::PositionPacked pp;
+    dreid::PosInfo pi;
+    std::memset(&pp, 0x00, sizeof(pp));
+    std::memset(&pi, 0x00, sizeof(pi));
+    std::filesystem::remove_all(root + "895");
+
+    auto distance = [&](table_t& dht, int i)
+    {
+        pp.lo = i;
+        assert(dht.search(pp, pi) && pi.id == (uint32_t)i);
+        return pi.distance;
+    };
+    auto insert = [&](table_t& dht, int from, int to)
+    {
+        for (int i = from; i < to; ++i)
+        {
+            pp.lo = pi.id = i;
+            pi.distance = 0;
+            assert(dht.insert_or_get(pp, pi, handles[i]));
+        }
+        // already there - the record is handed back instead
+        pp.lo = from;
+        pi.id = 0;
+        assert(!dht.insert_or_get(pp, pi, handles[from]) && pi.id == (uint32_t)from);
+    };
+    // update records from..to-1 to dist through their handles, or by key
+    // where the handle has gone stale. Returns how many went stale.
+    auto update = [&](table_t& dht, int from, int to, short dist)
+    {
+        size_t stale(0);
+        for (int i = from; i < to; ++i)
+        {
+            short before = distance(dht, i);
+            pi.distance = dist;
+            if (!dht.update(handles[i], pi))
+            {
+                stale++;
+                assert(distance(dht, i) == before);
+                pp.lo = pi.id = i;
+                pi.distance = dist;
+                assert(dht.update(pp, pi));
+            }
+            assert(distance(dht, i) == dist);
+        }
+        return stale;
+    };
+
+    BeginDummyScope
+        table_t dht;
+        dht.open(root, "log", 895);
+        insert(dht, 0, cnt);
+        assert(update(dht, 0, cnt, 1) == 0);    // buffered
+        assert(dht.flush());
+        assert(update(dht, 0, cnt, 2) == 0);    // on file
+        dht.set_split_threshold(1);
+        assert(dht.rehash() > 0);
+        size_t stale = update(dht, 0, cnt, 3);
+        assert(stale > 0 && stale < (size_t)cnt);
+        assert(update(dht, 0, cnt, 4) == stale);
+    EndDummyScope
+    // a handle doesn't outlive its table
+    BeginDummyScope
+        table_t dht;
+        dht.open(root, "log", 895);
+        assert(update(dht, 0, cnt, 5) == (size_t)cnt);
+    EndDummyScope
+
+    BeginDummyScope
+        table_t dht;
+        dht.set_storage_mode(dreid::DHT_STORAGE_LSM);
+        dht.set_lsm_options(1024*1024, 1, 10);
+        dht.open(root, "lsm", 895);
+        insert(dht, 0, cnt / 2);
+        assert(update(dht, 0, cnt / 2, 1) == 0);
+        assert(dht.compact());
+        assert(update(dht, 0, cnt / 2, 2) == (size_t)cnt / 2);
+        // the log the key updates went to is compacted, and the two runs merged
+        insert(dht, cnt / 2, cnt);
+        assert(update(dht, cnt / 2, cnt, 1) == 0);
+        assert(dht.compact());
+        assert(update(dht, 0, cnt, 3) == (size_t)cnt);
+        for (int i = 0; i < cnt; ++i)
+            assert(distance(dht, i) == 3);
+        assert(dht.size() == (size_t)cnt);
+    EndDummyScope
+    std::filesystem::remove_all(root + "895");
+    std::cout << "handles ok" << std::endl;
+}
+
+// The cache answers from memory or the table, spills its oldest
+// records once over budget, and leaves every record in the table, once,
+// when it is spilled
+void test_cache()
+{
+    typedef dreid::dht<dreid::PositionPacked, dreid::PosInfo> table_t;
+    const std::string root("/home/codefool/tmp/");
+    const int cnt(20000);
+    dreid::PositionPacked pp;
+    dreid::PosInfo pi;
+    std::memset(&pp, 0x00, sizeof(pp));
+    std::memset(&pi, 0x00, sizeof(pi));
+    std::filesystem::remove_all(root + "896");
+    BeginDummyScope
+        table_t dht;
+        dht.open(root, "cache", 896);
+        // room for about a quarter of the records
+        dreid::dht_cache<dreid::PositionPacked, dreid::PosInfo> cache(dht, cnt / 4 * 100);
+        for (int i = 0; i < cnt; ++i)
+        {
+            pp.lo = pi.id = i;
+            pi.distance = 0;
+            assert(cache.insert_or_get(pp, pi));
+        }
+        dreid::DhtCacheStats st = cache.stats();
+        assert(st.inserts == (uint64_t)cnt && st.spills > 0);
+        assert(st.size <= st.capacity && st.size + dht.size() == (size_t)cnt);
+        assert(cache.size() == (size_t)cnt);
+        // each key is already there, cached or spilled
+        for (int i = 0; i < cnt; ++i)
+        {
+            pp.lo = i;
+            pi.id = 0;
+            assert(!cache.insert_or_get(pp, pi) && pi.id == (uint32_t)i);
+        }
+        st = cache.stats();
+        assert(st.hits > 0 && st.misses > (uint64_t)cnt);
+        // odd records are updated, wherever they are
+        for (int i = 1; i < cnt; i += 2)
+        {
+            pp.lo = pi.id = i;
+            pi.distance = 7;
+            assert(cache.update(pp, pi));
+        }
+        std::vector<dreid::PositionPacked> keys(cnt + 1, pp);
+        std::vector<dreid::PosInfo> vals(cnt + 1);
+        for (int i = 0; i <= cnt; ++i)
+            keys[i].lo = i;
+        dreid::FoundList found;
+        assert(cache.search_many(keys, vals, found) == (size_t)cnt);
+        for (int i = 0; i < cnt; ++i)
+            assert(found[i] && vals[i].id == (uint32_t)i && vals[i].distance == ((i & 1) ? 7 : 0));
+        assert(!found[cnt]);
+        assert(cache.spill());
+        assert(cache.cached() == 0);
+        check_table(dht, cnt, 7);
+    EndDummyScope
+    BeginDummyScope
+        table_t dht;
+        dht.open(root, "cache", 896);
+        check_table(dht, cnt, 7);
+    EndDummyScope
+    std::filesystem::remove_all(root + "896");
+    std::cout << "cache ok" << std::endl;
+}
+
+// tiers that fall out of the window go to cold archives, which are
+// still searched and shadowed by updates, and a table from before tiers
+// is archived on open
+void test_tiers()
+{
+    typedef dreid::dht_tiers<dreid::PositionPacked, dreid::PosInfo> tiers_t;
+    const std::string root("/home/codefool/tmp/");
+    const std::string cold(root + "897/tiers_cold/");
+    const int tiers(6);
+    const int cnt(3000);     // records per tier
+    dreid::PositionPacked pp;
+    dreid::PosInfo pi;
+    std::memset(&pp, 0x00, sizeof(pp));
+    std::memset(&pi, 0x00, sizeof(pi));
+    std::filesystem::remove_all(root + "897");
+    auto check = [&](tiers_t& t, int bumped)
+    {
+        for (int i = 0; i < tiers * cnt; ++i)
+        {
+            pp.lo = i;
+            assert(t.search(pp, pi) && pi.id == (uint32_t)i);
+            assert(pi.distance == i / cnt + ((i == bumped) ? 100 : 0));
+        }
+        pp.lo = tiers * cnt;
+        assert(!t.search(pp, pi));
+    };
+    BeginDummyScope
+        tiers_t t(3);
+        assert(t.open(root, "tiers", 897));
+        for (int tier = 0; tier < tiers; ++tier)
+        {
+            assert(t.set_tier(tier));
+            for (int i = 0; i < cnt; ++i)
+            {
+                pp.lo = pi.id = tier * cnt + i;
+                pi.distance = tier;
+                assert(t.insert(pp, pi));
+            }
+        }
+        // the three oldest tiers are cold, and their tables gone
+        dreid::DhtTierStats st = t.stats();
+        assert(st.hot_tiers == 3 && st.cold_runs == 3);
+        for (int tier = 0; tier < tiers; ++tier)
+        {
+            char name[16];
+            std::sprintf(name, "tiers_t%04d", tier);
+            assert(std::filesystem::exists(root + "897/" + name) == (tier >= 3));
+            std::sprintf(name, "t%d.0", tier);
+            assert(std::filesystem::exists(cold + name) == (tier < 3));
+        }
+        check(t, -1);
+        st = t.stats();
+        assert(st.cold_hits >= (uint64_t)3 * cnt);
+        // a cold record is shadowed by its update in the current tier
+        pp.lo = 5;
+        assert(t.search(pp, pi));
+        pi.distance += 100;
+        assert(t.update(pp, pi));
+        check(t, 5);
+        assert(t.size() == (size_t)tiers * cnt + 1);
+    EndDummyScope
+    for (auto& entry : std::filesystem::directory_iterator(cold))
+        assert(entry.path().extension() != ".tmp");
+    BeginDummyScope
+        tiers_t t(3);
+        assert(t.open(root, "tiers", 897));
+        assert(t.tier() == tiers - 1 && t.stats().cold_runs == 3);
+        check(t, 5);
+    EndDummyScope
+
+    BeginDummyScope
+        dreid::dht<dreid::PositionPacked, dreid::PosInfo> dht;
+        dht.open(root, "legacy", 897);
+        for (int i = 0; i < cnt; ++i)
+        {
+            pp.lo = pi.id = i;
+            assert(dht.insert(pp, pi));
+        }
+    EndDummyScope
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        tiers_t t(3);
+        assert(t.open(root, "legacy", 897));
+        assert(!std::filesystem::exists(root + "897/legacy"));
+        assert(std::filesystem::exists(root + "897/legacy_cold/t-1.0"));
+        for (int i = 0; i < cnt; ++i)
+        {
+            pp.lo = i;
+            assert(t.search(pp, pi) && pi.id == (uint32_t)i);
+        }
+        assert(t.stats().cold_hits == (uint64_t)cnt);
+    }
+    std::filesystem::remove_all(root + "897");
+    std::cout << "tiers ok" << std::endl;
+}
+
+// a split threshold set before open() holds
+void test_split_threshold()
+{
+    const std::string root("/home/codefool/tmp/");
+    dreid::PositionPacked pp;
+    dreid::PosInfo pi;
+    std::memset(&pp, 0x00, sizeof(pp));
+    std::memset(&pi, 0x00, sizeof(pi));
+    std::filesystem::remove_all(root + "892");
+    BeginDummyScope
+        dreid::dht<dreid::PositionPacked, dreid::PosInfo> dht;
+        dht.set_split_threshold(4);
+        dht.open(root, "split", 892);
+        for (int i = 0; i < 20000; ++i)
+        {
+            pp.lo = pi.id = i;
+            assert(dht.insert(pp, pi));
+        }
+        for (auto& b : dht.bucket_stats())
+            assert(b.rec_cnt <= 4);
+    EndDummyScope
+    std::filesystem::remove_all(root + "892");
+    std::cout << "split ok" << std::endl;
+}
+
+// compress and decompress buf, which must come back as it went in
+void round_trip(const std::vector<uint8_t>& buf)
+{
+    std::vector<uint8_t> packed(dreid::lz4::compress_bound(buf.size()));
+    std::vector<uint8_t> out(buf.size() + 1);
+    size_t len = dreid::lz4::compress(buf.data(), buf.size(), packed.data(), packed.size());
+    assert(len > 0 && len <= packed.size());
+    assert(dreid::lz4::decompress(packed.data(), len, out.data(), buf.size()) == (ssize_t)buf.size());
+    assert(std::equal(buf.begin(), buf.end(), out.begin()));
+    // no room
+    assert(dreid::lz4::compress(buf.data(), buf.size(), packed.data(), packed.size() - 1) == 0);
+    if (buf.empty())
+        return;
+    assert(dreid::lz4::decompress(packed.data(), len, out.data(), buf.size() - 1) == -1);
+    // a block cut short never decodes to the whole thing
+    for (size_t n = 0; n < len; n += 1 + n / 64)
+        assert(dreid::lz4::decompress(packed.data(), n, out.data(), out.size()) < (ssize_t)buf.size());
+}
+
+// The LZ4 codec and record transforms give back what they were given,
+// and a damaged block fails instead of overrunning
+void test_codec()
+{
+    std::mt19937_64 rng(0x1234);
+    std::vector<uint8_t> buf;
+    round_trip(buf);
+    for (size_t n : { 1, 4, 12, 13, 100, 1000, 70000, 300000 })
+    {
+        buf.assign(n, 0x00);
+        round_trip(buf);
+        for (auto& b : buf)
+            b = rng();
+        round_trip(buf);
+        // repeats at every distance up to past the 64K window
+        for (size_t i = 0; i < n; ++i)
+            buf[i] = (i % 7 == 0) ? rng() : buf[i / 2];
+        round_trip(buf);
+    }
+
+    // garbage
+    std::vector<uint8_t> out(1 << 16);
+    for (int i = 0; i < 10000; ++i)
+    {
+        buf.resize(rng() % 256);
+        for (auto& b : buf)
+            b = rng();
+        ssize_t len = dreid::lz4::decompress(buf.data(), buf.size(), out.data(), out.size());
+        assert(len >= -1 && len <= (ssize_t)out.size());
+    }
+
+    // sorted records
+    const size_t rec_len(sizeof(dreid::PositionPacked) + sizeof(dreid::PosInfo));
+    const size_t rec_cnt(1000);
+    std::vector<uint64_t> keys(rec_cnt);
+    for (auto& k : keys)
+        k = rng() >> 20;
+    std::sort(keys.begin(), keys.end());
+    std::vector<uint8_t> recs(rec_cnt * rec_len), work, shuffled(recs.size());
+    for (size_t i = 0; i < rec_cnt; ++i)
+        std::memcpy(&recs[i * rec_len + sizeof(dreid::PositionPacked) - sizeof(uint64_t)], &keys[i], sizeof(uint64_t));
+    work = recs;
+    dreid::lz4::delta_encode(work.data(), rec_cnt, rec_len, sizeof(dreid::PositionPacked));
+    dreid::lz4::shuffle(work.data(), shuffled.data(), rec_cnt, rec_len);
+    round_trip(shuffled);
+    dreid::lz4::unshuffle(shuffled.data(), work.data(), rec_cnt, rec_len);
+    dreid::lz4::delta_decode(work.data(), rec_cnt, rec_len, sizeof(dreid::PositionPacked));
+    assert(work == recs);
+    std::cout << "lz4 ok" << std::endl;
+}
+
+// bytes in the sorted runs of a table
+uintmax_t run_bytes(const std::string& dir)
+{
+    uintmax_t bytes(0);
+    for (auto& entry : std::filesystem::recursive_directory_iterator(dir))
+        if (entry.is_regular_file() && is_run(entry.path().filename().string()))
+            bytes += entry.file_size();
+    return bytes;
+}
+
+// How much smaller LZ4 makes the runs of a table of real positions -
+// everything up to four moves in from the opening position.
+void measure_run_compression()
+{
+    typedef dreid::dht<dreid::PositionPacked, dreid::PosInfo> table_t;
+    const std::string root("/home/codefool/tmp/");
+    dreid::PosMap positions, next;
+    dreid::PosInfo pi;
+    dreid::Board board;
+    positions[board.get_packed()] = pi;
+    dreid::PositionId id(0);
+    for (int ply = 0; ply < 4; ++ply)
+    {
+        for (auto& [pp, pi] : positions)
+        {
+            dreid::Board b(pp);
+            dreid::Side s = b.gi().getOnMove();
+            dreid::MoveList moves;
+            b.get_all_moves(s, moves);
+            for (dreid::MovePtr mv : moves)
+            {
+                dreid::Board prime(pp);
+                prime.process_move(mv, s);
+                prime.getPosition().gi().toggleOnMove();
+                dreid::PosInfo prime_pi(++id, pi, mv->pack());
+                prime_pi.distance = ply + 1;
+                next.emplace(prime.get_packed(), prime_pi);
+            }
+        }
+        positions.insert(next.begin(), next.end());
+        next.clear();
+    }
+
+    uintmax_t bytes[2];
+    for (bool lz4 : { false, true })
+    {
+        std::filesystem::remove_all(root + "890");
+        table_t dht;
+        dht.set_storage_mode(dreid::DHT_STORAGE_LSM);
+        dht.set_lsm_options(1024*1024, 1, 10);
+        dht.set_run_compression(lz4);
+        dht.open(root, "ratio", 890);
+        for (auto& [pp, pi] : positions)
+        {
+            dreid::PositionPacked key(pp);
+            dreid::PosInfo val(pi);
+            assert(dht.insert(key, val));
+        }
+        assert(dht.compact());
+        bytes[lz4] = run_bytes(root + "890/");
+    }
+    std::filesystem::remove_all(root + "890");
+    std::cout << positions.size() << " positions: runs "
+              << bytes[0] << " bytes raw, " << bytes[1] << " bytes lz4 ("
+              << std::fixed << std::setprecision(2) << (double)bytes[0] / bytes[1] << "x)" << std::endl;
+}
+
+// The async search and append give the same answers as search_many and
+// insert_many, on the io_uring and on the pread/pwrite fallback, for log
+// and columnar tables, before and after the buffers are flushed
+void test_async()
+{
+    typedef dreid::dht<dreid::PositionPacked, dreid::PosInfo> table_t;
+    const std::string root("/home/codefool/tmp/");
+    const int cnt(20000), batch(1000);
+    std::vector<dreid::PositionPacked> keys(cnt), q(3 * cnt);
+    std::vector<dreid::PosInfo> vals(cnt), a_vals(q.size()), s_vals(q.size());
+    for (int i = 0; i < cnt; ++i)
+    {
+        std::memset(&keys[i], 0x00, sizeof(keys[i]));
+        std::memset(&vals[i], 0x00, sizeof(vals[i]));
+        keys[i].lo = 3 * i;     // misses in between
+        vals[i].id = i;
+    }
+    for (size_t i = 0; i < q.size(); ++i)
+    {
+        std::memset(&q[i], 0x00, sizeof(q[i]));
+        q[i].lo = (i * 7919) % q.size();
+    }
+
+    auto compare = [&](dreid::AsyncIO& aio, table_t& a, table_t& s)
+    {
+        dreid::FoundList a_found, s_found;
+        size_t hits = a.search_many_async(aio, q, a_vals, a_found);
+        assert(hits == s.search_many(q, s_vals, s_found));
+        assert(hits == (size_t)cnt);
+        for (size_t i = 0; i < q.size(); ++i)
+        {
+            assert(a_found[i] == s_found[i]);
+            assert(a_found[i] == (q[i].lo % 3 == 0));
+            assert(!a_found[i] || (a_vals[i].id == q[i].lo / 3 && a_vals[i] == s_vals[i]));
+        }
+        assert(aio.pending() == 0);
+    };
+
+    for (bool ring : { true, false })
+    {
+        for (auto mode : { dreid::DHT_STORAGE_LOG, dreid::DHT_STORAGE_COLUMNS })
+        {
+            std::filesystem::remove_all(root + "893");
+            dreid::AsyncIO aio(16, ring);
+            assert(aio.uring() || !ring);
+            BeginDummyScope
+                table_t a, s;
+                a.set_storage_mode(mode);
+                s.set_storage_mode(mode);
+                a.open(root, "async", 893);
+                s.open(root, "sync", 893);
+                dreid::FoundList inserted;
+                for (int i = 0; i < cnt; i += batch)
+                {
+                    std::span<const dreid::PositionPacked> k(keys.data() + i, batch);
+                    assert(a.append_many_async(aio, k, std::span<const dreid::PosInfo>(vals.data() + i, batch)) == (size_t)batch);
+                    std::vector<dreid::PosInfo> v(vals.begin() + i, vals.begin() + i + batch);
+                    assert(s.insert_many(k, v, inserted) == (size_t)batch);
+                }
+                assert(a.size() == (size_t)cnt);
+                compare(aio, a, s);
+                assert(a.flush() && s.flush());
+                compare(aio, a, s);
+            EndDummyScope
+            BeginDummyScope
+                table_t a, s;
+                a.open(root, "async", 893);
+                s.open(root, "sync", 893);
+                assert(a.storage_mode() == mode);
+                compare(aio, a, s);
+            EndDummyScope
+        }
+    }
+    std::filesystem::remove_all(root + "893");
+    std::cout << "async ok" << std::endl;
 }
 
 void command_test(int argc, char **argv)
@@ -107,6 +1053,7 @@ void command_test(int argc, char **argv)
     dreid::DiskHashTable dht;
     std::memset(&i_pp, 0x00, sizeof(dreid::PositionPacked));
     std::memset(&i_pi, 0x00, sizeof(dreid::PosInfo));
+    std::filesystem::remove_all("/home/codefool/tmp/888");
     dht.open("/home/codefool/tmp/", "temp", 888, sizeof(dreid::PositionPacked), sizeof(dreid::PosInfo));
     for (int i = 0; i < 10000; ++i)
     {
@@ -122,6 +1069,16 @@ void command_test(int argc, char **argv)
         assert(found == true);
         assert(o_pi == i_pi);
     }
+    test_lsm();
+    test_hasher();
+    test_split_threshold();
+    test_columns();
+    test_handles();
+    test_cache();
+    test_tiers();
+    test_async();
+    test_codec();
+    measure_run_compression();
 }
 
 int main(int argc, char **argv)
@@ -132,6 +1089,10 @@ int main(int argc, char **argv)
     std::string cmd = argv[1];
     if ( cmd == "verify" )
         command_verify(argc, argv);
+    else if (cmd == "rehash" )
+        command_rehash(argc, argv);
+    else if (cmd == "stats" )
+        command_stats(argc, argv);
     else if (cmd == "test" )
         command_test(argc, argv);
     else
@@ -1,5 +1,30 @@
+//
+// DiskQueue utility - push and pop a test queue, or test DiskQueue
+//
 #include <iostream>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include "dreid.h"
 #include "dq.h"
+#include "dq_front.h"
+
+void usage(std::string prog)
+{
+    std::cout << "DiskQueue Utility\n"
+              << "usage:\n"
+              << '\t' << prog << "        push and pop a test queue, printing what is popped\n"
+              << '\t' << prog << " test   test DiskQueue\n"
+              << std::endl;
+    exit(1);
+}
 
 struct Data
 {
@@ -7,7 +32,7 @@ struct Data
     int b;
 };
 
-int main(int argc, char **argv)
+void command_run()
 {
     dreid::DiskQueue dq("/home/codefool/tmp", "testqueue", sizeof(Data));
     Data d;
@@ -24,5 +49,344 @@ int main(int argc, char **argv)
     }
     while( dq.pop((dreid::dq_data_t)&d) )
         std::cout << d.a << ' ' << d.b << std::endl;
+}
+
+const std::string TEST_PATH("/home/codefool/tmp/dqtest");
+
+// big enough that a test crosses blocks without taking all day. The
+// fill is made from seq, so a damaged record shows.
+struct TestRec
+{
+    uint64_t seq;
+    uint64_t key;
+    uint64_t fill[126];
+};
+
+void make_rec(TestRec& r, uint64_t seq)
+{
+    r.seq = seq;
+    r.key = ( seq * 0x9e3779b97f4a7c15ULL ) >> 8;
+    for (size_t i(0); i < sizeof(r.fill) / sizeof(r.fill[0]); ++i)
+        r.fill[i] = seq * 31 + i / 8;
+}
+
+uint64_t rec_key(const unsigned char *rec)
+{
+    uint64_t key;
+    std::memcpy(&key, rec + offsetof(TestRec, key), sizeof(key));
+    return key;
+}
+
+dreid::DiskQueue *open_queue(const std::string& name, dreid::DqMode mode, bool sorted)
+{
+    dreid::DiskQueue *q = new dreid::DiskQueue(TEST_PATH, name, sizeof(TestRec), mode);
+    if (sorted)
+        q->set_sort_key(rec_key);
+    return q;
+}
+
+// what went into or came out of a queue
+struct Tally
+{
+    uint64_t cnt = 0;
+    uint64_t sum = 0;
+    uint64_t mix = 0;
+
+    void add(uint64_t seq)
+    {
+        cnt++;
+        sum += seq;
+        mix ^= seq * 0x9e3779b97f4a7c15ULL;
+    }
+    bool operator==(const Tally&) const = default;
+};
+
+// push records from..to-1, a few at a time
+void push_recs(dreid::DiskQueue& q, uint64_t from, uint64_t to, Tally& in)
+{
+    std::vector<TestRec> recs(100);
+    while (from < to)
+    {
+        size_t n = std::min(to - from, (uint64_t)recs.size());
+        for (size_t i(0); i < n; ++i)
+        {
+            make_rec(recs[i], from + i);
+            in.add(from + i);
+        }
+        q.push_n((dreid::dq_data_t)recs.data(), n);
+        from += n;
+    }
+}
+
+// pop up to max records, checking each one, and that they come in order
+// from next if fifo is set. Returns the number popped.
+uint64_t pop_recs(dreid::DiskQueue& q, uint64_t max, Tally& out, uint64_t& next, bool fifo)
+{
+    std::vector<TestRec> recs(100);
+    TestRec want;
+    uint64_t cnt(0);
+    while (cnt < max)
+    {
+        size_t n = q.pop_n((dreid::dq_data_t)recs.data(), std::min(max - cnt, (uint64_t)recs.size()));
+        if (n == 0)
+            break;
+        for (size_t i(0); i < n; ++i)
+        {
+            make_rec(want, recs[i].seq);
+            assert(!std::memcmp(&want, &recs[i], sizeof(want)));
+            assert(!fifo || recs[i].seq == next);
+            next = recs[i].seq + 1;
+            out.add(recs[i].seq);
+        }
+        cnt += n;
+    }
+    return cnt;
+}
+
+// copy a queue's files as they are now, as if the program had died here
+void copy_queue(const std::string& from, const std::string& to)
+{
+    std::filesystem::create_directories(TEST_PATH + '/' + to);
+    for (auto ext : { ".idx", ".dat", ".jnl" })
+        std::filesystem::copy_file(TEST_PATH + '/' + from + '/' + from + ext,
+                                   TEST_PATH + '/' + to   + '/' + to   + ext,
+                                   std::filesystem::copy_options::overwrite_existing);
+}
+
+// Records survive closing a queue and reopening it in another mode,
+// across blocks (and compressed frames.) A queue keeps the layout it
+// was made with. A sort key gives up first in first out.
+void test_reopen(dreid::DqMode mode, dreid::DqMode reopen_mode, bool sorted)
+{
+    const uint64_t cnt(300000);     // a block and a bit
+    Tally in, out;
+    uint64_t next(0);
+    std::filesystem::remove_all(TEST_PATH);
+    BeginDummyScope
+        std::unique_ptr<dreid::DiskQueue> q(open_queue("reopen", mode, sorted));
+        assert(q->compressed() == (mode == dreid::DQ_COMPRESSED));
+        push_recs(*q, 0, cnt, in);
+        assert(pop_recs(*q, cnt / 3, out, next, !sorted) == cnt / 3);
+    EndDummyScope
+    BeginDummyScope
+        std::unique_ptr<dreid::DiskQueue> q(open_queue("reopen", reopen_mode, sorted));
+        assert(q->compressed() == (mode == dreid::DQ_COMPRESSED));
+        assert(q->size() == in.cnt - out.cnt);
+        push_recs(*q, cnt, cnt * 2, in);
+        pop_recs(*q, cnt * 2, out, next, !sorted);
+        assert(q->empty());
+    EndDummyScope
+    assert(in == out);
+}
+
+// A queue that stopped without closing comes back as of its last
+// journal entry. A torn or damaged last entry is dropped, and the queue
+// comes back as of the one before.
+void test_journal(dreid::DqMode mode, bool sorted)
+{
+    std::filesystem::remove_all(TEST_PATH);
+    Tally in, out, in1, out1;
+    uint64_t next(0), next1;
+    BeginDummyScope
+        std::unique_ptr<dreid::DiskQueue> q(open_queue("jnl", mode, sorted));
+        q->set_sync_interval(0);
+        push_recs(*q, 0, 10000, in);
+        pop_recs(*q, 2500, out, next, !sorted);
+        q->flush();
+        in1 = in;
+        out1 = out;
+        next1 = next;
+        push_recs(*q, 10000, 15000, in);
+        pop_recs(*q, 1000, out, next, !sorted);
+        q->flush();
+        copy_queue("jnl", "whole");
+        copy_queue("jnl", "torn");
+        copy_queue("jnl", "damaged");
+    EndDummyScope
+
+    std::string jnl(TEST_PATH + "/torn/torn.jnl");
+    std::filesystem::resize_file(jnl, std::filesystem::file_size(jnl) - sizeof(dreid::JournalRec) / 2);
+    jnl = TEST_PATH + "/damaged/damaged.jnl";
+    std::FILE *fp = std::fopen(jnl.c_str(), "r+");
+    std::fseek(fp, -(long)sizeof(dreid::JournalRec) / 2, SEEK_END);
+    int c = std::fgetc(fp);
+    std::fseek(fp, -(long)sizeof(dreid::JournalRec) / 2, SEEK_END);
+    std::fputc(c ^ 0x5a, fp);
+    std::fclose(fp);
+
+    BeginDummyScope
+        std::unique_ptr<dreid::DiskQueue> q(open_queue("whole", mode, sorted));
+        assert(q->size() == in.cnt - out.cnt);
+        pop_recs(*q, in.cnt, out, next, !sorted);
+        assert(in == out);
+    EndDummyScope
+    for (auto name : { "torn", "damaged" })
+    {
+        Tally out2 = out1;
+        uint64_t next2 = next1;
+        std::unique_ptr<dreid::DiskQueue> q(open_queue(name, mode, sorted));
+        assert(q->size() == in1.cnt - out1.cnt);
+        pop_recs(*q, in.cnt, out2, next2, !sorted);
+        assert(in1 == out2);
+        // and carries on from there
+        Tally in3 = in1;
+        push_recs(*q, 20000, 21000, in3);
+        pop_recs(*q, in3.cnt, out2, next2, false);
+        assert(in3 == out2);
+    }
+}
+
+// Producers and consumers all at once through a QueueFront with a ring
+// small enough that most records spill to disk and are refilled. Every
+// record comes out once, whole.
+void test_front(dreid::DqMode mode)
+{
+    const int producers(4), consumers(4);
+    const uint64_t per_producer(50000);
+    const uint64_t total(producers * per_producer);
+    std::filesystem::remove_all(TEST_PATH);
+    std::unique_ptr<dreid::DiskQueue> q(open_queue("front", mode, false));
+    dreid::QueueFront front(*q, 1024);
+    std::mutex mtx;
+    Tally in, out;
+    std::atomic<uint64_t> popped{0};
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p)
+        threads.emplace_back([&, p]()
+        {
+            Tally mine;
+            std::vector<TestRec> recs(37);
+            uint64_t seq(p * per_producer), end(seq + per_producer);
+            while (seq < end)
+            {
+                // singly now and then, so push and push_n both race
+                size_t n = (seq % 5 == 0) ? 1 : std::min(end - seq, (uint64_t)recs.size());
+                for (size_t i(0); i < n; ++i)
+                {
+                    make_rec(recs[i], seq + i);
+                    mine.add(seq + i);
+                }
+                if (n == 1)
+                    front.push((dreid::dq_data_t)recs.data());
+                else
+                    front.push_n((dreid::dq_data_t)recs.data(), n);
+                seq += n;
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            in.cnt += mine.cnt;
+            in.sum += mine.sum;
+            in.mix ^= mine.mix;
+        });
+    for (int c = 0; c < consumers; ++c)
+        threads.emplace_back([&, c]()
+        {
+            Tally mine;
+            std::vector<TestRec> recs(53);
+            TestRec want;
+            while (popped < total)
+            {
+                size_t n = (c & 1) ? front.pop_n((dreid::dq_data_t)recs.data(), recs.size())
+                                   : front.pop((dreid::dq_data_t)recs.data());
+                if (n == 0)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                for (size_t i(0); i < n; ++i)
+                {
+                    make_rec(want, recs[i].seq);
+                    assert(!std::memcmp(&want, &recs[i], sizeof(want)));
+                    mine.add(recs[i].seq);
+                }
+                popped += n;
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            out.cnt += mine.cnt;
+            out.sum += mine.sum;
+            out.mix ^= mine.mix;
+        });
+    for (auto& t : threads)
+        t.join();
+    assert(in.cnt == total);
+    assert(in == out);
+    assert(front.empty());
+    assert(front.spilled() != 0 && front.refilled() != 0);
+}
+
+// Consumed blocks go back to the filesystem: a drained block's space is
+// released, free blocks at the end of the data file are cut off, and a
+// cut that didn't reach the data file is made again when the journal is
+// replayed.
+void test_release(dreid::DqMode mode)
+{
+    // records per block - MAX_BLOCK_SIZE over the record length
+    const uint64_t block_recs(256 * 1024 * 1024 / sizeof(TestRec));
+    const std::string dat(TEST_PATH + "/release/release.dat");
+    const std::string trim_dat(TEST_PATH + "/trim/trim.dat");
+    Tally in, out;
+    uint64_t next(0);
+    uintmax_t full;
+    std::filesystem::remove_all(TEST_PATH);
+    BeginDummyScope
+        std::unique_ptr<dreid::DiskQueue> q(open_queue("release", mode, false));
+        struct stat before, after;
+        push_recs(*q, 0, block_recs * 2 + 1000, in);
+        q->flush();
+        full = std::filesystem::file_size(dat);
+        assert(!stat(dat.c_str(), &before));
+        // drain the first block
+        pop_recs(*q, block_recs + 1, out, next, true);
+        q->flush();
+        assert(!stat(dat.c_str(), &after));
+        assert(after.st_blocks < before.st_blocks);
+        assert(std::filesystem::file_size(dat) == full);
+        // fill the last block so the first is used again, and drain the
+        // rest - the last two blocks are free and cut off
+        push_recs(*q, in.cnt, in.cnt + block_recs, in);
+        pop_recs(*q, in.cnt, out, next, true);
+        q->flush();
+        assert(q->empty() && in == out);
+        assert(std::filesystem::file_size(dat) <= full / 3);
+        copy_queue("release", "trim");
+    EndDummyScope
+    uintmax_t trimmed = std::filesystem::file_size(dat);
+    // as if the cut never reached the disk
+    std::filesystem::resize_file(trim_dat, full);
+    BeginDummyScope
+        std::unique_ptr<dreid::DiskQueue> q(open_queue("trim", mode, false));
+        assert(q->empty());
+        assert(std::filesystem::file_size(trim_dat) == trimmed);
+        push_recs(*q, in.cnt, in.cnt + 1000, in);
+        pop_recs(*q, in.cnt, out, next, true);
+        assert(q->empty() && in == out);
+    EndDummyScope
+}
+
+void command_test()
+{
+    const auto modes = { dreid::DQ_BUFFERED, dreid::DQ_MAPPED, dreid::DQ_COMPRESSED };
+    for (auto mode : modes)
+    {
+        for (bool sorted : { false, true })
+        {
+            for (auto reopen_mode : modes)
+                test_reopen(mode, reopen_mode, sorted);
+            test_journal(mode, sorted);
+        }
+        test_front(mode);
+        test_release(mode);
+    }
+    std::filesystem::remove_all(TEST_PATH);
+    std::cout << "DiskQueue ok" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+        command_run();
+    else if (std::string(argv[1]) == "test")
+        command_test();
+    else
+        usage(argv[0]);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "aio.h"
+
+namespace dreid {
+
+// there is no liburing here, so talk to the kernel directly
+static int uring_setup( unsigned entries, io_uring_params *p )
+{
+    return (int)syscall( __NR_io_uring_setup, entries, p );
+}
+
+static int uring_enter( int fd, unsigned to_submit, unsigned min_complete, unsigned flags )
+{
+    return (int)syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0 );
+}
+
+AsyncIO::AsyncIO(unsigned depth, bool use_ring)
+: _depth(depth == 0 ? 1 : depth)
+, _ring(-1)
+, _ops(_depth)
+, _inflight(0)
+, _sq_ptr(MAP_FAILED)
+, _cq_ptr(MAP_FAILED)
+, _sqes(MAP_FAILED)
+{
+    for ( unsigned i(_depth); i > 0; --i )
+        _free.push_back( i - 1 );
+    if ( use_ring && !setup_ring() )
+        teardown_ring();
+}
+
+AsyncIO::~AsyncIO()
+{
+    // the kernel may still be writing into our buffers
+    std::vector<AioCompletion> done;
+    while ( pending() )
+        wait( done, pending() );
+    teardown_ring();
+}
+
+bool AsyncIO::setup_ring()
+{
+    io_uring_params p;
+    std::memset( &p, 0x00, sizeof(p) );
+    _ring = uring_setup( _depth, &p );
+    if ( _ring < 0 )
+    {
+        _ring = -1;
+        return false;
+    }
+
+    _sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cq_len = p.cq_off.cqes  + p.cq_entries * sizeof(io_uring_cqe);
+    if ( p.features & IORING_FEAT_SINGLE_MMAP )
+        _sq_len = _cq_len = std::max( _sq_len, _cq_len );
+    _sq_ptr = mmap( nullptr, _sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING );
+    if ( _sq_ptr == MAP_FAILED )
+        return false;
+    if ( p.features & IORING_FEAT_SINGLE_MMAP )
+        _cq_ptr = _sq_ptr;
+    else
+        _cq_ptr = mmap( nullptr, _cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING );
+    if ( _cq_ptr == MAP_FAILED )
+        return false;
+    _sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    _sqes = mmap( nullptr, _sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES );
+    if ( _sqes == MAP_FAILED )
+        return false;
+
+    uint8_t *sq = (uint8_t *)_sq_ptr;
+    uint8_t *cq = (uint8_t *)_cq_ptr;
+    _sq_head  = (unsigned *)( sq + p.sq_off.head );
+    _sq_tail  = (unsigned *)( sq + p.sq_off.tail );
+    _sq_mask  = (unsigned *)( sq + p.sq_off.ring_mask );
+    _sq_array = (unsigned *)( sq + p.sq_off.array );
+    _cq_head  = (unsigned *)( cq + p.cq_off.head );
+    _cq_tail  = (unsigned *)( cq + p.cq_off.tail );
+    _cq_mask  = (unsigned *)( cq + p.cq_off.ring_mask );
+    _cqes     = cq + p.cq_off.cqes;
+    return true;
+}
+
+void AsyncIO::teardown_ring()
+{
+    if ( _sqes != MAP_FAILED )
+        munmap( _sqes, _sqes_len );
+    if ( _cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr )
+        munmap( _cq_ptr, _cq_len );
+    if ( _sq_ptr != MAP_FAILED )
+        munmap( _sq_ptr, _sq_len );
+    if ( _ring != -1 )
+        ::close( _ring );
+    _sqes = _cq_ptr = _sq_ptr = MAP_FAILED;
+    _ring = -1;
+}
+
+bool AsyncIO::prep_read( int fd, void *buf, size_t len, off_t off, uint64_t tag )
+{
+    return prep( fd, (uint8_t *)buf, len, off, false, tag );
+}
+
+bool AsyncIO::prep_write( int fd, const void *buf, size_t len, off_t off, uint64_t tag )
+{
+    return prep( fd, (uint8_t *)buf, len, off, true, tag );
+}
+
+bool AsyncIO::prep( int fd, uint8_t *buf, size_t len, off_t off, bool write, uint64_t tag )
+{
+    if ( _free.empty() )
+        return false;
+    unsigned slot = _free.back();
+    _free.pop_back();
+    _ops[slot] = Op{ fd, buf, len, off, 0, write, tag };
+    _queued.push_back( slot );
+    return true;
+}
+
+// the slot number rides along as user_data
+void AsyncIO::push_sqe( unsigned slot )
+{
+    Op& op = _ops[slot];
+    unsigned tail = *_sq_tail;
+    unsigned idx  = tail & *_sq_mask;
+    io_uring_sqe *sqe = (io_uring_sqe *)_sqes + idx;
+    std::memset( sqe, 0x00, sizeof(*sqe) );
+    sqe->opcode    = op.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd        = op.fd;
+    sqe->addr      = (uint64_t)( op.buf + op.done );
+    sqe->len       = op.len - op.done;
+    sqe->off       = op.off + op.done;
+    sqe->user_data = slot;
+    _sq_array[idx] = idx;
+    __atomic_store_n( _sq_tail, tail + 1, __ATOMIC_RELEASE );
+}
+
+size_t AsyncIO::submit()
+{
+    size_t cnt = _queued.size();
+    if ( cnt == 0 )
+        return 0;
+    if ( !uring() )
+    {
+        while ( !_queued.empty() )
+        {
+            unsigned slot = _queued.front();
+            _queued.pop_front();
+            run_sync( slot );
+        }
+        return cnt;
+    }
+
+    std::vector<unsigned> slots( _queued.begin(), _queued.end() );
+    for ( auto slot : slots )
+        push_sqe( slot );
+    _queued.clear();
+    _inflight += cnt;
+    size_t left = cnt;
+    while ( left > 0 )
+    {
+        int n = uring_enter( _ring, left, 0, 0 );
+        if ( n < 0 && ( errno == EINTR || errno == EAGAIN || errno == EBUSY ) )
+        {
+            reap();     // make room in the completion queue
+            continue;
+        }
+        if ( n <= 0 )
+        {
+            // The kernel took none of the rest. Nothing else consumes the
+            // submission queue, so take them back out and fail them -
+            // otherwise wait() would wait for them forever.
+            int err = ( n < 0 ) ? errno : EIO;
+            __atomic_store_n( _sq_tail, __atomic_load_n( _sq_head, __ATOMIC_ACQUIRE ), __ATOMIC_RELEASE );
+            for ( size_t i( cnt - left ); i < cnt; ++i )
+            {
+                Op& op = _ops[ slots[i] ];
+                _inflight--;
+                _done.push_back( AioCompletion{ op.tag, -err } );
+                _free.push_back( slots[i] );
+            }
+            break;
+        }
+        left -= n;
+    }
+    return cnt;
+}
+
+size_t AsyncIO::wait( std::vector<AioCompletion>& done, size_t min_cnt )
+{
+    done.clear();
+    while ( true )
+    {
+        while ( !_done.empty() )
+        {
+            done.push_back( _done.front() );
+            _done.pop_front();
+        }
+        if ( done.size() >= min_cnt || pending() == 0 )
+            break;
+        submit();       // includes resubmitted short transfers
+        if ( uring() && reap() == 0 && _inflight > 0 )
+        {
+            int n = uring_enter( _ring, 0, 1, IORING_ENTER_GETEVENTS );
+            if ( n < 0 && errno != EINTR )
+                break;
+            reap();
+        }
+    }
+    return done.size();
+}
+
+size_t AsyncIO::reap()
+{
+    size_t cnt(0);
+    unsigned head = *_cq_head;
+    unsigned tail = __atomic_load_n( _cq_tail, __ATOMIC_ACQUIRE );
+    while ( head != tail )
+    {
+        io_uring_cqe *cqe = (io_uring_cqe *)_cqes + ( head & *_cq_mask );
+        unsigned slot = (unsigned)cqe->user_data;
+        ssize_t  res  = cqe->res;
+        head++;
+        __atomic_store_n( _cq_head, head, __ATOMIC_RELEASE );
+        _inflight--;
+        finish( slot, res );
+        cnt++;
+    }
+    return cnt;
+}
+
+// pick up a transfer - short ones go back in the queue for the rest
+void AsyncIO::finish( unsigned slot, ssize_t res )
+{
+    Op& op = _ops[slot];
+    if ( res == -EINTR || res == -EAGAIN )
+    {
+        _queued.push_back( slot );
+        return;
+    }
+    if ( res > 0 )
+    {
+        op.done += res;
+        if ( op.done < op.len )
+        {
+            _queued.push_back( slot );
+            return;
+        }
+    }
+    _done.push_back( AioCompletion{ op.tag, ( res < 0 ) ? res : (ssize_t)op.done } );
+    _free.push_back( slot );
+}
+
+void AsyncIO::run_sync( unsigned slot )
+{
+    Op& op = _ops[slot];
+    ssize_t res(0);
+    while ( op.done < op.len )
+    {
+        res = op.write ? ::pwrite( op.fd, op.buf + op.done, op.len - op.done, op.off + op.done )
+                       : ::pread ( op.fd, op.buf + op.done, op.len - op.done, op.off + op.done );
+        if ( res < 0 && errno == EINTR )
+            continue;
+        if ( res <= 0 )
+            break;
+        op.done += res;
+    }
+    _done.push_back( AioCompletion{ op.tag, ( res < 0 ) ? -errno : (ssize_t)op.done } );
+    _free.push_back( slot );
+}
+
+} // namespace dreid
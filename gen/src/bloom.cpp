@@ -0,0 +1,83 @@
+#include <algorithm>
+#include "bloom.h"
+
+namespace dreid {
+
+BloomFilter::BloomFilter()
+: _nbits(0), _k(0)
+{}
+
+BloomFilter::BloomFilter(uint64_t key_cnt, uint32_t bits_per_key)
+{
+    // k = ln(2) * bits/key is optimal - 0.69 is close enough
+    _k = ( bits_per_key * 69 ) / 100;
+    if ( _k < 1 )  _k = 1;
+    if ( _k > 16 ) _k = 16;
+    _nbits = key_cnt * bits_per_key;
+    if ( _nbits < 64 )
+        _nbits = 64;
+    _bits.assign( ( _nbits + 63 ) / 64, 0 );
+    _nbits = _bits.size() * 64;
+}
+
+// double hashing: probe i is h1 + i * h2
+void BloomFilter::add(const unsigned char *key, size_t len)
+{
+    if ( _nbits == 0 )
+        return;
+    uint64_t h1 = hash( key, len );
+    uint64_t h2 = ( h1 >> 33 ) | ( h1 << 31 ) | 1;
+    for ( uint32_t i(0); i < _k; ++i )
+    {
+        uint64_t bit = ( h1 + i * h2 ) % _nbits;
+        _bits[ bit >> 6 ] |= 1ULL << ( bit & 63 );
+    }
+}
+
+bool BloomFilter::maybe_contains(const unsigned char *key, size_t len) const
+{
+    if ( _nbits == 0 )
+        return true;    // no filter - can't rule anything out
+    uint64_t h1 = hash( key, len );
+    uint64_t h2 = ( h1 >> 33 ) | ( h1 << 31 ) | 1;
+    for ( uint32_t i(0); i < _k; ++i )
+    {
+        uint64_t bit = ( h1 + i * h2 ) % _nbits;
+        if ( !( _bits[ bit >> 6 ] & ( 1ULL << ( bit & 63 ) ) ) )
+            return false;
+    }
+    return true;
+}
+
+void BloomFilter::clear()
+{
+    std::fill( _bits.begin(), _bits.end(), 0 );
+}
+
+void BloomFilter::assign(const unsigned char *bits, uint64_t nbits, uint32_t k)
+{
+    _nbits = nbits;
+    _k     = k;
+    _bits.assign( ( nbits + 63 ) / 64, 0 );
+    std::memcpy( _bits.data(), bits, byte_cnt() );
+}
+
+// FNV-1a over the key followed by a 64-bit finalizer (splitmix) to
+// spread the bits - keys here are mostly zeroes and small integers.
+uint64_t BloomFilter::hash(const unsigned char *key, size_t len, uint64_t seed)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+    for ( size_t i(0); i < len; ++i )
+    {
+        h ^= key[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+} // namespace dreid
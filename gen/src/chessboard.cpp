@@ -153,6 +153,8 @@ int main() {
         threads[i].join();
     }
 
+    dreid::close_tables();
+
 
     time_t tend = time(0);
     double hang = std::difftime(tend, tstart);
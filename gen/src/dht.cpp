@@ -1,291 +1,2150 @@
+#include <algorithm>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include "dht.h"
 #include "md5.h"
+#include "sorted_run.h"
 
 namespace dreid {
 
 #define TABLE_BUFF_SIZE 1024*1024*4 // 4 MiB
+#define APPEND_BUFF_SIZE 1024*16    // 16 KiB write-back per bucket
+#define APPEND_FLUSH_MS  5000       // max age of buffered appends
+#define AIO_READ_SIZE    1024*256   // bytes per asynchronous bucket read
+#define VALUE_FILE_SFX   ".v"       // columnar value file
 
-std::map<size_t, BuffPtr> DiskHashTable::BucketFile::buff_map;
+// search position of a record found in a sorted run rather than the file
+#define POS_IN_RUN ((off_t)-2)
+
+// positional I/O that doesn't give up on short transfers
+static ssize_t read_at( int fd, void *buf, size_t len, off_t pos )
+{
+    size_t done(0);
+    while ( done < len )
+    {
+        ssize_t n = ::pread( fd, (uchar *)buf + done, len - done, pos + done );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n < 0 )
+            return -1;
+        if ( n == 0 )
+            break;
+        done += n;
+    }
+    return done;
+}
+
+static bool write_at( int fd, const void *buf, size_t len, off_t pos )
+{
+    size_t done(0);
+    while ( done < len )
+    {
+        ssize_t n = ::pwrite( fd, (const uchar *)buf + done, len - done, pos + done );
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// BucketFileCache
+//
+BucketFileCache::BucketFileCache()
+: _capacity(BUCKET_FILE_CACHE_SIZE)
+, _hits(0)
+, _misses(0)
+, _evictions(0)
+{}
+
+// never destroyed, so tables with static storage duration can still
+// flush and release their files at exit.
+BucketFileCache& BucketFileCache::instance()
+{
+    static BucketFileCache *cache = new BucketFileCache;
+    return *cache;
+}
+
+// return an open descriptor for the owner, pinning it until release().
 // fopen is failing with errno 24 (too many files) on unlimited ulimit,
-// so postulating that I'm opening file too fast.
-std::mutex fopen_mtx;
+// so files are only ever opened under the cache lock.
+// Files that must already exist (sorted runs) are opened without
+// O_CREAT, so a run deleted by a merge is never brought back empty.
+int BucketFileCache::acquire(OwnerId owner, const std::string& fspec, bool create, bool *opened)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    auto itr = _map.find( owner );
+    if ( itr != _map.end() )
+    {
+        Entry& e = itr->second;
+        if ( e.pins++ == 0 )
+            _lru.erase( e.lru );
+        _hits++;
+        return e.fd;
+    }
+
+    _misses++;
+    if ( opened != nullptr )
+        *opened = true;
+    evict_nolock();
+    int fd = create ? ::open( fspec.c_str(), O_RDWR | O_CREAT, 0644 )
+                    : ::open( fspec.c_str(), O_RDONLY );
+    if ( fd != -1 )
+        _map[ owner ] = Entry{ fd, 1, _lru.end() };
+    return fd;
+}
 
+// unpin the owner's file. The file stays open until evicted.
+void BucketFileCache::release(OwnerId owner)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    auto itr = _map.find( owner );
+    if ( itr == _map.end() )
+        return;
+    Entry& e = itr->second;
+    if ( --e.pins == 0 )
+    {
+        _lru.push_front( owner );
+        e.lru = _lru.begin();
+        evict_nolock();
+    }
+}
+
+// close the owner's file for good - the owner is going away
+void BucketFileCache::forget(OwnerId owner)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    auto itr = _map.find( owner );
+    if ( itr == _map.end() )
+        return;
+    if ( itr->second.pins == 0 )
+        _lru.erase( itr->second.lru );
+    ::close( itr->second.fd );
+    _map.erase( itr );
+}
+
+void BucketFileCache::capacity(size_t cap)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    _capacity = ( cap == 0 ) ? 1 : cap;
+    evict_nolock();
+}
+
+BucketFileCache::Stats BucketFileCache::stats()
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    return Stats{ _hits, _misses, _evictions, _map.size(), _capacity };
+}
+
+// close least-recently used unpinned files until there is room for
+// one more. If everything is pinned, allow the cache to run over.
+void BucketFileCache::evict_nolock()
+{
+    while ( _map.size() >= _capacity && !_lru.empty() )
+    {
+        OwnerId victim = _lru.back();
+        _lru.pop_back();
+        auto itr = _map.find( victim );
+        ::close( itr->second.fd );
+        _map.erase( itr );
+        _evictions++;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// BucketFile
+//
 DiskHashTable::BucketFile::BucketFile(std::string fspec, size_t key_len, size_t val_len)
 : _fspec(fspec)
 , _keylen(key_len)
 , _vallen(val_len)
-, _reclen(key_len + val_len)
 , _reccnt(0)
-, _fp(nullptr)
+, _logcnt(0)
+, _reclen(key_len + val_len)
+, _lsm(false)
+, _run_seq(0)
+, _columnar(false)
+, _gen(0)
+{
+    // no need to open the file just to learn its size
+    struct stat stat_buf;
+    if ( !stat( fspec.c_str(), &stat_buf ) )
+        _reccnt = _logcnt = stat_buf.st_size / _reclen;
+}
+
+// the record count is already known (from the manifest)
+DiskHashTable::BucketFile::BucketFile(std::string fspec, size_t key_len, size_t val_len, size_t rec_cnt)
+: _fspec(fspec)
+, _keylen(key_len)
+, _vallen(val_len)
+, _reccnt(rec_cnt)
+, _logcnt(rec_cnt)
+, _reclen(key_len + val_len)
+, _lsm(false)
+, _run_seq(0)
+, _columnar(false)
+, _gen(0)
+{}
+
+DiskHashTable::BucketFile::~BucketFile()
+{
+    flush_nolock();
+    BucketFileCache::instance().forget( this );
+    BucketFileCache::instance().forget( &_valspec );
+}
+
+// pin the file (or the value file) in the cache, opening it if need be
+int DiskHashTable::BucketFile::open( bool values )
+{
+    const std::string& fspec = values ? _valspec : _fspec;
+    bool opened = false;
+    int fd = values ? BucketFileCache::instance().acquire( &_valspec, fspec, true, &opened )
+                    : BucketFileCache::instance().acquire( this, fspec, true, &opened );
+    if ( opened )
+        _ctr.opens++;
+    if ( fd == -1 )
+        std::cout << "Error opening bucket file " << fspec << ' ' << errno << " - terminating" << std::endl;
+    return fd;
+}
+
+// unpin the file - the cache decides when to actually close it
+void DiskHashTable::BucketFile::close( bool values )
+{
+    if ( values )
+        BucketFileCache::instance().release( &_valspec );
+    else
+        BucketFileCache::instance().release( this );
+}
+
+// switch a new bucket to key and value files. Only the key file says how
+// many records there are - values are written first, so a crash can
+// leave a value without its key but never the other way around.
+void DiskHashTable::BucketFile::set_columnar( bool recount )
+{
+    _columnar = true;
+    _valspec  = _fspec + VALUE_FILE_SFX;
+    struct stat stat_buf;
+    if ( recount && !stat( _fspec.c_str(), &stat_buf ) )
+        _reccnt = _logcnt = stat_buf.st_size / _keylen;
+}
+
+// read the value of a record in the file of a columnar bucket
+bool DiskHashTable::BucketFile::read_value_nolock( size_t recno, ucharptr val )
+{
+    file_guard fd( *this, true );
+    if ( fd == -1 || read_at( fd, val, _vallen, recno * _vallen ) != (ssize_t)_vallen )
+        return false;
+    _ctr.bytes_read += _vallen;
+    return true;
+}
+
+// the uncontended case doesn't look at the clock
+std::shared_lock<std::shared_mutex> DiskHashTable::BucketFile::read_lock()
+{
+    std::shared_lock<std::shared_mutex> lock( _mtx, std::try_to_lock );
+    if ( !lock.owns_lock() )
+    {
+        auto start = Clock::now();
+        lock.lock();
+        _ctr.lock_waits++;
+        _ctr.lock_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>( Clock::now() - start ).count();
+    }
+    return lock;
+}
+
+std::unique_lock<std::shared_mutex> DiskHashTable::BucketFile::write_lock()
+{
+    std::unique_lock<std::shared_mutex> lock( _mtx, std::try_to_lock );
+    if ( !lock.owns_lock() )
+    {
+        auto start = Clock::now();
+        lock.lock();
+        _ctr.lock_waits++;
+        _ctr.lock_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>( Clock::now() - start ).count();
+    }
+    return lock;
+}
+
+off_t DiskHashTable::BucketFile::search(ucharptr_c key, ucharptr val)
+{
+    auto lock = read_lock();
+    off_t pos = search_nolock(key, val);
+    _ctr.found( pos != -1, 1 );
+    return pos;
+}
+
+off_t DiskHashTable::BucketFile::search_nolock(ucharptr_c key, ucharptr val)
+{
+    size_t file_cnt = file_reccnt();
+    if ( file_cnt > 0 )
+    {
+        file_guard fd(*this);
+        if ( fd == -1 )
+            return -1;
+        size_t stride = file_stride();
+        size_t max_item_cnt = TABLE_BUFF_SIZE / stride;
+        BuffPtr buff = get_file_buff();
+        for ( size_t recno(0); recno < file_cnt; )
+        {
+            size_t want = std::min( max_item_cnt, file_cnt - recno );
+            ssize_t len = read_at( fd, buff.get(), want * stride, recno * stride );
+            if ( len <= 0 )
+                break;
+            size_t rec_cnt = len / stride;
+            _ctr.bytes_read += len;
+            ucharptr p = buff.get();
+            for ( size_t i(0); i < rec_cnt; ++i )
+            {
+                if ( !std::memcmp( p, key, _keylen ) )
+                {
+                    _ctr.recs_compared += i + 1;
+                    if ( _vallen != 0 && val != P_NAUGHT && val != nullptr )
+                    {
+                        if ( !_columnar )
+                            std::memcpy( val, p + _keylen, _vallen );
+                        else if ( !read_value_nolock( recno + i, val ) )
+                            return -1;
+                    }
+                    // positions are record offsets whatever the layout
+                    return ( recno + i ) * _reclen;
+                }
+                p += stride;
+            }
+            _ctr.recs_compared += rec_cnt;
+            recno += rec_cnt;
+        }
+    }
+
+    // records not yet flushed follow the end of the file
+    ucharptr p = _wbuf.data();
+    for ( size_t i(0); i < _wbuf.size(); i += _reclen )
+    {
+        _ctr.recs_compared++;
+        if ( !std::memcmp( p + i, key, _keylen ) )
+        {
+            if ( _vallen != 0 && val != P_NAUGHT && val != nullptr )
+                std::memcpy( val, p + i + _keylen, _vallen );
+            return file_cnt * _reclen + i;
+        }
+    }
+
+    // P_NAUGHT is per translation unit, so spell out "no value" for the run
+    ucharptr run_val = ( val == P_NAUGHT ) ? nullptr : val;
+    for ( auto itr = _runs.rbegin(); itr != _runs.rend(); ++itr )
+    {
+        if ( !(*itr)->maybe_contains( key ) )
+        {
+            _ctr.bloom_skips++;
+            continue;
+        }
+        _ctr.run_probes++;
+        size_t bytes(0);
+        off_t found = (*itr)->search( key, run_val, &bytes );
+        _ctr.bytes_read += bytes;
+        if ( found != -1 )
+            return POS_IN_RUN;
+    }
+    return -1;
+}
+
+size_t DiskHashTable::BucketFile::search_many(ucharptr_c keys, IndexList& idx, ucharptr vals, FoundList& found)
 {
-    std::lock_guard<std::mutex> lock(fopen_mtx);
-    if ( open() )
+    auto lock = read_lock();
+    size_t key_cnt = idx.size();
+    size_t hits = search_many_nolock(keys, idx, vals, found);
+    _ctr.found( hits, key_cnt );
+    return hits;
+}
+
+// check rec_cnt records against the keys named in idx. Found keys are
+// removed from idx, so what's left were not found.
+//
+// A block read from the key file of a columnar bucket holds bare keys.
+// key_recno then gives the record number of the first one, and values
+// of the keys found are read from the value file.
+size_t DiskHashTable::BucketFile::match_nolock(ucharptr_c recs, size_t rec_cnt, ucharptr_c keys, IndexList& idx, ucharptr vals, FoundList& found, size_t key_recno)
+{
+    size_t hits(0);
+    size_t stride = ( key_recno == RECNO_NONE ) ? _reclen : _keylen;
+    ucharptr_c end = recs + rec_cnt * stride;
+    for ( ucharptr rec = recs; rec < end && !idx.empty(); rec += stride )
+    {
+        _ctr.recs_compared++;
+        for ( size_t j(0); j < idx.size(); ++j )
+        {
+            size_t k = idx[j];
+            if ( !std::memcmp( rec, keys + k * _keylen, _keylen ) )
+            {
+                if ( _vallen != 0 && vals != nullptr )
+                {
+                    if ( key_recno == RECNO_NONE )
+                        std::memcpy( vals + k * _vallen, rec + _keylen, _vallen );
+                    else if ( !read_value_nolock( key_recno + ( rec - recs ) / stride, vals + k * _vallen ) )
+                        break;  // leave it unfound rather than hand back garbage
+                }
+                found[k] = true;
+                hits++;
+                idx[j] = idx.back();
+                idx.pop_back();
+                break;
+            }
+        }
+    }
+    return hits;
+}
+
+// look for all keys named in idx in a single pass over the bucket.
+// Found keys are removed from idx, so what's left were not found.
+size_t DiskHashTable::BucketFile::search_many_nolock(ucharptr_c keys, IndexList& idx, ucharptr vals, FoundList& found)
+{
+    size_t hits(0);
+    size_t file_cnt = file_reccnt();
+    if ( file_cnt > 0 && !idx.empty() )
+    {
+        file_guard fd(*this);
+        if ( fd == -1 )
+            return hits;
+        size_t stride = file_stride();
+        size_t max_item_cnt = TABLE_BUFF_SIZE / stride;
+        BuffPtr buff = get_file_buff();
+        for ( size_t recno(0); recno < file_cnt && !idx.empty(); )
+        {
+            size_t want = std::min( max_item_cnt, file_cnt - recno );
+            ssize_t len = read_at( fd, buff.get(), want * stride, recno * stride );
+            if ( len <= 0 )
+                break;
+            _ctr.bytes_read += len;
+            size_t rec_cnt = len / stride;
+            hits  += match_nolock( buff.get(), rec_cnt, keys, idx, vals, found, _columnar ? recno : RECNO_NONE );
+            recno += rec_cnt;
+        }
+    }
+    return hits + search_tail_nolock( keys, idx, vals, found );
+}
+
+// the part of a search that follows the file - buffered appends, then
+// (in LSM mode) the runs
+size_t DiskHashTable::BucketFile::search_tail_nolock(ucharptr_c keys, IndexList& idx, ucharptr vals, FoundList& found)
+{
+    size_t hits = match_nolock( _wbuf.data(), _wbuf.size() / _reclen, keys, idx, vals, found );
+
+    // what's left can only be in the runs - probe them one key at a time
+    for ( auto itr = _runs.rbegin(); itr != _runs.rend() && !idx.empty(); ++itr )
+    {
+        for ( size_t j(0); j < idx.size(); )
+        {
+            size_t k = idx[j];
+            ucharptr val = ( _vallen != 0 && vals != nullptr ) ? vals + k * _vallen : nullptr;
+            ucharptr_c key = keys + k * _keylen;
+            bool hit = false;
+            if ( (*itr)->maybe_contains( key ) )
+            {
+                _ctr.run_probes++;
+                size_t bytes(0);
+                hit = (*itr)->search( key, val, &bytes ) != -1;
+                _ctr.bytes_read += bytes;
+            }
+            else
+            {
+                _ctr.bloom_skips++;
+            }
+            if ( hit )
+            {
+                found[k] = true;
+                hits++;
+                idx[j] = idx.back();
+                idx.pop_back();
+            }
+            else
+            {
+                ++j;
+            }
+        }
+    }
+    return hits;
+}
+
+// atomically insert every key in idx that is not already in the bucket.
+// Keys that are already present get their current value copied out.
+size_t DiskHashTable::BucketFile::insert_many(ucharptr_c keys, IndexList& idx, ucharptr vals, FoundList& inserted)
+{
+    auto lock = write_lock();
+    FoundList found( inserted.size(), false );
+    size_t key_cnt = idx.size();
+    _ctr.found( search_many_nolock( keys, idx, vals, found ), key_cnt );
+
+    // idx now holds the absent keys - restore input order so duplicates
+    // within the batch resolve to the first occurrence
+    std::sort( idx.begin(), idx.end() );
+    size_t cnt(0);
+    for ( size_t j(0); j < idx.size(); ++j )
+    {
+        size_t k = idx[j];
+        ucharptr_c key = keys + k * _keylen;
+        ucharptr   val = ( _vallen != 0 && vals != nullptr ) ? vals + k * _vallen : nullptr;
+        size_t dupe(0);
+        while ( dupe < j && std::memcmp( key, keys + idx[dupe] * _keylen, _keylen ) )
+            dupe++;
+        if ( dupe < j )
+        {
+            if ( val != nullptr )
+                std::memcpy( val, vals + idx[dupe] * _vallen, _vallen );
+            continue;
+        }
+        if ( append_nolock( key, val ) )
+        {
+            inserted[k] = true;
+            cnt++;
+        }
+    }
+    return cnt;
+}
+
+// search and append under one lock. On a hit the existing value is
+// copied to val, otherwise the record number of the new record is
+// returned along with the generation it belongs to.
+bool DiskHashTable::BucketFile::insert_or_get( ucharptr_c key, ucharptr val, size_t& recno, uint64_t& gen )
+{
+    auto lock = write_lock();
+    bool hit = search_nolock( key, val ) != -1;
+    _ctr.found( hit, 1 );
+    if ( hit )
+        return false;
+    recno = _logcnt;
+    gen   = _gen;
+    return append_nolock( key, val );
+}
+
+// rewrite the value of a record of the log without searching for it
+bool DiskHashTable::BucketFile::update_at( size_t recno, uint64_t gen, ucharptr_c val )
+{
+    auto lock = write_lock();
+    if ( gen != _gen || recno >= _logcnt )
+        return false;
+    _ctr.updates++;
+    if ( _vallen == 0 )
+        return true;
+
+    std::vector<uchar> v( _vallen, NAUGHT );
+    if ( val != P_NAUGHT && val != nullptr )
+        std::memcpy( v.data(), val, _vallen );
+    size_t file_cnt = file_reccnt();
+    if ( recno >= file_cnt )
+    {
+        std::memcpy( _wbuf.data() + ( recno - file_cnt ) * _reclen + _keylen, v.data(), _vallen );
+        return true;
+    }
+    file_guard fd( *this, _columnar );
+    off_t pos = _columnar ? recno * _vallen : recno * _reclen + _keylen;
+    _ctr.bytes_written += _vallen;
+    return fd != -1 && write_at( fd, v.data(), _vallen, pos );
+}
+
+bool DiskHashTable::BucketFile::append( ucharptr_c key, ucharptr_c val )
+{
+    auto lock = write_lock();
+    return append_nolock( key, val );
+}
+
+// append the record to the write-back buffer, flushing it to disk once
+// it is full or has been sitting around for too long.
+bool DiskHashTable::BucketFile::append_nolock( ucharptr_c key, ucharptr_c val )
+{
+    buffer_nolock( key, val );
+    if ( flush_due() )
+        return flush_nolock();
+    return true;
+}
+
+void DiskHashTable::BucketFile::buffer_nolock( ucharptr_c key, ucharptr_c val )
+{
+    if ( _wbuf.empty() )
+    {
+        _wbuf.reserve( APPEND_BUFF_SIZE );
+        _wbuf_since = Clock::now();
+    }
+    _wbuf.insert( _wbuf.end(), key, key + _keylen );
+    if ( _vallen != 0 )
+    {
+        if ( val != P_NAUGHT && val != nullptr )
+            _wbuf.insert( _wbuf.end(), val, val + _vallen );
+        else
+            _wbuf.insert( _wbuf.end(), _vallen, NAUGHT );
+    }
+    _reccnt++;
+    _logcnt++;
+    _ctr.appends++;
+}
+
+bool DiskHashTable::BucketFile::flush_due() const
+{
+    return !_wbuf.empty()
+        && ( _wbuf.size() + _reclen > APPEND_BUFF_SIZE
+          || Clock::now() - _wbuf_since > std::chrono::milliseconds( APPEND_FLUSH_MS ) );
+}
+
+bool DiskHashTable::BucketFile::flush()
+{
+    auto lock = write_lock();
+    return flush_nolock();
+}
+
+// flush the buffer if it holds records appended before cutoff
+bool DiskHashTable::BucketFile::flush_if_older( Clock::time_point cutoff )
+{
+    auto lock = write_lock();
+    if ( _wbuf.empty() || _wbuf_since > cutoff )
+        return true;
+    return flush_nolock();
+}
+
+bool DiskHashTable::BucketFile::sync()
+{
+    auto lock = write_lock();
+    if ( !flush_nolock() )
+        return false;
+    if ( _columnar )
+    {
+        file_guard vfd( *this, true );
+        if ( vfd == -1 || ::fdatasync( vfd ) != 0 )
+            return false;
+    }
+    file_guard fd(*this);
+    return fd != -1 && ::fdatasync( fd ) == 0;
+}
+
+// write all buffered records to the end of the file in one go. On
+// failure the records stay buffered so nothing is lost.
+bool DiskHashTable::BucketFile::flush_nolock()
+{
+    if ( _wbuf.empty() )
+        return true;
+    if ( _columnar )
+    {
+        // split the buffer into its columns - values go out first
+        size_t cnt = _wbuf.size() / _reclen;
+        size_t recno = file_reccnt();
+        std::vector<uchar> ks( cnt * _keylen );
+        std::vector<uchar> vs( cnt * _vallen );
+        for ( size_t i(0); i < cnt; ++i )
+        {
+            std::memcpy( ks.data() + i * _keylen, _wbuf.data() + i * _reclen, _keylen );
+            std::memcpy( vs.data() + i * _vallen, _wbuf.data() + i * _reclen + _keylen, _vallen );
+        }
+        file_guard vfd( *this, true );
+        if ( vfd == -1 || !write_at( vfd, vs.data(), vs.size(), recno * _vallen ) )
+            return false;
+        file_guard fd(*this);
+        if ( fd == -1 || !write_at( fd, ks.data(), ks.size(), recno * _keylen ) )
+            return false;
+    }
+    else
+    {
+        file_guard fd(*this);
+        if ( fd == -1 || !write_at( fd, _wbuf.data(), _wbuf.size(), file_reccnt() * _reclen ) )
+            return false;
+    }
+    _ctr.bytes_written += _wbuf.size();
+    _wbuf.clear();
+    return true;
+}
+
+bool DiskHashTable::BucketFile::update(ucharptr_c key, ucharptr_c val)
+{
+    auto lock = write_lock();
+    return update_nolock( key, val );
+}
+
+bool DiskHashTable::BucketFile::update_nolock(ucharptr_c key, ucharptr_c val)
+{
+    off_t pos = search_nolock( key );
+    if ( pos == -1 )
+        return false;
+    _ctr.updates++;
+    if ( pos == POS_IN_RUN )
+        return append_nolock( key, val );  // shadow the run's copy
+
+    off_t file_len = file_reccnt() * _reclen;
+    bool  in_buff  = pos >= file_len;
+    std::vector<uchar> rec;
+    ucharptr p;
+    if ( in_buff )
+    {
+        // record is still in the write-back buffer
+        p = _wbuf.data() + ( pos - file_len );
+    }
+    else
+    {
+        rec.resize( _reclen );
+        p = rec.data();
+    }
+    std::memcpy( p, key, _keylen );
+    if ( _vallen != 0 )
+    {
+        if ( val != P_NAUGHT && val != nullptr )
+            std::memcpy( p + _keylen, val, _vallen );
+        else
+            std::memset( p + _keylen, NAUGHT, _vallen );
+    }
+    if ( in_buff )
+        return true;
+
+    if ( _columnar )
+    {
+        // the key stays put - only the value is rewritten
+        file_guard vfd( *this, true );
+        _ctr.bytes_written += _vallen;
+        return vfd != -1 && write_at( vfd, p + _keylen, _vallen, ( pos / _reclen ) * _vallen );
+    }
+    file_guard fd(*this);
+    _ctr.bytes_written += _reclen;
+    return fd != -1 && write_at( fd, p, _reclen, pos );
+}
+
+// read up to max_recs consecutive records starting at recno into buff.
+// Returns the number of records read, zero at the end of the bucket.
+//
+// In LSM mode the records of the runs (oldest first) come before those
+// of the file, so shadowed versions are included until the bucket is
+// compacted.
+size_t DiskHashTable::BucketFile::read_block( size_t recno, ucharptr buff, size_t max_recs )
+{
+    auto lock = read_lock();
+    for ( auto& run : _runs )
+    {
+        if ( recno < run->size() )
+            return run->read_recs( recno, buff, max_recs );
+        recno -= run->size();
+    }
+    size_t file_cnt = file_reccnt();
+    size_t cnt(0);
+    if ( recno < file_cnt )
+    {
+        file_guard fd(*this);
+        if ( fd == -1 )
+            return 0;
+        size_t want = std::min( max_recs, file_cnt - recno );
+        if ( _columnar )
+            cnt = read_columns_nolock( fd, recno, want, buff );
+        else
+        {
+            ssize_t len = read_at( fd, buff, want * _reclen, recno * _reclen );
+            if ( len <= 0 )
+                return 0;
+            _ctr.bytes_read += len;
+            cnt = len / _reclen;
+        }
+        if ( cnt == 0 )
+            return 0;
+        recno += cnt;
+    }
+    if ( recno >= file_cnt && cnt < max_recs && recno < _logcnt )
+    {
+        size_t want = std::min( max_recs - cnt, _logcnt - recno );
+        std::memcpy( buff + cnt * _reclen, _wbuf.data() + ( recno - file_cnt ) * _reclen, want * _reclen );
+        cnt += want;
+    }
+    return cnt;
+}
+
+// read cnt records of a columnar bucket's files into buff as whole
+// records. Returns the number of records read.
+size_t DiskHashTable::BucketFile::read_columns_nolock( int fd, size_t recno, size_t cnt, ucharptr buff )
+{
+    std::vector<uchar> ks( cnt * _keylen );
+    std::vector<uchar> vs( cnt * _vallen );
+    file_guard vfd( *this, true );
+    ssize_t klen = read_at( fd, ks.data(), ks.size(), recno * _keylen );
+    ssize_t vlen = ( vfd == -1 ) ? -1 : read_at( vfd, vs.data(), vs.size(), recno * _vallen );
+    if ( klen <= 0 || vlen <= 0 )
+        return 0;
+    _ctr.bytes_read += klen + vlen;
+    cnt = std::min( klen / _keylen, vlen / _vallen );
+    for ( size_t i(0); i < cnt; ++i )
+    {
+        std::memcpy( buff + i * _reclen, ks.data() + i * _keylen, _keylen );
+        std::memcpy( buff + i * _reclen + _keylen, vs.data() + i * _vallen, _vallen );
+    }
+    return cnt;
+}
+
+// read a specific record from the file. Return true
+// if record was read, or false if EOF.
+bool DiskHashTable::BucketFile::read( size_t recno, ucharptr key, ucharptr val )
+{
+    if ( _lsm || _columnar )
+    {
+        std::vector<uchar> rec( _reclen );
+        if ( read_block( recno, rec.data(), 1 ) != 1 )
+            return false;
+        std::memcpy( key, rec.data(), _keylen );
+        if ( _vallen != 0 )
+            std::memcpy( val, rec.data() + _keylen, _vallen );
+        return true;
+    }
+    auto lock = read_lock();
+    if ( recno >= _reccnt )
+        return false;
+    ucharptr p;
+    BuffPtr buff;
+    if ( recno >= file_reccnt() )
+    {
+        p = _wbuf.data() + ( recno - file_reccnt() ) * _reclen;
+    }
+    else
+    {
+        file_guard fd(*this);
+        buff = get_file_buff();
+        if ( fd == -1 || read_at( fd, buff.get(), _reclen, recno * _reclen ) != (ssize_t)_reclen )
+            return false;
+        p = buff.get();
+    }
+    std::memcpy( key, p, _keylen );
+    if ( _vallen != 0 )
+        std::memcpy( val, p + _keylen, _vallen );
+    return true;
+}
+
+// runs are named after the bucket file with a sequence number
+std::string DiskHashTable::BucketFile::run_fspec( uint32_t seq ) const
+{
+    char sfx[16];
+    std::sprintf( sfx, ".r%06u", seq );
+    return _fspec + sfx;
+}
+
+// add a run found on disk. Runs must be attached oldest first.
+void DiskHashTable::BucketFile::attach_run( SortedRunPtr run, uint32_t seq )
+{
+    auto lock = write_lock();
+    _runs.push_back( run );
+    _reccnt += run->size();
+    _run_seq = std::max( _run_seq, seq + 1 );
+}
+
+// sort the file into a new run, then merge the runs if there are more
+// than max_runs of them. The bucket is locked throughout, which keeps
+// this simple - the file is small and runs are bounded by splitting.
+bool DiskHashTable::BucketFile::compact( size_t max_runs, uint32_t bloom_bits, uint16_t codec )
+{
+    auto lock = write_lock();
+    if ( !compact_log_nolock( bloom_bits, codec ) )
+        return false;
+    if ( _runs.size() > max_runs )
+        return merge_runs_nolock( bloom_bits, codec );
+    return true;
+}
+
+// The run is complete on disk before the file is truncated. If we die in
+// between, the records are in both places - the run's lineage names the
+// log it came from, and load_runs() drops the log's copy.
+bool DiskHashTable::BucketFile::compact_log_nolock( uint32_t bloom_bits, uint16_t codec )
+{
+    if ( !flush_nolock() )
+        return false;
+    size_t cnt = file_reccnt();
+    if ( cnt == 0 )
+        return true;
+
+    file_guard fd(*this);
+    if ( fd == -1 )
+        return false;
+    std::vector<uchar> recs( cnt * _reclen );
+    if ( read_at( fd, recs.data(), recs.size(), 0 ) != (ssize_t)recs.size() )
+        return false;
+    uint64_t log_check = BloomFilter::hash( recs.data(), recs.size() );
+
+    // sort by key, first copy in the file wins (that's the one search finds)
+    IndexList order( cnt );
+    for ( size_t i(0); i < cnt; ++i )
+        order[i] = i;
+    std::stable_sort( order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        return std::memcmp( recs.data() + a * _reclen, recs.data() + b * _reclen, _keylen ) < 0;
+    });
+
+    std::string fspec = run_fspec( _run_seq );
+    std::string tmp = fspec + ".tmp";
+    RunWriter rw( tmp, _keylen, _vallen, cnt, bloom_bits, codec );
+    ucharptr prev = nullptr;
+    for ( auto i : order )
+    {
+        ucharptr p = recs.data() + i * _reclen;
+        if ( prev != nullptr && !std::memcmp( prev, p, _keylen ) )
+            continue;
+        rw.add( p );
+        prev = p;
+    }
+    rw.set_lineage( RunLineage{ 0, cnt, log_check } );
+    // the run must be on disk before the log it replaces is truncated
+    if ( !rw.finish() || !sync_rename( tmp, fspec ) )
+    {
+        std::filesystem::remove( tmp );
+        std::cout << "Error writing run " << fspec << " - log left as is" << std::endl;
+        return false;
+    }
+    SortedRunPtr run = std::make_shared<SortedRun>( fspec, _keylen, _vallen );
+    if ( !run->load() )
+        return false;
+    _runs.push_back( run );
+    _run_seq++;
+
+    if ( ::ftruncate( fd, 0 ) != 0 )
+        return false;
+    _reccnt -= _logcnt;
+    _gen++;
+    _reccnt += run->size();
+    _logcnt = 0;
+    return true;
+}
+
+// k-way merge of all runs into one. Where runs disagree, the newest
+// version of a record is kept. The merged run gets the highest sequence
+// number, and its lineage says every earlier run went into it, so
+// load_runs() drops the inputs if they outlive a crash.
+bool DiskHashTable::BucketFile::merge_runs_nolock( uint32_t bloom_bits, uint16_t codec )
+{
+    if ( _runs.size() < 2 )
+        return true;
+
+    struct Cursor
+    {
+        SortedRunPtr       run;
+        std::vector<uchar> buff;
+        size_t             blk;
+        size_t             cnt;
+        size_t             pos;
+        ucharptr rec() { return buff.data() + pos; }
+    };
+    std::vector<Cursor> curs;
+    size_t total(0);
+    for ( auto& run : _runs )
+    {
+        Cursor c{ run, std::vector<uchar>( RUN_BLOCK_RECS * _reclen ), 0, 0, 0 };
+        c.cnt = run->read_block( 0, c.buff.data() ) * _reclen;
+        curs.push_back( std::move( c ) );
+        total += run->size();
+    }
+    auto advance = [&](Cursor& c)
+    {
+        c.pos += _reclen;
+        if ( c.pos >= c.cnt )
+        {
+            c.blk++;
+            c.pos = 0;
+            c.cnt = c.run->read_block( c.blk, c.buff.data() ) * _reclen;
+        }
+    };
+
+    std::string fspec = run_fspec( _run_seq );
+    std::string tmp = fspec + ".tmp";
+    RunWriter rw( tmp, _keylen, _vallen, total, bloom_bits, codec );
+    bool ok = true;
+    while ( ok )
+    {
+        // newest run is last - on ties keep the first one looked at
+        Cursor* best = nullptr;
+        for ( auto itr = curs.rbegin(); itr != curs.rend(); ++itr )
+            if ( itr->pos < itr->cnt
+              && ( best == nullptr || std::memcmp( itr->rec(), best->rec(), _keylen ) < 0 ) )
+                best = &*itr;
+        if ( best == nullptr )
+            break;
+        ok = rw.add( best->rec() );
+        std::vector<uchar> key( best->rec(), best->rec() + _keylen );
+        for ( auto& c : curs )
+            if ( c.pos < c.cnt && !std::memcmp( c.rec(), key.data(), _keylen ) )
+                advance( c );
+    }
+    rw.set_lineage( RunLineage{ _run_seq, 0, 0 } );
+    // and the merged run before the runs it replaces are removed
+    if ( !ok || !rw.finish() || !sync_rename( tmp, fspec ) )
+    {
+        std::filesystem::remove( tmp );
+        std::cout << "Error merging runs into " << fspec << " - runs left as is" << std::endl;
+        return false;
+    }
+    SortedRunPtr run = std::make_shared<SortedRun>( fspec, _keylen, _vallen );
+    if ( !run->load() )
+        return false;
+    _run_seq++;
+    for ( auto& old : _runs )
+        old->remove();
+    _runs.clear();
+    _runs.push_back( run );
+    _reccnt = _logcnt + run->size();
+    return true;
+}
+
+// A crash between writing a run and truncating the log it came from
+// leaves the records in both. If the log is still exactly what the run
+// was compacted from, drop it.
+bool DiskHashTable::BucketFile::drop_compacted_log( const RunLineage& lineage )
+{
+    auto lock = write_lock();
+    if ( lineage.log_cnt == 0 || file_reccnt() != lineage.log_cnt || !_wbuf.empty() )
+        return false;
+    file_guard fd(*this);
+    if ( fd == -1 )
+        return false;
+    std::vector<uchar> recs( lineage.log_cnt * _reclen );
+    if ( read_at( fd, recs.data(), recs.size(), 0 ) != (ssize_t)recs.size()
+      || BloomFilter::hash( recs.data(), recs.size() ) != lineage.log_check
+      || ::ftruncate( fd, 0 ) != 0 )
+        return false;
+    _reccnt -= _logcnt;
+    _logcnt = 0;
+    _gen++;
+    return true;
+}
+
+void DiskHashTable::BucketFile::remove_runs()
+{
+    auto lock = write_lock();
+    for ( auto& run : _runs )
+        run->remove();
+    _runs.clear();
+    _reccnt = _logcnt;
+}
+
+DhtStats DiskHashTable::BucketFile::Counters::snapshot() const
+{
+    return DhtStats{ searches, hits, misses, recs_compared, bytes_read, bytes_written,
+                     appends, updates, lock_waits, lock_wait_ns, opens, run_probes, bloom_skips };
+}
+
+void DiskHashTable::BucketFile::Counters::reset()
+{
+    for ( auto c : { &searches, &hits, &misses, &recs_compared, &bytes_read, &bytes_written,
+                     &appends, &updates, &lock_waits, &lock_wait_ns, &opens, &run_probes, &bloom_skips } )
+        *c = 0;
+}
+
+void DiskHashTable::BucketFile::Counters::found( size_t hit_cnt, size_t key_cnt )
+{
+    searches += key_cnt;
+    hits     += hit_cnt;
+    misses   += key_cnt - hit_cnt;
+}
+
+// maintain a file buffer for each thread
+BuffPtr DiskHashTable::BucketFile::get_file_buff()
+{
+    thread_local BuffPtr buff(
+        new unsigned char[ TABLE_BUFF_SIZE ],
+        std::default_delete<uchar[]>()
+    );
+    return buff;
+}
+
+DhtStats& DhtStats::operator+=( const DhtStats& o )
+{
+    searches      += o.searches;
+    hits          += o.hits;
+    misses        += o.misses;
+    recs_compared += o.recs_compared;
+    bytes_read    += o.bytes_read;
+    bytes_written += o.bytes_written;
+    appends       += o.appends;
+    updates       += o.updates;
+    lock_waits    += o.lock_waits;
+    lock_wait_ns  += o.lock_wait_ns;
+    opens         += o.opens;
+    run_probes    += o.run_probes;
+    bloom_skips   += o.bloom_skips;
+    return *this;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// DiskHashTable
+//
+// Default hasher
+DiskHashTable::DiskHashTable()
+: buckfunc(default_hasher)
+, hasher_id(DHT_DEFAULT_HASHER)
+, split_recs(BUCKET_SPLIT_RECS)
+, storage(DHT_STORAGE_LOG)
+, lsm_log_recs(LSM_LOG_RECS)
+, lsm_max_runs(LSM_MAX_RUNS)
+, lsm_bloom_bits(LSM_BLOOM_BITS)
+, lsm_codec(RUN_CODEC_RAW)
+, compact_stop(false)
+, retired{}
+{}
+
+bool DiskHashTable::open(
+    const std::string  path_name,
+    const std::string  base_name,
+    int                level,
+    size_t             key_len,
+    size_t             val_len
+)
+{
+    name     = base_name;
+    keylen   = key_len;
+    vallen   = val_len;
+    reclen   = key_len + val_len;
+    reccnt   = 0;
+    last_sweep = std::chrono::steady_clock::now().time_since_epoch().count();
+
+    std::stringstream ss;
+    ss << path_name << level << '/' << name << '/';
+    path = ss.str();
+    std::filesystem::create_directories( path );
+
+    // the buckets of a table are where its hasher put them
+    DhtManifestHeader hdr;
+    if ( read_manifest_header( path, name, hdr )
+      && std::string( hdr.hasher, strnlen( hdr.hasher, sizeof(hdr.hasher) ) ) != hasher_id )
+    {
+        std::cout << "Table " << path << name << " was built with hasher '"
+                  << std::string( hdr.hasher, strnlen( hdr.hasher, sizeof(hdr.hasher) ) )
+                  << "', not '" << hasher_id << "' - not opened" << std::endl;
+        path.clear();
+        return false;
+    }
+
+    // preload the bucket file table so we have record counts
+    // but only for files that exist
+    if ( load_manifest() )
+    {
+        if ( storage == DHT_STORAGE_LSM )
+            load_runs( false );
+    }
+    else
+    {
+        split_set = read_directory( path, name );
+        BucketIdList buckets = list_buckets( path, name, true );
+        check_columns( !buckets.empty() );
+        if ( storage != DHT_STORAGE_COLUMNS )
+            load_runs( true );
+        for ( auto& bucket : buckets )
+            get_bucket( bucket, true );
+        std::shared_lock<std::shared_mutex> lock( map_mtx );
+        for ( auto& b : fp_map )
+            reccnt += b.second->_reccnt;
+    }
+    // the table is open - the manifest goes stale from here on
+    std::filesystem::remove( get_manifest_fspec( path, name ) );
+
+    if ( storage == DHT_STORAGE_LSM )
+    {
+        compact_stop = false;
+        compactor = std::thread( &DiskHashTable::compact_loop, this );
+    }
+
+    return true;
+}
+
+DiskHashTable::~DiskHashTable()
+{
+    close();
+}
+
+bool DiskHashTable::close()
+{
+    if ( path.empty() )
+        return false;   // never opened
+    stop_compactor();
+    bool ok = flush();
+    return write_manifest() && ok;
+}
+
+// hash the key, then walk down the split prefixes to the live bucket
+std::string DiskHashTable::calc_bucket_id( ucharptr_c key )
+{
+    std::string hash = buckfunc( key, keylen );
+    size_t len = std::min( (size_t)BUCKET_ID_WIDTH, hash.size() );
+    while ( len < hash.size() && split_set.contains( hash.substr( 0, len ) ) )
+        len++;
+    return hash.substr( 0, len );
+}
+
+bool DiskHashTable::search( ucharptr_c key, ucharptr val )
+{
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::string bucket = calc_bucket_id( key );
+    BucketFilePtr bp = get_bucket( bucket );
+    return bp != nullptr && bp->search( key, val ) != -1;
+}
+
+bool DiskHashTable::insert( ucharptr_c key, ucharptr_c val )
+{
+    Handle handle;
+    return insert_or_get( key, val, handle );
+}
+
+bool DiskHashTable::insert_or_get( ucharptr_c key, ucharptr val, Handle& handle )
+{
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::string bucket = calc_bucket_id( key );
+    BucketFilePtr bp = get_bucket( bucket );
+    size_t   recno(0);
+    uint64_t gen(0);
+    bool ok = bp != nullptr && bp->insert_or_get( key, val, recno, gen );
+    if ( ok )
+    {
+        reccnt++;
+        handle = Handle{ bp, gen, recno };
+    }
+    guard.unlock();
+    sweep_write_buffers();
+    maybe_split( bucket, bp );
+    maybe_compact( bucket, bp );
+    return ok;
+}
+
+// split_mtx keeps the bucket from being split while it is written
+bool DiskHashTable::update( const Handle& handle, ucharptr_c val )
+{
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    BucketFilePtr bp = handle.bucket.lock();
+    return bp != nullptr && bp->update_at( handle.recno, handle.gen, val );
+}
+
+bool DiskHashTable::append( ucharptr_c key, ucharptr_c val )
+{
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::string bucket = calc_bucket_id( key );
+    BucketFilePtr bp = get_bucket( bucket );
+    bool ok = bp != nullptr;
+    if ( ok )
+        ok = bp->append( key, val );
+    if ( ok )
+        reccnt++;
+    guard.unlock();
+    sweep_write_buffers();
+    maybe_split( bucket, bp );
+    maybe_compact( bucket, bp );
+    return ok;
+}
+
+bool DiskHashTable::update( ucharptr_c key, ucharptr_c val )
+{
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::string bucket = calc_bucket_id( key );
+    BucketFilePtr bp = get_bucket( bucket );
+    bool ok = bp != nullptr && bp->update( key, val );
+    guard.unlock();
+    maybe_compact( bucket, bp );
+    return ok;
+}
+
+std::map<std::string, IndexList> DiskHashTable::group_by_bucket( ucharptr_c keys, size_t cnt )
+{
+    std::map<std::string, IndexList> groups;
+    for ( size_t k(0); k < cnt; ++k )
+        groups[ calc_bucket_id( keys + k * keylen ) ].push_back( k );
+    return groups;
+}
+
+size_t DiskHashTable::search_many( std::span<const uchar> keys, std::span<uchar> vals, FoundList& found )
+{
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    size_t cnt = keys.size() / keylen;
+    ucharptr_c kp = (ucharptr)keys.data();
+    ucharptr   vp = vals.empty() ? nullptr : vals.data();
+    found.assign( cnt, false );
+    size_t hits(0);
+    for ( auto& g : group_by_bucket( kp, cnt ) )
+    {
+        BucketFilePtr bp = get_bucket( g.first );
+        if ( bp != nullptr )
+            hits += bp->search_many( kp, g.second, vp, found );
+    }
+    return hits;
+}
+
+size_t DiskHashTable::insert_many( std::span<const uchar> keys, std::span<uchar> vals, FoundList& inserted )
+{
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    size_t cnt = keys.size() / keylen;
+    ucharptr_c kp = (ucharptr)keys.data();
+    ucharptr   vp = vals.empty() ? nullptr : vals.data();
+    inserted.assign( cnt, false );
+    size_t added(0);
+    std::vector<std::pair<std::string, BucketFilePtr>> touched;
+    for ( auto& g : group_by_bucket( kp, cnt ) )
+    {
+        BucketFilePtr bp = get_bucket( g.first );
+        if ( bp != nullptr )
+        {
+            added += bp->insert_many( kp, g.second, vp, inserted );
+            touched.push_back( {g.first, bp} );
+        }
+    }
+    reccnt += added;
+    guard.unlock();
+    sweep_write_buffers();
+    for ( auto& t : touched )
     {
-        struct stat stat_buf;
-        if ( !stat( fspec.c_str(), &stat_buf ) )
-            _reccnt = stat_buf.st_size / _reclen;
-        close();
+        maybe_split( t.first, t.second );
+        maybe_compact( t.first, t.second );
     }
+    return added;
 }
 
-DiskHashTable::BucketFile::~BucketFile()
+// Every bucket being searched is held (shared) from its first read to
+// its last. Buckets are taken in bucket order, as in append_many_async,
+// so two threads can't deadlock over them.
+size_t DiskHashTable::search_many_async( AsyncIO& aio, std::span<const uchar> keys, std::span<uchar> vals, FoundList& found )
 {
-    close();
-}
+    struct Scan
+    {
+        BucketFilePtr                       bp;
+        std::shared_lock<std::shared_mutex> lock;
+        IndexList                           idx;
+        size_t                              key_cnt;
+        int                                 fd;
+        size_t                              next;       // next byte to read
+        size_t                              end;        // bytes in the file
+        size_t                              stride;     // bytes per record in the file
+        size_t                              inflight;
+    };
 
-bool DiskHashTable::BucketFile::open()
-{
-    if ( _fp == nullptr )
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    size_t cnt = keys.size() / keylen;
+    ucharptr_c kp = (ucharptr)keys.data();
+    ucharptr   vp = vals.empty() ? nullptr : vals.data();
+    found.assign( cnt, false );
+    size_t hits(0);
+
+    std::vector<Scan> scans;
+    for ( auto& g : group_by_bucket( kp, cnt ) )
     {
-        const char *mode = (std::filesystem::exists(_fspec)) ? "r+" : "w+";
-        _fp = std::fopen( _fspec.c_str(), mode );
-        if ( _fp == nullptr )
+        BucketFilePtr bp = get_bucket( g.first );
+        if ( bp != nullptr )
+            scans.push_back( Scan{ bp, std::shared_lock<std::shared_mutex>(), g.second, g.second.size(), -1, 0, 0, bp->file_stride(), 0 } );
+    }
+
+    // one read buffer per ring slot
+    size_t chunk = std::max( (size_t)AIO_READ_SIZE, reclen );
+    thread_local std::vector<uchar> pool;
+    pool.resize( aio.depth() * chunk );
+    IndexList bufs;
+    IndexList buf_pos( aio.depth() );   // file position of each buffer's read
+    for ( size_t b(0); b < aio.depth(); ++b )
+        bufs.push_back( b );
+
+    auto begin_scan = [&]( Scan& sc )
+    {
+        sc.lock = sc.bp->read_lock();
+        sc.end  = sc.bp->file_reccnt() * sc.stride;
+        if ( sc.end > 0 )
+            sc.fd = sc.bp->open();
+    };
+    auto end_scan = [&]( Scan& sc )
+    {
+        hits += sc.bp->search_tail_nolock( kp, sc.idx, vp, found );
+        sc.bp->_ctr.found( sc.key_cnt - sc.idx.size(), sc.key_cnt );
+        if ( sc.fd != -1 )
+            sc.bp->close();
+        sc.lock.unlock();
+    };
+
+    std::deque<size_t> issuable;
+    std::vector<AioCompletion> done;
+    size_t next_scan(0);
+    while ( true )
+    {
+        // keep the ring full - round robin over the buckets being read
+        while ( !bufs.empty() && !aio.full() )
         {
-            std::cout << "Error opening bucket file " << _fspec << ' ' << errno << " - terminating" << std::endl;
-            return false;
+            if ( issuable.empty() )
+            {
+                if ( next_scan == scans.size() )
+                    break;
+                Scan& sc = scans[ next_scan ];
+                begin_scan( sc );
+                if ( sc.fd == -1 )
+                    end_scan( sc );
+                else
+                    issuable.push_back( next_scan );
+                next_scan++;
+                continue;
+            }
+            size_t s = issuable.front();
+            issuable.pop_front();
+            Scan& sc = scans[s];
+            if ( sc.idx.empty() || sc.next >= sc.end )
+                continue;
+            size_t b = bufs.back();
+            bufs.pop_back();
+            size_t len = std::min( chunk / sc.stride * sc.stride, sc.end - sc.next );
+            aio.prep_read( sc.fd, pool.data() + b * chunk, len, sc.next, s * aio.depth() + b );
+            buf_pos[b] = sc.next;
+            sc.next += len;
+            sc.inflight++;
+            if ( sc.next < sc.end )
+                issuable.push_back( s );
+        }
+        aio.submit();
+        if ( aio.pending() == 0 )
+            break;
+
+        aio.wait( done, 1 );
+        for ( auto& c : done )
+        {
+            size_t s = c.tag / aio.depth();
+            size_t b = c.tag % aio.depth();
+            Scan& sc = scans[s];
+            if ( c.result > 0 )
+            {
+                sc.bp->_ctr.bytes_read += c.result;
+                size_t key_recno = sc.bp->_columnar ? buf_pos[b] / sc.stride : RECNO_NONE;
+                hits += sc.bp->match_nolock( pool.data() + b * chunk, c.result / sc.stride, kp, sc.idx, vp, found, key_recno );
+            }
+            bufs.push_back( b );
+            sc.inflight--;
+            if ( sc.inflight == 0 && ( sc.idx.empty() || sc.next >= sc.end ) )
+                end_scan( sc );
         }
     }
-    return true;
+    return hits;
 }
 
-bool DiskHashTable::BucketFile::close()
+// Records are buffered under each bucket's lock, and buckets whose
+// buffers are due are written through the ring while still locked.
+// A failed write leaves its records buffered, as flush() does.
+size_t DiskHashTable::append_many_async( AsyncIO& aio, std::span<const uchar> keys, std::span<const uchar> vals )
 {
-    if ( _fp != nullptr )
+    struct Flush
+    {
+        BucketFilePtr                       bp;
+        std::unique_lock<std::shared_mutex> lock;
+        int                                 fd;
+        size_t                              len;
+    };
+
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    size_t cnt = keys.size() / keylen;
+    ucharptr_c kp = (ucharptr)keys.data();
+    ucharptr_c vp = vals.empty() ? nullptr : (ucharptr)vals.data();
+    size_t added(0);
+    std::vector<std::pair<std::string, BucketFilePtr>> touched;
+    std::vector<Flush> flushes;
+    std::vector<AioCompletion> done;
+
+    auto complete = [&]()
+    {
+        aio.submit();
+        aio.wait( done, 1 );
+        for ( auto& c : done )
+        {
+            Flush& f = flushes[ c.tag ];
+            if ( c.result == (ssize_t)f.len )
+            {
+                f.bp->_ctr.bytes_written += f.len;
+                f.bp->_wbuf.clear();
+            }
+            else
+                std::cout << "Error writing bucket file " << f.bp->_fspec << ' ' << -c.result << std::endl;
+            f.bp->close();
+            f.lock.unlock();
+        }
+    };
+
+    auto groups = group_by_bucket( kp, cnt );
+    flushes.reserve( groups.size() );
+    for ( auto& g : groups )
+    {
+        BucketFilePtr bp = get_bucket( g.first );
+        if ( bp == nullptr )
+            continue;
+        auto lock = bp->write_lock();
+        for ( auto k : g.second )
+            bp->buffer_nolock( kp + k * keylen, ( vp != nullptr ) ? vp + k * vallen : P_NAUGHT );
+        added += g.second.size();
+        touched.push_back( {g.first, bp} );
+        if ( !bp->flush_due() )
+            continue;
+        if ( bp->_columnar )
+        {
+            bp->flush_nolock();
+            continue;
+        }
+
+        int fd = bp->open();
+        if ( fd == -1 )
+            continue;
+        while ( aio.full() )
+            complete();
+        flushes.push_back( Flush{ bp, std::move( lock ), fd, bp->_wbuf.size() } );
+        aio.prep_write( fd, bp->_wbuf.data(), bp->_wbuf.size(), bp->file_reccnt() * reclen, flushes.size() - 1 );
+    }
+    while ( aio.pending() > 0 )
+        complete();
+    reccnt += added;
+    guard.unlock();
+    sweep_write_buffers();
+    for ( auto& t : touched )
     {
-        std::fclose( _fp );
-        _fp = nullptr;
+        maybe_split( t.first, t.second );
+        maybe_compact( t.first, t.second );
     }
-    return true;
+    return added;
 }
 
-off_t DiskHashTable::BucketFile::search(ucharptr_c key, ucharptr val)
+DhtStats DiskHashTable::stats()
 {
-    std::lock_guard<std::mutex> lock(_mtx);
-    return search_nolock(key, val);
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::shared_lock<std::shared_mutex> lock( map_mtx );
+    DhtStats total( retired );
+    for ( auto& b : fp_map )
+        total += b.second->_ctr.snapshot();
+    return total;
 }
 
-off_t DiskHashTable::BucketFile::search_nolock(ucharptr_c key, ucharptr val)
+std::vector<DhtBucketStats> DiskHashTable::bucket_stats()
+{
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::shared_lock<std::shared_mutex> lock( map_mtx );
+    std::vector<DhtBucketStats> buckets;
+    buckets.reserve( fp_map.size() );
+    for ( auto& b : fp_map )
+        buckets.push_back( DhtBucketStats{ b.first, b.second->_reccnt, b.second->_runs.size(), b.second->_ctr.snapshot() } );
+    return buckets;
+}
+
+void DiskHashTable::reset_stats()
+{
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::shared_lock<std::shared_mutex> lock( map_mtx );
+    retired = DhtStats{};
+    for ( auto& b : fp_map )
+        b.second->_ctr.reset();
+}
+
+std::vector<size_t> DiskHashTable::size_histogram()
+{
+    std::vector<size_t> hist;
+    for ( auto& b : bucket_stats() )
+    {
+        size_t slot(0);
+        for ( size_t n( b.rec_cnt ); n > 1; n >>= 1 )
+            slot++;
+        if ( hist.size() <= slot )
+            hist.resize( slot + 1, 0 );
+        hist[ slot ]++;
+    }
+    return hist;
+}
+
+// The pass holds split_mtx shared throughout, so no bucket is split
+// (and deleted) under it.
+size_t DiskHashTable::for_each_block( BlockFunc fn, size_t threads )
 {
-    file_guard fg(*this);
-    int max_item_cnt = TABLE_BUFF_SIZE / _reclen;
-    BuffPtr buff = get_file_buff();
-    std::fseek(_fp, 0, SEEK_SET);
-    fpos_t pos;  // file position at start of block
-    std::fgetpos(_fp, &pos);
-    size_t rec_cnt = std::fread(buff.get(), _reclen, max_item_cnt, _fp);
-    while ( rec_cnt > 0 )
-    {
-        unsigned char *p = buff.get();
-        for ( int i(0); i < rec_cnt; ++i )
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::vector<BucketFilePtr> buckets;
+    size_t total(0);
+    BeginDummyScope
+        std::shared_lock<std::shared_mutex> lock( map_mtx );
+        for ( auto& b : fp_map )
+        {
+            buckets.push_back( b.second );
+            total += b.second->_reccnt;
+        }
+    EndDummyScope
+    if ( buckets.empty() )
+        return 0;
+    threads = std::clamp( threads, (size_t)1, buckets.size() );
+
+    // cut the bucket list where the running record count passes each
+    // multiple of total/threads
+    IndexList cuts{ 0 };
+    size_t per = total / threads + 1;
+    size_t acc(0);
+    for ( size_t i(0); i < buckets.size() && cuts.size() < threads; ++i )
+    {
+        acc += buckets[i]->_reccnt;
+        if ( acc >= per * cuts.size() )
+            cuts.push_back( i + 1 );
+    }
+    cuts.push_back( buckets.size() );
+
+    std::atomic<size_t> visited(0);
+    auto scan = [&]( size_t first, size_t last )
+    {
+        size_t max_recs = std::max( (size_t)ITER_BUFF_SIZE / reclen, (size_t)1 );
+        std::vector<uchar> buff( max_recs * reclen );
+        size_t cnt(0);
+        for ( size_t b( first ); b < last; ++b )
         {
-            if ( !std::memcmp( p, key, _keylen ) )
+            size_t n;
+            for ( size_t recno(0); ( n = buckets[b]->read_block( recno, buff.data(), max_recs ) ) > 0; recno += n )
             {
-                if ( _vallen != 0 && val != P_NAUGHT )
-                    std::memcpy( val, p + _keylen, _vallen );
-                off_t off = pos.__pos + ( p - buff.get() );
-                return off;
+                fn( buff.data(), n );
+                cnt += n;
             }
-            p += _reclen;
         }
-        std::fgetpos( _fp, &pos );
-        rec_cnt = std::fread( buff.get(), _reclen, max_item_cnt, _fp );
-    }
-    return -1;
+        visited += cnt;
+    };
+
+    std::vector<std::thread> pool;
+    for ( size_t t(1); t + 1 < cuts.size(); ++t )
+        pool.emplace_back( scan, cuts[t], cuts[t + 1] );
+    scan( cuts[0], cuts[1] );
+    for ( auto& th : pool )
+        th.join();
+    return visited;
 }
 
+bool DiskHashTable::flush()
+{
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::shared_lock<std::shared_mutex> lock( map_mtx );
+    bool ok = true;
+    for ( auto& b : fp_map )
+        ok = b.second->flush() && ok;
+    return ok;
+}
 
-bool DiskHashTable::BucketFile::append( ucharptr_c key, ucharptr_c val )
+// buckets that are not appended to don't get a chance to notice that
+// their buffers are stale, so once in a while visit all of them.
+// Only the thread that advances last_sweep does the visiting.
+void DiskHashTable::sweep_write_buffers()
 {
-    std::lock_guard<std::mutex> lock( _mtx );
-    return append_nolock( key, val );
+    typedef std::chrono::steady_clock Clock;
+    auto now  = Clock::now();
+    auto age  = std::chrono::milliseconds( APPEND_FLUSH_MS );
+    auto last = last_sweep.load();
+    if ( now - Clock::time_point( Clock::duration( last ) ) < age )
+        return;
+    if ( !last_sweep.compare_exchange_strong( last, now.time_since_epoch().count() ) )
+        return;
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::shared_lock<std::shared_mutex> lock( map_mtx );
+    for ( auto& b : fp_map )
+        b.second->flush_if_older( now - age );
 }
 
-bool DiskHashTable::BucketFile::append_nolock( ucharptr_c key, ucharptr_c val )
+void DiskHashTable::set_lsm_options( size_t log_recs, size_t max_runs, uint32_t bloom_bits )
 {
-    fpos_t pos;
-    file_guard fg(*this);
-    std::fseek( _fp, 0, SEEK_END );
-    std::fgetpos( _fp, &pos );
-    std::fwrite( key, _keylen, 1, _fp );
-    if ( _vallen != 0 )
+    lsm_log_recs   = log_recs;
+    lsm_max_runs   = std::max( max_runs, (size_t)1 );
+    lsm_bloom_bits = bloom_bits;
+}
+
+void DiskHashTable::set_run_compression( bool on )
+{
+    lsm_codec = on ? RUN_CODEC_LZ4 : RUN_CODEC_RAW;
+}
+
+// hand the bucket to the compaction thread once its log is full
+void DiskHashTable::maybe_compact( const std::string& bucket, BucketFilePtr bp )
+{
+    if ( storage != DHT_STORAGE_LSM || bp == nullptr || bp->_logcnt < lsm_log_recs )
+        return;
+    std::lock_guard<std::mutex> lock( compact_mtx );
+    if ( compact_pending.insert( bucket ).second )
     {
-        if ( val != P_NAUGHT )
-            std::fwrite( val, _vallen, 1, _fp );
-        else
-            std::fwrite( P_NAUGHT, 1, _vallen, _fp );
+        compact_queue.push_back( bucket );
+        compact_cv.notify_one();
     }
-    _reccnt++;
-    return true;
 }
 
-bool DiskHashTable::BucketFile::update(ucharptr_c key, ucharptr_c val)
+void DiskHashTable::compact_loop()
 {
-    std::lock_guard<std::mutex> lock( _mtx );
-    return update_nolock( key, val );
+    while ( true )
+    {
+        std::string bucket;
+        BeginDummyScope
+            std::unique_lock<std::mutex> lock( compact_mtx );
+            compact_cv.wait( lock, [this]{ return compact_stop || !compact_queue.empty(); } );
+            if ( compact_stop )
+                return;
+            bucket = compact_queue.front();
+            compact_queue.pop_front();
+            compact_pending.erase( bucket );
+        EndDummyScope
+        compact_bucket( bucket, lsm_max_runs );
+    }
 }
 
-bool DiskHashTable::BucketFile::update_nolock(ucharptr_c key, ucharptr_c val)
+// pending compactions are dropped - the logs are simply compacted the
+// next time around
+void DiskHashTable::stop_compactor()
 {
-    file_guard fg(*this);
-    off_t pos = search_nolock( key );
-    if( pos != -1 )
-    {
-        std::fseek( _fp, pos, SEEK_SET );
-        std::fwrite( key, _keylen, 1, _fp );
-        if ( _vallen != 0 )
-        {
-            if ( val != P_NAUGHT )
-                std::fwrite( val, _vallen, 1, _fp );
-            else
-                std::fwrite( P_NAUGHT, 1, _vallen, _fp );
-        }
+    if ( !compactor.joinable() )
+        return;
+    BeginDummyScope
+        std::lock_guard<std::mutex> lock( compact_mtx );
+        compact_stop = true;
+        compact_queue.clear();
+        compact_pending.clear();
+    EndDummyScope
+    compact_cv.notify_all();
+    compactor.join();
+}
+
+// the bucket may have been split away since it was queued
+void DiskHashTable::compact_bucket( const std::string& bucket, size_t max_runs )
+{
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    BucketFilePtr bp;
+    BeginDummyScope
+        std::shared_lock<std::shared_mutex> lock( map_mtx );
+        auto itr = fp_map.find( bucket );
+        if ( itr == fp_map.end() )
+            return;
+        bp = itr->second;
+    EndDummyScope
+    bp->compact( max_runs, lsm_bloom_bits, lsm_codec );
+}
+
+bool DiskHashTable::compact()
+{
+    if ( storage != DHT_STORAGE_LSM )
         return true;
-    }
-    return false;
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::shared_lock<std::shared_mutex> lock( map_mtx );
+    bool ok = true;
+    for ( auto& b : fp_map )
+        ok = b.second->compact( 1, lsm_bloom_bits, lsm_codec ) && ok;
+    return ok;
 }
 
-// read a specific record from the file. Return true
-// if record was read, or false if EOF.
-bool DiskHashTable::BucketFile::read( size_t recno, ucharptr key, ucharptr val )
+void DiskHashTable::maybe_split( const std::string& bucket, BucketFilePtr bp )
+{
+    if ( bp != nullptr && split_recs != 0 && bp->_reccnt > split_recs )
+        split_bucket( bucket );
+}
+
+// Split the bucket into sixteen buckets one hex digit longer. The whole
+// table is locked while this happens. The new buckets are on disk before
+// the directory records the split, and the old bucket is only deleted
+// once that is on disk too, so list_buckets() can always tell which
+// files are live after a crash.
+bool DiskHashTable::split_bucket( const std::string& bucket )
 {
-    std::lock_guard<std::mutex> lock( _mtx );
-    file_guard fg(*this);
-    BuffPtr buff = get_file_buff();
-    off_t pos = recno * _reclen;
-    std::fseek( _fp, pos, SEEK_SET );
-    if ( std::fread( buff.get(), _reclen, 1, _fp ) != EOF )
+    std::unique_lock<std::shared_mutex> guard( split_mtx );
+    BucketFilePtr bp;
+    BeginDummyScope
+        std::shared_lock<std::shared_mutex> lock( map_mtx );
+        auto itr = fp_map.find( bucket );
+        if ( itr == fp_map.end() )
+            return false;   // somebody else got here first
+        bp = itr->second;
+    EndDummyScope
+    if ( bp->_reccnt <= split_recs || bucket.size() >= BUCKET_ID_MAX_WIDTH )
+        return false;
+
+    // an LSM bucket is folded into a single run first, so only the live
+    // version of each record is copied
+    if ( !( ( storage == DHT_STORAGE_LSM ) ? bp->compact( 1, lsm_bloom_bits, lsm_codec ) : bp->flush() ) )
+        return false;
+    size_t max_recs = TABLE_BUFF_SIZE / reclen;
+    BuffPtr buff = bp->get_file_buff();
+    size_t cnt = bp->read_block( 0, buff.get(), 1 );
+    if ( cnt == 0 || buckfunc( buff.get(), keylen ).size() <= bucket.size() )
+        return false;       // hasher doesn't provide any more digits
+
+    // fan the records out to the new buckets
+    std::map<std::string, BucketFilePtr> kids;
+    for ( int i(0); i < 16; ++i )
+    {
+        char digit[2];
+        std::sprintf( digit, "%x", i );
+        std::string kid = bucket + digit;
+        std::string fspec = get_bucket_fspec( kid );
+        remove_bucket_files( fspec );       // leftover from a failed split
+        kids[ kid ] = make_bucket( fspec );
+    }
+    bool ok = true;
+    for ( size_t recno(0); ok && ( cnt = bp->read_block( recno, buff.get(), max_recs ) ) > 0; recno += cnt )
     {
         ucharptr p = buff.get();
-        std::memcpy( key, p, _keylen );
-        if ( _vallen != 0 )
-            std::memcpy( val, p + _keylen, _vallen );
-        return true;
+        for ( size_t i(0); i < cnt; ++i, p += reclen )
+        {
+            std::string kid = buckfunc( p, keylen ).substr( 0, bucket.size() + 1 );
+            ok = ok && kids[ kid ]->append( p, ( vallen != 0 ) ? p + keylen : P_NAUGHT );
+        }
+    }
+    for ( auto& k : kids )
+        ok = k.second->sync() && ok;
+    ok = ok && sync_path( path );
+
+    BucketIdSet splits( split_set );
+    splits.insert( bucket );
+    std::swap( split_set, splits );
+    if ( !ok || !write_directory() )
+    {
+        std::swap( split_set, splits );
+        for ( auto& k : kids )
+        {
+            std::string fspec = k.second->_fspec;
+            k.second.reset();
+            remove_bucket_files( fspec );
+        }
+        std::cout << "Error splitting bucket " << bp->_fspec << " - bucket left as is" << std::endl;
+        return false;
     }
-    return false;
+
+    std::unique_lock<std::shared_mutex> lock( map_mtx );
+    std::string fspec = bp->_fspec;
+    fp_map.erase( bucket );
+    bp->_gen++;     // outstanding handles now point nowhere
+    retired += bp->_ctr.snapshot();
+    bp->remove_runs();
+    bp.reset();
+    remove_bucket_files( fspec );
+    for ( auto& k : kids )
+        if ( k.second->_reccnt != 0 )
+            fp_map.insert( k );
+        else
+            remove_bucket_files( k.second->_fspec );
+    lock.unlock();
+    for ( auto& k : kids )
+        maybe_compact( k.first, k.second );
+    return true;
 }
 
-// maintain a map of file buffers - one for each thread
-BuffPtr DiskHashTable::BucketFile::get_file_buff()
+size_t DiskHashTable::rehash()
 {
-    std::hash<std::thread::id> hasher;
-    size_t id_hash = hasher( std::this_thread::get_id() );
-    if ( buff_map.find( id_hash ) == buff_map.end() )
+    size_t splits(0);
+    while ( true )
     {
-        buff_map[ id_hash ] = BuffPtr(
-            new unsigned char[ TABLE_BUFF_SIZE ],
-            std::default_delete<uchar[]>()
-        );
+        BucketIdList oversized;
+        BeginDummyScope
+            std::shared_lock<std::shared_mutex> lock( map_mtx );
+            for ( auto& b : fp_map )
+                if ( split_recs != 0 && b.second->_reccnt > split_recs )
+                    oversized.push_back( b.first );
+        EndDummyScope
+        size_t cnt(0);
+        for ( auto& bucket : oversized )
+            cnt += split_bucket( bucket ) ? 1 : 0;
+        if ( cnt == 0 )
+            break;
+        splits += cnt;
     }
-    return buff_map[ id_hash ];
+    return splits;
 }
 
-//////////////////////////////////////////////////////////////////////////////
-// DiskHashTable
-//
-// Default hasher
-DiskHashTable::DiskHashTable()
-{}
+// the directory is the list of bucket ids that have been split, one per line
+bool DiskHashTable::write_directory()
+{
+    std::string fspec = get_directory_fspec( path, name );
+    std::string tmp = fspec + ".tmp";
+    std::ofstream ofs( tmp, std::ios::trunc );
+    for ( auto& id : split_set )
+        ofs << id << '\n';
+    ofs.close();
+    if ( !ofs || !sync_path( tmp ) )
+        return false;
+    std::error_code ec;
+    std::filesystem::rename( tmp, fspec, ec );
+    if ( ec )
+        return false;
+    // the new directory is in place either way, so don't back out
+    if ( !sync_path( path ) )
+        std::cout << "Error syncing " << path << ' ' << errno << std::endl;
+    return true;
+}
 
-bool DiskHashTable::open(
-    const std::string  path_name,
-    const std::string  base_name,
-    int                level,
-    size_t             key_len,
-    size_t             val_len,
-    dht_bucket_id_func bucket_func
-)
+BucketIdSet DiskHashTable::read_directory( const std::string path, const std::string base )
 {
-    name     = base_name;
-    keylen   = key_len;
-    vallen   = val_len;
-    reclen   = key_len + val_len;
-    reccnt   = 0;
-    buckfunc = bucket_func;
+    BucketIdSet splits;
+    std::ifstream ifs( get_directory_fspec( path, base ) );
+    std::string id;
+    while ( ifs >> id )
+        splits.insert( id );
+    return splits;
+}
+
+std::string DiskHashTable::get_directory_fspec( const std::string path, const std::string base )
+{
+    std::stringstream ss;
+    ss << path << '/' << base << ".dir";
+    return ss.str();
+}
 
+std::string DiskHashTable::get_manifest_fspec( const std::string path, const std::string base )
+{
     std::stringstream ss;
-    ss << path_name << level << '/' << name << '/';
-    path = ss.str();
-    std::filesystem::create_directories( path );
+    ss << path << '/' << base << ".mf";
+    return ss.str();
+}
 
-    // preload the bucket file table so we have record counts
-    // but only for files that exist
-    char buff[ BUCKET_ID_WIDTH + 1 ];
-    for ( int i(0); i < BUCKET_HI; ++i )
+bool DiskHashTable::set_hasher( dht_bucket_id_func func, const std::string& id )
+{
+    if ( func == nullptr || id.empty() || id.size() > sizeof(DhtManifestHeader::hasher) )
     {
-        std::sprintf( buff, "%0*x", BUCKET_ID_WIDTH, i );
-        get_bucket( buff, true );
+        std::cout << "Bad hasher '" << id << "' - keeping '" << hasher_id << '\'' << std::endl;
+        return false;
     }
-
+    buckfunc  = func;
+    hasher_id = id;
     return true;
 }
 
-DiskHashTable::~DiskHashTable()
-{}
-
-std::string DiskHashTable::calc_bucket_id( ucharptr_c key )
+bool DiskHashTable::read_manifest_header( const std::string path, const std::string base, DhtManifestHeader& hdr )
 {
-    return buckfunc( key, keylen );
+    std::ifstream ifs( get_manifest_fspec( path, base ), std::ios::binary );
+    return ifs.read( (char *)&hdr, sizeof(hdr) )
+        && !std::memcmp( hdr.magic, DHT_MANIFEST_MAGIC, sizeof(hdr.magic) )
+        && hdr.version == DHT_MANIFEST_VERSION;
 }
 
-bool DiskHashTable::search( ucharptr_c key, ucharptr val )
+// load the bucket directory from the manifest. Returns false if there is
+// no usable manifest and the table has to be scanned.
+bool DiskHashTable::load_manifest()
 {
-    std::string bucket = calc_bucket_id( key );
-    BucketFilePtr bp = get_bucket( bucket );
-    return bp != nullptr && bp->search( key, val ) != -1;
-}
+    DhtManifestHeader hdr;
+    if ( !read_manifest_header( path, name, hdr ) )
+        return false;
+    if ( hdr.key_len != keylen || hdr.val_len != vallen )
+    {
+        std::cout << "Manifest for " << path << name << " does not match the table - ignored" << std::endl;
+        return false;
+    }
 
-bool DiskHashTable::insert( ucharptr_c key, ucharptr_c val )
-{
-    std::string bucket = calc_bucket_id( key );
-    BucketFilePtr bp = get_bucket( bucket );
-    bool ok = bp != nullptr;
-    if ( ok )
-        ok = bp->search( key, val ) == -1;
-    if ( ok )
-        ok = bp->append( key, val );
-    if ( ok )
-        reccnt++;
-    return ok;
+    std::ifstream ifs( get_manifest_fspec( path, name ), std::ios::binary );
+    ifs.seekg( sizeof(hdr) );
+    BucketIdSet splits;
+    char id[ BUCKET_ID_MAX_WIDTH + 1 ] = {0};
+    for ( uint32_t i(0); i < hdr.split_cnt && ifs.read( id, BUCKET_ID_MAX_WIDTH ); ++i )
+        splits.insert( id );
+    std::vector<DhtManifestBucket> buckets( hdr.bucket_cnt );
+    if ( !ifs.read( (char *)buckets.data(), buckets.size() * sizeof(DhtManifestBucket) ) )
+        return false;
+
+    split_set = splits;
+    // a log table may go LSM (its files are LSM logs), but a table
+    // stays in whatever columns it was written in
+    if ( hdr.storage != DHT_STORAGE_LOG )
+        storage = (DhtStorageMode)hdr.storage;
+    else if ( storage == DHT_STORAGE_COLUMNS )
+    {
+        std::cout << "Table " << path << name << " was not written in columns - opened as a log" << std::endl;
+        storage = DHT_STORAGE_LOG;
+    }
+    for ( auto& b : buckets )
+    {
+        std::memcpy( id, b.id, BUCKET_ID_MAX_WIDTH );
+        add_bucket( id, b.log_cnt );    // runs are counted as they are attached
+    }
+    reccnt = hdr.rec_cnt;
+    return true;
 }
 
-bool DiskHashTable::append( ucharptr_c key, ucharptr_c val )
+bool DiskHashTable::write_manifest()
 {
-    std::string bucket = calc_bucket_id( key );
-    BucketFilePtr bp = get_bucket( bucket );
-    bool ok = bp != nullptr;
-    if ( ok )
-        ok = bp->append( key, val );
-    if ( ok )
-        reccnt++;
-    return ok;
+    std::shared_lock<std::shared_mutex> guard( split_mtx );
+    std::shared_lock<std::shared_mutex> lock( map_mtx );
+    DhtManifestHeader hdr;
+    std::memset( &hdr, 0x00, sizeof(hdr) );
+    std::memcpy( hdr.magic, DHT_MANIFEST_MAGIC, sizeof(hdr.magic) );
+    hdr.version = DHT_MANIFEST_VERSION;
+    hdr.key_len = keylen;
+    hdr.val_len = vallen;
+    std::strncpy( hdr.hasher, hasher_id.c_str(), sizeof(hdr.hasher) );
+    hdr.storage   = storage;
+    hdr.split_cnt = split_set.size();
+    hdr.rec_cnt   = reccnt;
+
+    std::vector<DhtManifestBucket> buckets;
+    for ( auto& b : fp_map )
+    {
+        if ( b.second->_reccnt == 0 )
+            continue;   // never written, so there's no file
+        DhtManifestBucket mb;
+        std::memset( &mb, 0x00, sizeof(mb) );
+        std::memcpy( mb.id, b.first.c_str(), std::min( b.first.size(), sizeof(mb.id) ) );
+        mb.rec_cnt = b.second->_reccnt;
+        mb.log_cnt = b.second->_logcnt;
+        buckets.push_back( mb );
+    }
+    hdr.bucket_cnt = buckets.size();
+
+    std::string fspec = get_manifest_fspec( path, name );
+    std::string tmp = fspec + ".tmp";
+    std::ofstream ofs( tmp, std::ios::binary | std::ios::trunc );
+    ofs.write( (const char *)&hdr, sizeof(hdr) );
+    for ( auto& id : split_set )
+    {
+        char buff[ BUCKET_ID_MAX_WIDTH ] = {0};
+        std::memcpy( buff, id.c_str(), std::min( id.size(), sizeof(buff) ) );
+        ofs.write( buff, sizeof(buff) );
+    }
+    ofs.write( (const char *)buckets.data(), buckets.size() * sizeof(DhtManifestBucket) );
+    ofs.close();
+    if ( !ofs )
+        return false;
+    std::error_code ec;
+    std::filesystem::rename( tmp, fspec, ec );
+    return !ec;
 }
 
-bool DiskHashTable::update( ucharptr_c key, ucharptr_c val )
+// A bucket file is live if every shorter prefix of its id has been split
+// and the id itself has not.
+BucketIdList DiskHashTable::list_buckets( const std::string path, const std::string base, bool prune )
 {
-    std::string bucket = calc_bucket_id( key );
-    BucketFilePtr bp = get_bucket( bucket );
-    return bp != nullptr && bp->update( key, val );
+    BucketIdList buckets;
+    BucketIdSet splits = read_directory( path, base );
+    std::string lead = base + '_';
+    for ( auto& entry : std::filesystem::directory_iterator( path ) )
+    {
+        std::string fname = entry.path().filename().string();
+        if ( !entry.is_regular_file() || fname.rfind( lead, 0 ) != 0 )
+            continue;
+        std::string id = fname.substr( lead.size() );
+        // the value file of a columnar bucket lives and dies with it
+        bool values = id.ends_with( VALUE_FILE_SFX );
+        if ( values )
+            id.resize( id.size() - std::strlen( VALUE_FILE_SFX ) );
+        if ( id.size() < BUCKET_ID_WIDTH || id.find_first_not_of( "0123456789abcdef" ) != std::string::npos )
+            continue;
+        bool live = !splits.contains( id );
+        for ( size_t len( BUCKET_ID_WIDTH ); live && len < id.size(); ++len )
+            live = splits.contains( id.substr( 0, len ) );
+        if ( live && !values )
+            buckets.push_back( id );
+        else if ( !live && prune )
+            std::filesystem::remove( entry.path() );
+    }
+    std::sort( buckets.begin(), buckets.end() );
+    return buckets;
 }
 
 // return the file pointer for the given bucket
 // Open the file pointer if it's not already
 DiskHashTable::BucketFilePtr DiskHashTable::get_bucket( const std::string& bucket, bool must_exist )
 {
+    BeginDummyScope
+        std::shared_lock<std::shared_mutex> lock( map_mtx );
+        auto itr = fp_map.find( bucket );
+        if ( itr != fp_map.end() )
+            return itr->second;
+    EndDummyScope
+
+    bool exists;
+    std::string fspec = get_bucket_fspec( bucket, &exists );
+    if ( !exists && must_exist )
+        return nullptr;
+
+    // another thread may have beaten us to it
+    std::unique_lock<std::shared_mutex> lock( map_mtx );
     auto itr = fp_map.find( bucket );
     if ( itr != fp_map.end() )
         return itr->second;
+    BucketFilePtr bf = make_bucket( fspec );
+    fp_map.insert( {bucket, bf} );
+    return bf;
+}
 
-    bool exists;
-    std::string fspec = get_bucket_fspec( bucket, &exists );
-    BucketFilePtr bf = nullptr;
-    if ( exists || !must_exist )
+// add a bucket whose record count is known without looking at its file
+void DiskHashTable::add_bucket( const std::string& bucket, size_t rec_cnt )
+{
+    std::unique_lock<std::shared_mutex> lock( map_mtx );
+    fp_map.insert( {bucket, make_bucket( get_bucket_fspec( bucket ), &rec_cnt )} );
+}
+
+DiskHashTable::BucketFilePtr DiskHashTable::make_bucket( const std::string& fspec, const size_t* rec_cnt )
+{
+    BucketFilePtr bf = ( rec_cnt != nullptr )
+        ? std::make_shared<BucketFile>( fspec, keylen, vallen, *rec_cnt )
+        : std::make_shared<BucketFile>( fspec, keylen, vallen );
+    bf->_lsm = storage == DHT_STORAGE_LSM;
+    if ( storage == DHT_STORAGE_COLUMNS && vallen != 0 )
+        bf->set_columnar( rec_cnt == nullptr );
+    return bf;
+}
+
+// Without a manifest, value files are what mark a columnar table. A
+// table of plain bucket files can't be read as columns.
+void DiskHashTable::check_columns( bool has_buckets )
+{
+    bool columnar = false;
+    std::string lead = name + '_';
+    for ( auto& entry : std::filesystem::directory_iterator( path ) )
+    {
+        std::string fname = entry.path().filename().string();
+        if ( fname.rfind( lead, 0 ) == 0 && fname.ends_with( VALUE_FILE_SFX ) )
+        {
+            columnar = true;
+            break;
+        }
+    }
+    if ( columnar )
+        storage = DHT_STORAGE_COLUMNS;
+    else if ( has_buckets && storage == DHT_STORAGE_COLUMNS )
     {
-        bf = std::make_shared<BucketFile>( fspec, keylen, vallen );
-        if ( bf != nullptr )
-            fp_map.insert( {bucket, bf} );
+        std::cout << "Table " << path << name << " was not written in columns - opened as a log" << std::endl;
+        storage = DHT_STORAGE_LOG;
     }
-    return bf;
+}
+
+void DiskHashTable::remove_bucket_files( const std::string& fspec )
+{
+    std::filesystem::remove( fspec );
+    std::filesystem::remove( fspec + VALUE_FILE_SFX );
+}
+
+// Attach the sorted runs found on disk to their buckets, oldest first.
+// Any run means the table is in LSM mode. Runs of buckets that have
+// been split and half-written runs are leftovers from a crash, as are
+// runs already merged into a newer one and a log already compacted
+// into the newest run.
+void DiskHashTable::load_runs( bool prune )
+{
+    BucketIdSet splits = read_directory( path, name );
+    std::string lead = name + '_';
+    std::map<std::string, std::map<uint32_t, std::string>> runs;
+    for ( auto& entry : std::filesystem::directory_iterator( path ) )
+    {
+        std::string fname = entry.path().filename().string();
+        size_t dot = fname.rfind( ".r" );
+        if ( !entry.is_regular_file() || fname.rfind( lead, 0 ) != 0 || dot == std::string::npos )
+            continue;
+        std::string id  = fname.substr( lead.size(), dot - lead.size() );
+        std::string seq = fname.substr( dot + 2 );
+        bool live = id.size() >= BUCKET_ID_WIDTH && !splits.contains( id )
+                 && seq.find_first_not_of( "0123456789" ) == std::string::npos;
+        for ( size_t len( BUCKET_ID_WIDTH ); live && len < id.size(); ++len )
+            live = splits.contains( id.substr( 0, len ) );
+        if ( live )
+            runs[ id ][ std::stoul( seq ) ] = entry.path().string();
+        else if ( prune )
+            std::filesystem::remove( entry.path() );
+    }
+    if ( !runs.empty() )
+        storage = DHT_STORAGE_LSM;
+    size_t dropped(0);
+
+    for ( auto& r : runs )
+    {
+        BucketFilePtr bp = get_bucket( r.first );
+        bp->_lsm = true;
+        std::vector<std::pair<uint32_t, SortedRunPtr>> loaded;
+        uint32_t merged_below(0);
+        for ( auto& s : r.second )
+        {
+            SortedRunPtr run = std::make_shared<SortedRun>( s.second, keylen, vallen );
+            if ( !run->load() )
+                continue;
+            loaded.push_back( { s.first, run } );
+            merged_below = std::max( merged_below, run->lineage().merged_below );
+        }
+        SortedRunPtr newest;
+        for ( auto& l : loaded )
+        {
+            if ( l.first < merged_below )
+            {
+                l.second->remove();
+                continue;
+            }
+            bp->attach_run( l.second, l.first );
+            newest = l.second;
+        }
+        if ( newest != nullptr && bp->drop_compacted_log( newest->lineage() ) )
+            dropped++;
+    }
+    if ( dropped != 0 )
+        std::cout << "Table " << path << name << ": dropped " << dropped << " logs already compacted" << std::endl;
 }
 
 std::string DiskHashTable::get_bucket_fspec( const std::string& bucket, bool* exists )
@@ -302,12 +2161,35 @@ std::string DiskHashTable::get_bucket_fspec( const std::string path, const std::
     return ss.str();
 }
 
+BucketFileCache::Stats DiskHashTable::file_cache_stats()
+{
+    return BucketFileCache::instance().stats();
+}
+
+void DiskHashTable::set_file_cache_size(size_t cap)
+{
+    BucketFileCache::instance().capacity( cap );
+}
+
+uint64_t DiskHashTable::bucket_order( ucharptr_c key, size_t keylen )
+{
+    MD5 md5;
+    md5.update( key, keylen );
+    md5.finalize();
+    // the first 8 bytes, most significant first - the hex digits in order
+    const unsigned char *digest = md5.rawdigest();
+    uint64_t order(0);
+    for ( int i(0); i < 8; ++i )
+        order = ( order << 8 ) | digest[i];
+    return order;
+}
+
 std::string DiskHashTable::default_hasher( ucharptr_c key, size_t keylen )
 {
     MD5 md5;
     md5.update( key, keylen );
     md5.finalize();
-    return md5.hexdigest().substr( 0, BUCKET_ID_WIDTH );
+    return md5.hexdigest().substr( 0, BUCKET_ID_MAX_WIDTH );
 }
 
 } // namespace dreid
\ No newline at end of file
@@ -1,9 +1,30 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <dq.h>
+#include <lz4block.h>
 
 namespace dreid {
 
 const dq_rec_no_t MAX_BLOCK_SIZE = 1024*1024*256;   // 256 MiB
-const char * dq_naught = "\0";
+const dq_rec_no_t MAX_BUFF_SIZE  = 1024*1024*4;     // 4 MiB push and pop buffers
+const unsigned    JOURNAL_SYNC_RECS    = 16;       // entries between fsyncs
+const uint64_t    JOURNAL_COMPACT_RECS = 4096;     // entries before a new snapshot
+
+// FNV-1a over everything but the checksum itself
+static uint32_t check_of(const JournalRec& jr)
+{
+    const unsigned char *p = (const unsigned char *)&jr;
+    uint32_t h = 2166136261u;
+    for ( size_t i(0); i < offsetof(JournalRec, _check); ++i )
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
 
 QueueFile::QueueFile()
 : _fp(nullptr)
@@ -47,8 +68,20 @@ std::mutex& QueueFile::mtx()
     return _mtx;
 }
 
-DiskQueue::DiskQueue(std::string path, std::string name, dq_rec_no_t reclen)
+DiskQueue::DiskQueue(std::string path, std::string name, dq_rec_no_t reclen, DqMode mode)
 : _path(path), _name(name)
+, _jnl_seq(0)
+, _jnl_cnt(0)
+, _sync_recs(JOURNAL_SYNC_RECS)
+, _unsynced(0)
+, _mapped(mode == DQ_MAPPED)
+, _push_map{nullptr, 0, nullptr, BLOCK_NIL}
+, _pop_map {nullptr, 0, nullptr, BLOCK_NIL}
+, _pop_drop(0)
+, _sort_key(nullptr)
+, _sort_from(0)
+, _frame_recs(0)
+, _frame_slot(0)
 {
     // queue is in its own folder
     // path/name/name.idx and name.dat
@@ -57,7 +90,11 @@ DiskQueue::DiskQueue(std::string path, std::string name, dq_rec_no_t reclen)
     ss << path << '/' << name;
     std::filesystem::create_directories(ss.str());
     ss << '/' << name;
-    if ( _idx.open(ss.str() + ".idx") )
+    _fspec = ss.str();
+    bool exists = _idx.open(_fspec + ".idx");
+    _idx.close();
+    _jnl.open(_fspec + ".jnl");
+    if ( exists )
     {
         read_index();
     }
@@ -74,112 +111,651 @@ DiskQueue::DiskQueue(std::string path, std::string name, dq_rec_no_t reclen)
         _header._push._rec_no   = _header._recs_per_block;
         _header._pop ._block_id = BLOCK_NIL;
         _header._pop ._rec_no   = _header._recs_per_block;
+        if ( mode == DQ_COMPRESSED )
+        {
+            // whole frames to a block, each in its worst-case slot
+            init_frames( std::min( _header._recs_per_block, std::max( MAX_BUFF_SIZE / reclen, (dq_rec_no_t)1 ) ) );
+            _header._recs_per_block = ( _header._recs_per_block / _frame_recs ) * _frame_recs;
+            _header._block_size     = ( _header._recs_per_block / _frame_recs ) * _frame_slot;
+            _header._push._rec_no   = _header._recs_per_block;
+            _header._pop ._rec_no   = _header._recs_per_block;
+        }
 
         write_index();
     }
+    if ( _frame_recs != 0 )
+        _mapped = false;
 
-    _dat.open(ss.str() + ".dat");
+    _dat.open(_fspec + ".dat");
+    // a trim replayed from the journal may not have reached the data file
+    struct stat st;
+    off_t len = _header._block_cnt * _header._block_size;
+    if ( _dat.is_open() && !fstat(fileno(_dat), &st) && st.st_size > len && ftruncate(fileno(_dat), len) )
+        std::cout << "DiskQueue " << _name << ": unable to truncate data file ("
+                  << std::strerror(errno) << ")" << std::endl;
+    init_buffers();
+    load_push_frame();
 }
 
 DiskQueue::~DiskQueue()
 {
-    write_index();
+    flush();
+    unmap_block(_push_map);
+    unmap_block(_pop_map);
     _dat.close();
+    _jnl.close();
 }
 
-void DiskQueue::push(const dq_data_t data)
+void DiskQueue::init_buffers()
+{
+    _buf_recs = std::min( _header._recs_per_block, std::max( MAX_BUFF_SIZE / _header._rec_len, (dq_rec_no_t)1 ) );
+    if ( _frame_recs != 0 )
+        _buf_recs = _frame_recs;
+    _push_buf.reserve( _buf_recs * _header._rec_len );
+    _pop_buf.resize( _buf_recs * _header._rec_len );
+    // whatever was pushed before is on disk
+    _push_buf_start = _header._push._rec_no;
+    _sort_from      = _header._push._rec_no;
+    _pop_buf_start  = 0;
+    _pop_buf_cnt    = 0;
+}
+
+void DiskQueue::flush()
 {
     std::lock_guard<std::mutex> lock(_dat.mtx());
-    if ( _header._push._rec_no == _header._recs_per_block )
+    flush_push_nolock();
+    sort_mapped_nolock();
+    // the data must be on disk before the journal says it is there
+    sync_data_nolock();
+    journal(JNL_CHECKPOINT);
+    fsync(fileno(_jnl));
+    _unsynced = 0;
+}
+
+void DiskQueue::sync_data_nolock()
+{
+    if ( _push_map.base != nullptr )
+        msync(_push_map.base, _push_map.len, MS_SYNC);
+    if ( _dat.is_open() )
     {
-        // current block is full - get a fresh block
-        if ( _free.empty() )
-        {
-            // create a new block at end of file
-            off_t pos = _header._block_cnt * _header._block_size;
-            _header._push._block_id = _header._block_cnt;
-            _header._push._rec_no   = 0;
-            _alloc.push_back(_header._block_cnt);
-            _header._block_cnt++;
-            std::fseek(_dat, pos, SEEK_SET);
-            std::fwrite(dq_naught, 1, _header._block_size, _dat);
-        }
-        else
+        std::fflush(_dat);
+        fdatasync(fileno(_dat));
+    }
+}
+
+// write the buffered tail of the push block
+void DiskQueue::flush_push_nolock()
+{
+    if ( _push_buf.empty() )
+        return;
+    if ( _sort_key != nullptr )
+    {
+        // a compressed tail frame is rewritten, but what was written
+        // before (and journaled) keeps its place
+        dq_rec_no_t from = unpopped_from(std::max(_sort_from, _push_buf_start));
+        if ( from < _header._push._rec_no )
+            sort_recs(_push_buf.data() + (from - _push_buf_start) * _header._rec_len, _header._push._rec_no - from);
+    }
+    _sort_from = _header._push._rec_no;
+    if ( _frame_recs != 0 )
+    {
+        // the frame is written whole, and kept until it is full
+        write_frame_nolock();
+        if ( _push_buf.size() == _frame_recs * _header._rec_len )
         {
-            // pull the head off of the free chain
-            dq_block_id_t block = _free.front();
-            _free.pop_front();
-            _alloc.push_back(block);
-            _header._push._block_id = block;
-            _header._push._rec_no   = 0;
+            _push_buf_start += _frame_recs;
+            _push_buf.clear();
         }
-        write_index();
+        return;
     }
     off_t pos = (_header._push._block_id * _header._block_size) +
-                (_header._push._rec_no   * _header._rec_len);
+                (_push_buf_start         * _header._rec_len);
     std::fseek(_dat, pos, SEEK_SET);
-    std::fwrite((const void *)data, 1, _header._rec_len, _dat);
+    std::fwrite(_push_buf.data(), 1, _push_buf.size(), _dat);
+    _push_buf_start += _push_buf.size() / _header._rec_len;
+    _push_buf.clear();
+}
+
+void DiskQueue::init_frames(dq_rec_no_t frame_recs)
+{
+    _frame_recs = frame_recs;
+    _frame_slot = sizeof(FrameHeader) + lz4::compress_bound( _frame_recs * _header._rec_len );
+    _frame_raw.resize( _frame_recs * _header._rec_len );
+    _frame_buf.resize( _frame_slot );
+}
+
+off_t DiskQueue::frame_pos(dq_block_id_t block, dq_rec_no_t rec)
+{
+    return (block * _header._block_size) + (rec / _frame_recs) * _frame_slot;
+}
+
+// compress the push buffer into its frame's slot
+void DiskQueue::write_frame_nolock()
+{
+    dq_rec_no_t cnt = _push_buf.size() / _header._rec_len;
+    size_t      len = _push_buf.size();
+    std::memcpy(_frame_raw.data(), _push_buf.data(), len);
+    lz4::delta_encode(_frame_raw.data(), cnt, _header._rec_len, _header._rec_len);
+    lz4::shuffle(_frame_raw.data(), _frame_buf.data() + sizeof(FrameHeader), cnt, _header._rec_len);
+    std::memcpy(_frame_raw.data(), _frame_buf.data() + sizeof(FrameHeader), len);
+    FrameHeader fh;
+    fh._rec_cnt = cnt;
+    fh._len     = lz4::compress(_frame_raw.data(), len, _frame_buf.data() + sizeof(FrameHeader), _frame_slot - sizeof(FrameHeader));
+    std::memcpy(_frame_buf.data(), &fh, sizeof(fh));
+    std::fseek(_dat, frame_pos(_header._push._block_id, _push_buf_start), SEEK_SET);
+    std::fwrite(_frame_buf.data(), 1, sizeof(fh) + fh._len, _dat);
+}
+
+// decompress the frame holding rec into recs. Returns its record count.
+dq_rec_no_t DiskQueue::read_frame_nolock(dq_block_id_t block, dq_rec_no_t rec, unsigned char *recs)
+{
+    FrameHeader fh;
+    std::fflush(_dat);
+    std::fseek(_dat, frame_pos(block, rec), SEEK_SET);
+    if ( std::fread(&fh, sizeof(fh), 1, _dat) != 1
+      || fh._rec_cnt > _frame_recs
+      || fh._len > _frame_slot - sizeof(fh)
+      || std::fread(_frame_buf.data(), 1, fh._len, _dat) != fh._len )
+    {
+        std::cout << "DiskQueue " << _name << ": unable to read frame at block " << block
+                  << " record " << rec << std::endl;
+        return 0;
+    }
+    size_t  len = fh._rec_cnt * _header._rec_len;
+    ssize_t got = lz4::decompress(_frame_buf.data(), fh._len, _frame_raw.data(), _frame_raw.size());
+    if ( got != (ssize_t)len )
+    {
+        std::cout << "DiskQueue " << _name << ": damaged frame at block " << block
+                  << " record " << rec << std::endl;
+        return 0;
+    }
+    lz4::unshuffle(_frame_raw.data(), recs, fh._rec_cnt, _header._rec_len);
+    lz4::delta_decode(recs, fh._rec_cnt, _header._rec_len, _header._rec_len);
+    return fh._rec_cnt;
+}
+
+// a compressed queue reopened part way through a frame picks the frame
+// up again, so it is rewritten whole
+void DiskQueue::load_push_frame()
+{
+    dq_rec_no_t rec   = _header._push._rec_no;
+    dq_rec_no_t start = rec - rec % std::max( _frame_recs, (dq_rec_no_t)1 );
+    if ( _frame_recs == 0 || _header._push._block_id == BLOCK_NIL || rec == start )
+        return;
+    _push_buf.resize( _frame_recs * _header._rec_len );
+    dq_rec_no_t cnt = read_frame_nolock(_header._push._block_id, rec, _push_buf.data());
+    if ( cnt < rec - start )
+    {
+        // lost - drop what can't be read back
+        bool in_frame = _header._pop._block_id == _header._push._block_id && _header._pop._rec_no > start + cnt;
+        dq_rec_no_t from = (in_frame) ? _header._pop._rec_no : start + cnt;
+        _header._rec_cnt -= std::min( _header._rec_cnt, rec - from );
+        if ( in_frame )
+            _header._pop._rec_no = start + cnt;
+        _header._push._rec_no = start + cnt;
+        rec = start + cnt;
+    }
+    _push_buf.resize( (rec - start) * _header._rec_len );
+    _push_buf_start = start;
+    _sort_from      = rec;
+}
+
+// first record at or after rec in the push block that hasn't been popped
+dq_rec_no_t DiskQueue::unpopped_from(dq_rec_no_t rec)
+{
+    if ( _header._pop._block_id == _header._push._block_id && _header._pop._rec_no > rec )
+        return _header._pop._rec_no;
+    return rec;
+}
+
+void DiskQueue::sort_recs(unsigned char *recs, dq_rec_no_t cnt)
+{
+    if ( cnt < 2 )
+        return;
+    dq_rec_no_t len = _header._rec_len;
+    std::vector<std::pair<uint64_t, dq_rec_no_t>> order(cnt);
+    for ( dq_rec_no_t i(0); i < cnt; ++i )
+        order[i] = { _sort_key(recs + i * len), i };
+    // ties keep their order
+    std::sort(order.begin(), order.end());
+    _sort_buf.resize(cnt * len);
+    for ( dq_rec_no_t i(0); i < cnt; ++i )
+        std::memcpy(_sort_buf.data() + i * len, recs + order[i].second * len, len);
+    std::memcpy(recs, _sort_buf.data(), cnt * len);
+}
+
+// sort what has been copied into the push block mapping since last time
+void DiskQueue::sort_mapped_nolock()
+{
+    if ( _sort_key == nullptr || _push_map.recs == nullptr || _push_map.block != _header._push._block_id )
+        return;
+    dq_rec_no_t from = unpopped_from(_sort_from);
+    if ( from < _header._push._rec_no )
+        sort_recs(_push_map.recs + from * _header._rec_len, _header._push._rec_no - from);
+    _sort_from = _header._push._rec_no;
+}
+
+// map a block of the data file, growing the file to cover it first -
+// touching a mapped page past the end of the file faults
+bool DiskQueue::map_block(QueueMap& map, dq_block_id_t block)
+{
+    unmap_block(map);
+    int   fd   = fileno(_dat);
+    off_t pos  = block * _header._block_size;
+    off_t end  = pos + _header._block_size;
+    off_t base = pos - pos % sysconf(_SC_PAGESIZE);
+    struct stat st;
+    if ( fstat(fd, &st) || ( st.st_size < end && ftruncate(fd, end) ) )
+        return false;
+    void *ptr = mmap(nullptr, end - base, PROT_READ | PROT_WRITE, MAP_SHARED, fd, base);
+    if ( ptr == MAP_FAILED )
+        return false;
+    madvise(ptr, end - base, MADV_SEQUENTIAL);
+    map.base  = (unsigned char *)ptr;
+    map.len   = end - base;
+    map.recs  = map.base + (pos - base);
+    map.block = block;
+    return true;
+}
+
+void DiskQueue::unmap_block(QueueMap& map)
+{
+    if ( map.base != nullptr )
+        munmap(map.base, map.len);
+    map.base  = nullptr;
+    map.len   = 0;
+    map.recs  = nullptr;
+    map.block = BLOCK_NIL;
+}
+
+// give back the whole pages holding records [from,to) of a mapped block
+void DiskQueue::drop_pages(QueueMap& map, dq_rec_no_t from, dq_rec_no_t to)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t lo   = (uintptr_t)(map.recs + from * _header._rec_len);
+    uintptr_t hi   = (uintptr_t)(map.recs + to   * _header._rec_len);
+    lo = (lo + page - 1) / page * page;
+    hi = hi / page * page;
+    if ( hi > lo )
+        madvise((void *)lo, hi - lo, MADV_DONTNEED);
+}
+
+// a block could not be mapped - carry on with buffered io. Anything
+// copied into the mappings is already in the file.
+void DiskQueue::unmap_nolock(const char *why)
+{
+    std::cout << "DiskQueue " << _name << ": unable to map " << why
+              << " block (" << std::strerror(errno) << "), using buffered io" << std::endl;
+    unmap_block(_push_map);
+    unmap_block(_pop_map);
+    _mapped         = false;
+    _push_buf_start = _header._push._rec_no;
+    _pop_buf_cnt    = 0;
+}
+
+void DiskQueue::next_push_block_nolock()
+{
+    flush_push_nolock();
+    sort_mapped_nolock();
+    // current block is full - get a fresh block
+    if ( _free.empty() )
+    {
+        // create a new block at end of file
+        _header._push._block_id = _header._block_cnt;
+        _header._push._rec_no   = 0;
+        _alloc.push_back(_header._block_cnt);
+        _header._block_cnt++;
+        reserve_block(_header._push._block_id);
+        journal(JNL_NEW_BLOCK, _header._push._block_id);
+    }
+    else
+    {
+        // pull the head off of the free chain
+        dq_block_id_t block = _free.front();
+        _free.pop_front();
+        _alloc.push_back(block);
+        _header._push._block_id = block;
+        _header._push._rec_no   = 0;
+        // its space was given back when it was freed
+        reserve_block(block);
+        journal(JNL_REUSE_BLOCK, block);
+    }
+    _push_buf_start = 0;
+    _sort_from      = 0;
+}
+
+void DiskQueue::next_pop_block_nolock()
+{
+    // put this block on the free chain,
+    // setup next block (if any)
+    dq_block_id_t done = _header._pop._block_id;
+    if ( done != BLOCK_NIL )
+    {
+        _alloc.pop_front();
+        _free.push_back(done);
+    }
+    if ( _alloc.empty() )
+    {
+        _header._pop._block_id = BLOCK_NIL;
+        _header._pop._rec_no   = _header._recs_per_block;
+    }
+    else
+    {
+        _header._pop._block_id = _alloc.front();
+        _header._pop._rec_no   = 0;
+    }
+    unmap_block(_pop_map);
+    _pop_buf_cnt = 0;
+    if ( done != BLOCK_NIL )
+    {
+        release_block(done);
+        journal(JNL_FREE_BLOCK, done);
+        trim_nolock();
+    }
+    else
+        journal(JNL_CHECKPOINT);
+}
+
+// give a block its space without writing it - the file is just made
+// long enough (sparse) where fallocate isn't supported
+void DiskQueue::reserve_block(dq_block_id_t block)
+{
+    int   fd  = fileno(_dat);
+    off_t pos = block * _header._block_size;
+    off_t end = pos + _header._block_size;
+    // compressed frames only use part of their slots - leave it sparse
+    if ( _frame_recs == 0 && fallocate(fd, 0, pos, _header._block_size) == 0 )
+        return;
+    struct stat st;
+    if ( fstat(fd, &st) || ( st.st_size < end && ftruncate(fd, end) ) )
+        std::cout << "DiskQueue " << _name << ": unable to extend data file ("
+                  << std::strerror(errno) << ")" << std::endl;
+}
+
+// hand a consumed block's space back to the filesystem. Not every
+// filesystem can punch holes - the block just stays allocated there.
+void DiskQueue::release_block(dq_block_id_t block)
+{
+    std::fflush(_dat);
+    fallocate(fileno(_dat), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              block * _header._block_size, _header._block_size);
+}
+
+// free blocks at the end of the file are dropped from it altogether
+void DiskQueue::trim_nolock()
+{
+    dq_block_id_t cnt = _header._block_cnt;
+    std::vector<dq_block_id_t> free(_free.begin(), _free.end());
+    std::sort(free.begin(), free.end());
+    for ( auto itr = free.rbegin(); cnt > 0 && itr != free.rend() && *itr + 1 >= cnt; ++itr )
+        if ( *itr + 1 == cnt )
+            cnt--;
+    if ( cnt == _header._block_cnt )
+        return;
+    _free.remove_if([cnt](dq_block_id_t id) { return id >= cnt; });
+    _header._block_cnt = cnt;
+    std::fflush(_dat);
+    if ( ftruncate(fileno(_dat), cnt * _header._block_size) )
+        std::cout << "DiskQueue " << _name << ": unable to truncate data file ("
+                  << std::strerror(errno) << ")" << std::endl;
+    journal(JNL_TRIM, cnt);
+}
+
+void DiskQueue::push(const dq_data_t data)
+{
+    push_n(data, 1);
+}
+
+bool DiskQueue::pop(dq_data_t data)
+{
+    return pop_n(data, 1) == 1;
+}
+
+void DiskQueue::push_n(const dq_data_t data, dq_rec_no_t cnt)
+{
+    std::lock_guard<std::mutex> lock(_dat.mtx());
+    const unsigned char *ptr = data;
+    while ( cnt > 0 )
+    {
+        dq_rec_no_t n = push_run_nolock(ptr, cnt);
+        ptr += n * _header._rec_len;
+        cnt -= n;
+    }
+}
+
+dq_rec_no_t DiskQueue::pop_n(dq_data_t data, dq_rec_no_t max)
+{
+    std::lock_guard<std::mutex> lock(_dat.mtx());
+    dq_rec_no_t cnt(0);
+    while ( cnt < max )
+    {
+        dq_rec_no_t n = pop_run_nolock(data + cnt * _header._rec_len, max - cnt);
+        if ( n == 0 )
+            break;
+        cnt += n;
+    }
+    return cnt;
+}
+
+// copy as many records as fit in the push block (and push buffer)
+dq_rec_no_t DiskQueue::push_run_nolock(const unsigned char *data, dq_rec_no_t cnt)
+{
+    if ( _header._push._rec_no == _header._recs_per_block )
+        next_push_block_nolock();
+    if ( _mapped && _push_map.block != _header._push._block_id
+                 && !map_block(_push_map, _header._push._block_id) )
+        unmap_nolock("push");
+    dq_rec_no_t n = std::min( cnt, _header._recs_per_block - _header._push._rec_no );
+    if ( _mapped )
+    {
+        std::memcpy(_push_map.recs + _header._push._rec_no * _header._rec_len, data, n * _header._rec_len);
+    }
+    else
+    {
+        n = std::min( n, _buf_recs - _push_buf.size() / _header._rec_len );
+        _push_buf.insert(_push_buf.end(), data, data + n * _header._rec_len);
+    }
     if ( _header._pop._block_id == BLOCK_NIL )
+    {
         _header._pop = _header._push;
-    _header._push._rec_no++;
-    _header._rec_cnt++;
+        _pop_buf_cnt = 0;
+    }
+    _header._push._rec_no += n;
+    _header._rec_cnt      += n;
+    if ( !_mapped && _push_buf.size() == _buf_recs * _header._rec_len )
+        flush_push_nolock();
+    else if ( _mapped && _header._push._rec_no - _sort_from >= _buf_recs )
+        sort_mapped_nolock();
+    return n;
 }
 
-bool DiskQueue::pop(dq_data_t data)
+// copy as many records as can be had from one place - the pop block
+// mapping, the push buffer or the pop buffer
+dq_rec_no_t DiskQueue::pop_run_nolock(unsigned char *data, dq_rec_no_t max)
 {
-    // pop record off the top of the queue
+    // pop records off the top of the queue
     // if last record in the block, move block to end of
     // free chain
-    std::lock_guard<std::mutex> lock(_dat.mtx());
     if ( empty() )
-        return false;
+        return 0;
     if ( _header._pop._rec_no == _header._recs_per_block )
+        next_pop_block_nolock();
+
+    dq_rec_no_t rec = _header._pop._rec_no;
+    bool in_push_block = _header._pop._block_id == _header._push._block_id;
+    dq_rec_no_t n = std::min( max, ( (in_push_block) ? _header._push._rec_no : _header._recs_per_block ) - rec );
+    if ( _mapped && _pop_map.block != _header._pop._block_id )
     {
-        // put this block on the free chain,
-        // setup next block (if any)
-        if ( _header._pop._block_id != BLOCK_NIL )
+        if ( map_block(_pop_map, _header._pop._block_id) )
+            _pop_drop = rec;
+        else
+            unmap_nolock("pop");
+    }
+    if ( _mapped )
+    {
+        std::memcpy(data, _pop_map.recs + rec * _header._rec_len, n * _header._rec_len);
+        // drop the pages of each buffer's worth of records once consumed
+        if ( rec + n - _pop_drop >= _buf_recs )
         {
-            _alloc.pop_front();
-            _free.push_back(_header._pop._block_id);
+            drop_pages(_pop_map, _pop_drop, rec + n);
+            _pop_drop = rec + n;
         }
-        if ( _alloc.empty() )
+    }
+    else if ( in_push_block && rec >= _push_buf_start )
+    {
+        // not written yet
+        std::memcpy(data, _push_buf.data() + (rec - _push_buf_start) * _header._rec_len, n * _header._rec_len);
+    }
+    else
+    {
+        if ( _frame_recs != 0 && ( rec < _pop_buf_start || rec >= _pop_buf_start + _pop_buf_cnt ) )
         {
-            _header._pop._block_id = BLOCK_NIL;
-            _header._pop._rec_no   = _header._recs_per_block;
+            // frames before the push buffer are full
+            _pop_buf_start = rec - rec % _frame_recs;
+            _pop_buf_cnt   = read_frame_nolock(_header._pop._block_id, rec, _pop_buf.data());
+            if ( rec >= _pop_buf_start + _pop_buf_cnt )
+                return 0;
         }
-        else
+        else if ( rec < _pop_buf_start || rec >= _pop_buf_start + _pop_buf_cnt )
         {
-            _header._pop._block_id = _alloc.front();
-            _header._pop._rec_no   = 0;
+            // read ahead as far as the block has been written
+            dq_rec_no_t limit = (in_push_block) ? _push_buf_start : _header._recs_per_block;
+            dq_rec_no_t cnt   = std::min( _buf_recs, limit - rec );
+            off_t pos = (_header._pop._block_id * _header._block_size) +
+                        (rec                    * _header._rec_len);
+            std::fseek(_dat, pos, SEEK_SET);
+            _pop_buf_cnt   = std::fread(_pop_buf.data(), _header._rec_len, cnt, _dat);
+            _pop_buf_start = rec;
+            if ( _pop_buf_cnt == 0 )
+                return 0;
         }
-        write_index();
+        n = std::min( n, _pop_buf_start + _pop_buf_cnt - rec );
+        std::memcpy(data, _pop_buf.data() + (rec - _pop_buf_start) * _header._rec_len, n * _header._rec_len);
     }
+    _header._pop._rec_no += n;
+    _header._rec_cnt     -= n;
+    return n;
+}
 
-    off_t pos = (_header._pop._block_id * _header._block_size) +
-                (_header._pop._rec_no   * _header._rec_len);
-    std::fseek(_dat, pos, SEEK_SET);
-    std::fread((void *)data, 1, _header._rec_len, _dat);
-    _header._pop._rec_no++;
-    _header._rec_cnt--;
+// append one entry to the journal, and write a new snapshot once the
+// journal has grown long
+void DiskQueue::journal(JournalType type, dq_block_id_t block)
+{
+    // the positions journaled must be backed by what is in the file
+    flush_push_nolock();
+    if ( _dat.is_open() )
+        std::fflush(_dat);
+    JournalRec jr{ ++_jnl_seq, (uint32_t)type, block,
+                   _header._push, _header._pop, _header._rec_cnt, 0 };
+    jr._check = check_of(jr);
+    std::fseek(_jnl, 0, SEEK_END);
+    std::fwrite(&jr, sizeof(jr), 1, _jnl);
+    std::fflush(_jnl);
+    if ( _sync_recs != 0 && ++_unsynced >= _sync_recs )
+    {
+        sync_data_nolock();
+        fsync(fileno(_jnl));
+        _unsynced = 0;
+    }
+    if ( ++_jnl_cnt >= JOURNAL_COMPACT_RECS )
+        write_index();
+}
 
-    return true;
+// apply the journal to the snapshot just read
+void DiskQueue::replay_journal()
+{
+    JournalRec jr;
+    long good(0);
+    std::fseek(_jnl, 0, SEEK_SET);
+    while ( std::fread(&jr, sizeof(jr), 1, _jnl) == 1 && jr._check == check_of(jr) )
+    {
+        good += sizeof(jr);
+        _jnl_cnt++;
+        if ( jr._seq <= _jnl_seq )
+            continue;       // already in the snapshot
+        _jnl_seq = jr._seq;
+        // the entry is packed - take its fields by value
+        dq_block_id_t block = jr._block;
+        switch ( jr._type )
+        {
+        case JNL_NEW_BLOCK:
+            _alloc.push_back(block);
+            if ( _header._block_cnt < block + 1 )
+                _header._block_cnt = block + 1;
+            break;
+        case JNL_REUSE_BLOCK:
+            _free.remove(block);
+            _alloc.push_back(block);
+            break;
+        case JNL_FREE_BLOCK:
+            _alloc.remove(block);
+            _free.push_back(block);
+            break;
+        case JNL_TRIM:
+            _free.remove_if([block](dq_block_id_t id) { return id >= block; });
+            _header._block_cnt = block;
+            break;
+        }
+        _header._push    = jr._push;
+        _header._pop     = jr._pop;
+        _header._rec_cnt = jr._rec_cnt;
+    }
+    // drop a torn entry so the next one follows the last good one
+    std::fflush(_jnl);
+    if ( ftruncate(fileno(_jnl), good) )
+        std::cout << "DiskQueue " << _name << ": unable to trim journal (" << std::strerror(errno) << ")" << std::endl;
 }
 
+// write a snapshot of the index and empty the journal. The data the
+// snapshot points at is on disk first, and the snapshot is in place for
+// good before the journal goes.
 void DiskQueue::write_index()
 {
+    sync_data_nolock();
     std::lock_guard<std::mutex> lock(_idx.mtx());
-    if ( !_idx.is_open() )
-        _idx.open();
     _header._alloc_cnt = _alloc.size();
     _header._free_cnt  = _free .size();
-    std::fseek( _idx, 0, SEEK_SET );
-    std::fwrite( &_header, sizeof(QueueHeader), 1, _idx );
+    std::string tmp = _fspec + ".idx.tmp";
+    FILE *fp = std::fopen( tmp.c_str(), "w" );
+    if ( fp == nullptr )
+    {
+        std::cout << "DiskQueue " << _name << ": unable to write " << tmp
+                  << " (" << std::strerror(errno) << ")" << std::endl;
+        return;
+    }
+    std::fwrite( &_header, sizeof(QueueHeader), 1, fp );
     // write the alloc chain
     for ( auto id : _alloc )
-        std::fwrite(&id, sizeof(id), 1, _idx);
+        std::fwrite(&id, sizeof(id), 1, fp);
     for ( auto id : _free )
-        std::fwrite(&id, sizeof(id), 1, _idx);
-    _idx.close();
+        std::fwrite(&id, sizeof(id), 1, fp);
+    // the last journal entry this snapshot includes
+    std::fwrite( &_jnl_seq, sizeof(_jnl_seq), 1, fp );
+    std::fwrite( &_frame_recs, sizeof(_frame_recs), 1, fp );
+    std::fflush(fp);
+    fsync(fileno(fp));
+    std::fclose(fp);
+    if ( std::rename( tmp.c_str(), (_fspec + ".idx").c_str() ) )
+    {
+        std::cout << "DiskQueue " << _name << ": unable to replace index ("
+                  << std::strerror(errno) << ")" << std::endl;
+        return;
+    }
+    int dir = ::open( std::filesystem::path(_fspec).parent_path().c_str(), O_RDONLY );
+    if ( dir == -1 || fsync(dir) )
+    {
+        std::cout << "DiskQueue " << _name << ": unable to sync index directory ("
+                  << std::strerror(errno) << ") - journal kept" << std::endl;
+        if ( dir != -1 )
+            ::close(dir);
+        return;
+    }
+    ::close(dir);
+    std::fflush(_jnl);
+    if ( ftruncate(fileno(_jnl), 0) == 0 )
+        fsync(fileno(_jnl));
+    _jnl_cnt  = 0;
+    _unsynced = 0;
 }
 
 void DiskQueue::read_index()
@@ -202,7 +778,16 @@ void DiskQueue::read_index()
         std::fread( &id, sizeof(id), 1, _idx );
         _free.push_back( id );
     }
+    // an index written before there was a journal has no sequence
+    if ( std::fread( &_jnl_seq, sizeof(_jnl_seq), 1, _idx ) != 1 )
+        _jnl_seq = 0;
+    // only a compressed queue's blocks aren't whole records
+    dq_rec_no_t frame_recs(0);
+    if ( _header._block_size != _header._recs_per_block * _header._rec_len
+      && std::fread( &frame_recs, sizeof(frame_recs), 1, _idx ) == 1 )
+        init_frames(frame_recs);
     _idx.close();
+    replay_journal();
 }
 
 } // namespace dreid
\ No newline at end of file
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <cstring>
+#include <dq_front.h>
+
+namespace dreid {
+
+QueueFront::QueueFront(DiskQueue& dq, size_t recs)
+: _dq(dq)
+, _reclen(0)
+, _head(0)
+, _tail(0)
+, _overflow(0)
+, _carry_pos(0)
+, _spilled(0)
+, _refilled(0)
+{
+    size_t cap(2);
+    while ( cap < recs )
+        cap <<= 1;
+    _mask = cap - 1;
+    _seq  = std::make_unique<std::atomic<size_t>[]>(cap);
+    for ( size_t i(0); i < cap; ++i )
+        _seq[i].store(i, std::memory_order_relaxed);
+    _reclen   = _dq.rec_len();
+    _recs.resize(cap * _reclen);
+    _batch.resize((cap / 2) * _reclen);
+    // whatever is already on disk is older than anything pushed now
+    _overflow = _dq.size();
+}
+
+// a slot is free to push when its sequence equals the tail position,
+// and full (ready to pop) when it equals the position plus one
+bool QueueFront::ring_push(const unsigned char *data)
+{
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    while (true)
+    {
+        size_t   seq = _seq[pos & _mask].load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if ( dif == 0 )
+        {
+            if ( _tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+                break;
+        }
+        else if ( dif < 0 )
+            return false;       // full
+        else
+            pos = _tail.load(std::memory_order_relaxed);
+    }
+    std::memcpy(_recs.data() + (pos & _mask) * _reclen, data, _reclen);
+    _seq[pos & _mask].store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool QueueFront::ring_pop(unsigned char *data)
+{
+    size_t pos = _head.load(std::memory_order_relaxed);
+    while (true)
+    {
+        size_t   seq = _seq[pos & _mask].load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if ( dif == 0 )
+        {
+            if ( _head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+                break;
+        }
+        else if ( dif < 0 )
+            return false;       // empty
+        else
+            pos = _head.load(std::memory_order_relaxed);
+    }
+    std::memcpy(data, _recs.data() + (pos & _mask) * _reclen, _reclen);
+    _seq[pos & _mask].store(pos + _mask + 1, std::memory_order_release);
+    return true;
+}
+
+void QueueFront::push(const dq_data_t data)
+{
+    push_n(data, 1);
+}
+
+bool QueueFront::pop(dq_data_t data)
+{
+    return pop_n(data, 1) == 1;
+}
+
+void QueueFront::push_n(const dq_data_t data, dq_rec_no_t cnt)
+{
+    dq_rec_no_t n(0);
+    if ( _overflow.load(std::memory_order_acquire) == 0 )
+    {
+        while ( n < cnt && ring_push(data + n * _reclen) )
+            n++;
+        if ( n == cnt )
+            return;
+    }
+    // ring is full, or older records are on disk - go behind them
+    _overflow += cnt - n;
+    _spilled  += cnt - n;
+    _dq.push_n(data + n * _reclen, cnt - n);
+}
+
+dq_rec_no_t QueueFront::pop_n(dq_data_t data, dq_rec_no_t max)
+{
+    dq_rec_no_t n(0);
+    while ( n < max && ring_pop(data + n * _reclen) )
+        n++;
+    if ( n > 0 || _overflow.load(std::memory_order_acquire) == 0 )
+        return n;
+    return refill(data, max);
+}
+
+// oldest records not in the ring - call with _refill_mtx held
+dq_rec_no_t QueueFront::take_overflow(unsigned char *data, dq_rec_no_t max)
+{
+    dq_rec_no_t n(0);
+    dq_rec_no_t carried = _carry.size() / _reclen - _carry_pos;
+    if ( carried > 0 )
+    {
+        n = std::min( max, carried );
+        std::memcpy(data, _carry.data() + _carry_pos * _reclen, n * _reclen);
+        _carry_pos += n;
+        if ( n == carried )
+        {
+            _carry.clear();
+            _carry_pos = 0;
+        }
+    }
+    if ( n < max )
+        n += _dq.pop_n(data + n * _reclen, max - n);
+    _overflow -= n;
+    return n;
+}
+
+// hand the oldest records on disk to the caller and move the next batch
+// into the ring
+dq_rec_no_t QueueFront::refill(dq_data_t data, dq_rec_no_t max)
+{
+    std::lock_guard<std::mutex> lock(_refill_mtx);
+    // someone else may have refilled while we waited
+    dq_rec_no_t n(0);
+    while ( n < max && ring_pop(data + n * _reclen) )
+        n++;
+    if ( n > 0 )
+        return n;
+    n = take_overflow(data, max);
+    if ( n == 0 )
+        return 0;
+    dq_rec_no_t cnt = take_overflow(_batch.data(), _batch.size() / _reclen);
+    dq_rec_no_t i(0);
+    while ( i < cnt && ring_push(_batch.data() + i * _reclen) )
+        i++;
+    _refilled += i;
+    if ( i < cnt )
+    {
+        // late pushes took the room - keep the rest, ahead of anything
+        // still carried, for next time
+        _carry.erase(_carry.begin(), _carry.begin() + _carry_pos * _reclen);
+        _carry.insert(_carry.begin(), _batch.begin() + i * _reclen, _batch.begin() + cnt * _reclen);
+        _carry_pos = 0;
+        _overflow += cnt - i;
+    }
+    return n;
+}
+
+dq_rec_no_t QueueFront::size()
+{
+    size_t head = _head.load(std::memory_order_acquire);
+    size_t tail = _tail.load(std::memory_order_acquire);
+    return (tail - head) + _overflow.load(std::memory_order_acquire);
+}
+
+void QueueFront::flush()
+{
+    _dq.flush();
+}
+
+void QueueFront::spill()
+{
+    std::lock_guard<std::mutex> lock(_refill_mtx);
+    if ( _carry.size() > _carry_pos * _reclen )
+        _dq.push_n(_carry.data() + _carry_pos * _reclen, _carry.size() / _reclen - _carry_pos);
+    _carry.clear();
+    _carry_pos = 0;
+    dq_rec_no_t max = _batch.size() / _reclen;
+    while ( true )
+    {
+        dq_rec_no_t n(0);
+        while ( n < max && ring_pop(_batch.data() + n * _reclen) )
+            n++;
+        if ( n == 0 )
+            break;
+        _dq.push_n(_batch.data(), n);
+        _overflow += n;
+        _spilled  += n;
+    }
+    _dq.flush();
+}
+
+} // namespace dreid
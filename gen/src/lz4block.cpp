@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cstring>
+#include "lz4block.h"
+
+namespace dreid {
+namespace lz4 {
+
+#define MIN_MATCH      4
+#define LAST_LITERALS  5    // the block always ends with this many literals
+#define MF_LIMIT       12   // no match may start this close to the end
+#define MAX_DISTANCE   65535
+#define HASH_LOG       12
+#define SHUFFLE_TILE   32   // records (and bytes) per shuffle tile
+
+static inline uint32_t read32( const uint8_t *p )
+{
+    uint32_t v;
+    std::memcpy( &v, p, sizeof(v) );
+    return v;
+}
+
+static inline uint32_t hash4( uint32_t v )
+{
+    return ( v * 2654435761U ) >> ( 32 - HASH_LOG );
+}
+
+// lengths of 15 and up spill into 255-valued continuation bytes
+static inline uint8_t *put_length( uint8_t *op, size_t len )
+{
+    while ( len >= 255 )
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+size_t compress_bound( size_t n )
+{
+    return n + n / 255 + 16;
+}
+
+size_t compress( const uint8_t *src, size_t n, uint8_t *dst, size_t cap )
+{
+    if ( cap < compress_bound( n ) )
+        return 0;
+
+    uint32_t table[ 1 << HASH_LOG ];
+    std::memset( table, 0xff, sizeof(table) );
+
+    const uint8_t *ip     = src;
+    const uint8_t *anchor = src;    // start of pending literals
+    const uint8_t *iend   = src + n;
+    const uint8_t *mlimit = ( n > MF_LIMIT ) ? iend - MF_LIMIT : src;
+    uint8_t       *op     = dst;
+
+    auto emit = [&]( const uint8_t *lit_end, size_t match_len, uint16_t offset )
+    {
+        size_t lit_len = lit_end - anchor;
+        uint8_t *token = op++;
+        *token = (uint8_t)( ( ( lit_len < 15 ) ? lit_len : 15 ) << 4 );
+        if ( lit_len >= 15 )
+            op = put_length( op, lit_len - 15 );
+        std::memcpy( op, anchor, lit_len );
+        op += lit_len;
+        if ( match_len == 0 )
+            return;     // last sequence - literals only
+        *op++ = (uint8_t)( offset & 0xff );
+        *op++ = (uint8_t)( offset >> 8 );
+        size_t ml = match_len - MIN_MATCH;
+        *token |= (uint8_t)( ( ml < 15 ) ? ml : 15 );
+        if ( ml >= 15 )
+            op = put_length( op, ml - 15 );
+    };
+
+    while ( ip < mlimit )
+    {
+        uint32_t seq = read32( ip );
+        uint32_t h   = hash4( seq );
+        uint32_t ref = table[h];
+        table[h] = (uint32_t)( ip - src );
+        if ( ref == 0xffffffff
+          || ( ip - src ) - ref > MAX_DISTANCE
+          || read32( src + ref ) != seq )
+        {
+            ip++;
+            continue;
+        }
+
+        // extend the match forward, stopping short of the tail
+        const uint8_t *match = src + ref;
+        const uint8_t *mend  = iend - LAST_LITERALS;
+        size_t len = MIN_MATCH;
+        while ( ip + len < mend && ip[len] == match[len] )
+            len++;
+        // and backward over literals that also match
+        while ( ip > anchor && match > src && ip[-1] == match[-1] )
+        {
+            ip--;
+            match--;
+            len++;
+        }
+        emit( ip, len, (uint16_t)( ip - match ) );
+        ip += len;
+        anchor = ip;
+        if ( ip < mlimit )
+            table[ hash4( read32( ip - 2 ) ) ] = (uint32_t)( ip - 2 - src );
+    }
+    emit( iend, 0, 0 );
+    return op - dst;
+}
+
+ssize_t decompress( const uint8_t *src, size_t n, uint8_t *dst, size_t cap )
+{
+    const uint8_t *ip   = src;
+    const uint8_t *iend = src + n;
+    uint8_t       *op   = dst;
+    uint8_t       *oend = dst + cap;
+
+    auto get_length = [&]( size_t len, bool& ok ) -> size_t
+    {
+        if ( len != 15 )
+            return len;
+        uint8_t b;
+        do
+        {
+            if ( ip >= iend )
+            {
+                ok = false;
+                return 0;
+            }
+            b = *ip++;
+            len += b;
+        } while ( b == 255 );
+        return len;
+    };
+
+    while ( ip < iend )
+    {
+        bool ok = true;
+        uint8_t token = *ip++;
+        size_t lit_len = get_length( token >> 4, ok );
+        if ( !ok || lit_len > (size_t)( iend - ip ) || lit_len > (size_t)( oend - op ) )
+            return -1;
+        std::memcpy( op, ip, lit_len );
+        ip += lit_len;
+        op += lit_len;
+        if ( ip == iend )
+            break;      // last sequence has no match
+
+        if ( iend - ip < 2 )
+            return -1;
+        size_t offset = ip[0] | ( ip[1] << 8 );
+        ip += 2;
+        size_t match_len = get_length( token & 0x0f, ok ) + MIN_MATCH;
+        if ( !ok || offset == 0 || offset > (size_t)( op - dst ) || match_len > (size_t)( oend - op ) )
+            return -1;
+        // may overlap the output being written, so copy bytewise
+        const uint8_t *match = op - offset;
+        for ( size_t i(0); i < match_len; ++i )
+            op[i] = match[i];
+        op += match_len;
+    }
+    return op - dst;
+}
+
+void delta_encode( uint8_t *recs, size_t rec_cnt, size_t rec_len, size_t key_len )
+{
+    // back to front, so each record is XOR-ed with the original previous key
+    for ( size_t i( rec_cnt ); i > 1; --i )
+    {
+        uint8_t       *cur  = recs + ( i - 1 ) * rec_len;
+        const uint8_t *prev = cur - rec_len;
+        for ( size_t b(0); b < key_len; ++b )
+            cur[b] ^= prev[b];
+    }
+}
+
+void delta_decode( uint8_t *recs, size_t rec_cnt, size_t rec_len, size_t key_len )
+{
+    for ( size_t i(1); i < rec_cnt; ++i )
+    {
+        uint8_t       *cur  = recs + i * rec_len;
+        const uint8_t *prev = cur - rec_len;
+        for ( size_t b(0); b < key_len; ++b )
+            cur[b] ^= prev[b];
+    }
+}
+
+// Both transposes go a tile at a time, so neither side strides through
+// memory a byte per cache line - a frame of big records is megabytes.
+void shuffle( const uint8_t *src, uint8_t *dst, size_t rec_cnt, size_t rec_len )
+{
+    for ( size_t r0(0); r0 < rec_cnt; r0 += SHUFFLE_TILE )
+    {
+        size_t r1 = std::min( r0 + SHUFFLE_TILE, rec_cnt );
+        for ( size_t b0(0); b0 < rec_len; b0 += SHUFFLE_TILE )
+        {
+            size_t b1 = std::min( b0 + SHUFFLE_TILE, rec_len );
+            for ( size_t b(b0); b < b1; ++b )
+                for ( size_t r(r0); r < r1; ++r )
+                    dst[ b * rec_cnt + r ] = src[ r * rec_len + b ];
+        }
+    }
+}
+
+void unshuffle( const uint8_t *src, uint8_t *dst, size_t rec_cnt, size_t rec_len )
+{
+    for ( size_t r0(0); r0 < rec_cnt; r0 += SHUFFLE_TILE )
+    {
+        size_t r1 = std::min( r0 + SHUFFLE_TILE, rec_cnt );
+        for ( size_t b0(0); b0 < rec_len; b0 += SHUFFLE_TILE )
+        {
+            size_t b1 = std::min( b0 + SHUFFLE_TILE, rec_len );
+            for ( size_t r(r0); r < r1; ++r )
+                for ( size_t b(b0); b < b1; ++b )
+                    dst[ r * rec_len + b ] = src[ b * rec_cnt + r ];
+        }
+    }
+}
+
+} // namespace lz4
+} // namespace dreid
@@ -327,6 +327,14 @@ MD5& MD5::finalize()
 
 //////////////////////////////
 
+// return the 16 digest bytes, or nullptr if not finalized
+const unsigned char *MD5::rawdigest() const
+{
+  return finalized ? digest : nullptr;
+}
+
+//////////////////////////////
+
 // return hex representation of digest as string
 std::string MD5::hexdigest() const
 {
@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lz4block.h"
+#include "sorted_run.h"
+
+namespace dreid {
+
+// wait until a file (or a directory's entries) is on disk
+bool sync_path( const std::string& fspec )
+{
+    int fd = ::open( fspec.c_str(), O_RDONLY );
+    if ( fd == -1 )
+        return false;
+    bool ok = ::fsync( fd ) == 0;
+    ::close( fd );
+    return ok;
+}
+
+// put a finished file in place for good - it is on disk before it is
+// renamed, and the rename is on disk before this returns
+bool sync_rename( const std::string& tmp, const std::string& fspec )
+{
+    std::error_code ec;
+    if ( !sync_path( tmp ) )
+        return false;
+    std::filesystem::rename( tmp, fspec, ec );
+    return !ec && sync_path( std::filesystem::path( fspec ).parent_path().string() );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// SortedRun
+//
+SortedRun::SortedRun(const std::string& fspec, size_t key_len, size_t val_len)
+: _fspec(fspec)
+, _keylen(key_len)
+, _vallen(val_len)
+, _reclen(key_len + val_len)
+, _reccnt(0)
+, _codec(0)
+, _lineage{0, 0, 0}
+{}
+
+SortedRun::~SortedRun()
+{
+    BucketFileCache::instance().forget( this );
+}
+
+int SortedRun::open()
+{
+    int fd = BucketFileCache::instance().acquire( this, _fspec, false );
+    if ( fd == -1 )
+        std::cout << "Error opening run file " << _fspec << ' ' << errno << std::endl;
+    return fd;
+}
+
+void SortedRun::close()
+{
+    BucketFileCache::instance().release( this );
+}
+
+// read the footer, index and filter
+bool SortedRun::load()
+{
+    int fd = open();
+    if ( fd == -1 )
+        return false;
+    bool ok = false;
+    RunFooter ftr;
+    off_t end = ::lseek( fd, 0, SEEK_END );
+    if ( end >= (off_t)sizeof(ftr)
+      && ::pread( fd, &ftr, sizeof(ftr), end - sizeof(ftr) ) == sizeof(ftr)
+      && !std::memcmp( ftr.magic, RUN_MAGIC, sizeof(ftr.magic) )
+      && ( ftr.version == 1 || ftr.version == RUN_VERSION )
+      && ftr.key_len == _keylen
+      && ftr.val_len == _vallen )
+    {
+        std::memset( &_lineage, 0x00, sizeof(_lineage) );
+        off_t lin_off = end - sizeof(ftr) - sizeof(_lineage);
+        if ( ftr.version >= 2 && ( lin_off < 0
+          || ::pread( fd, &_lineage, sizeof(_lineage), lin_off ) != sizeof(_lineage) ) )
+            std::memset( &_lineage, 0x00, sizeof(_lineage) );
+        _reccnt = ftr.rec_cnt;
+        _codec  = ftr.codec;
+        size_t ent_len = _keylen + sizeof(RunBlockInfo);
+        std::vector<uchar> index( ftr.block_cnt * ent_len );
+        std::vector<uchar> bloom( ( ftr.bloom_bits + 63 ) / 64 * 8 );
+        ok = ::pread( fd, index.data(), index.size(), ftr.index_off ) == (ssize_t)index.size()
+          && ::pread( fd, bloom.data(), bloom.size(), ftr.bloom_off ) == (ssize_t)bloom.size();
+        if ( ok )
+        {
+            _first_keys.resize( ftr.block_cnt * _keylen );
+            _blocks.resize( ftr.block_cnt );
+            _block_recno.resize( ftr.block_cnt );
+            size_t recno(0);
+            for ( size_t b(0); b < ftr.block_cnt; ++b )
+            {
+                ucharptr p = index.data() + b * ent_len;
+                std::memcpy( _first_keys.data() + b * _keylen, p, _keylen );
+                std::memcpy( &_blocks[b], p + _keylen, sizeof(RunBlockInfo) );
+                _block_recno[b] = recno;
+                recno += _blocks[b].rec_cnt;
+            }
+            _bloom.assign( bloom.data(), ftr.bloom_bits, ftr.bloom_k );
+        }
+    }
+    close();
+    if ( !ok )
+        std::cout << "Run file " << _fspec << " is damaged - ignored" << std::endl;
+    return ok;
+}
+
+bool SortedRun::maybe_contains(ucharptr_c key) const
+{
+    return _bloom.maybe_contains( key, _keylen );
+}
+
+off_t SortedRun::search(ucharptr_c key, ucharptr val, size_t *bytes_read)
+{
+    if ( _blocks.empty() || !maybe_contains( key ) )
+        return -1;
+
+    // find the last block whose first key is <= key
+    size_t lo(0), hi(_blocks.size());
+    while ( lo < hi )
+    {
+        size_t mid = ( lo + hi ) / 2;
+        if ( std::memcmp( _first_keys.data() + mid * _keylen, key, _keylen ) <= 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if ( lo == 0 )
+        return -1;
+    size_t blk = lo - 1;
+
+    thread_local std::vector<uchar> buff;
+    buff.resize( RUN_BLOCK_RECS * _reclen );
+    size_t cnt = read_block( blk, buff.data(), bytes_read );
+
+    lo = 0;
+    hi = cnt;
+    while ( lo < hi )
+    {
+        size_t mid = ( lo + hi ) / 2;
+        ucharptr p = buff.data() + mid * _reclen;
+        int cmp = std::memcmp( p, key, _keylen );
+        if ( cmp == 0 )
+        {
+            if ( _vallen != 0 && val != nullptr )
+                std::memcpy( val, p + _keylen, _vallen );
+            return _block_recno[blk] + mid;
+        }
+        if ( cmp < 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+size_t SortedRun::read_block(size_t blk, ucharptr buff, size_t *bytes_read)
+{
+    if ( blk >= _blocks.size() )
+        return 0;
+    const RunBlockInfo& bi = _blocks[blk];
+    size_t raw_len = bi.rec_cnt * _reclen;
+    bool   packed  = bi.len < raw_len;
+    thread_local std::vector<uchar> packed_buff, shuffled;
+    if ( packed )
+        packed_buff.resize( bi.len );
+    int fd = open();
+    if ( fd == -1 )
+        return 0;
+    ssize_t len = ::pread( fd, packed ? packed_buff.data() : buff, bi.len, bi.off );
+    close();
+    if ( len != bi.len )
+        return 0;
+    if ( bytes_read != nullptr )
+        *bytes_read += len;
+    if ( packed )
+    {
+        shuffled.resize( raw_len );
+        if ( _codec != RUN_CODEC_LZ4
+          || lz4::decompress( packed_buff.data(), bi.len, shuffled.data(), raw_len ) != (ssize_t)raw_len )
+        {
+            std::cout << "Damaged block " << blk << " in run file " << _fspec << std::endl;
+            return 0;
+        }
+        lz4::unshuffle( shuffled.data(), buff, bi.rec_cnt, _reclen );
+        lz4::delta_decode( buff, bi.rec_cnt, _reclen, _keylen );
+    }
+    return bi.rec_cnt;
+}
+
+size_t SortedRun::read_recs(size_t recno, ucharptr buff, size_t max_recs)
+{
+    if ( recno >= _reccnt || max_recs == 0 )
+        return 0;
+    auto itr = std::upper_bound( _block_recno.begin(), _block_recno.end(), recno );
+    size_t blk = ( itr - _block_recno.begin() ) - 1;
+    std::vector<uchar> block( RUN_BLOCK_RECS * _reclen );
+    size_t cnt(0);
+    for ( ; blk < _blocks.size() && cnt < max_recs; ++blk )
+    {
+        size_t blk_cnt = read_block( blk, block.data() );
+        if ( blk_cnt == 0 )
+            break;
+        size_t skip = ( recno > _block_recno[blk] ) ? recno - _block_recno[blk] : 0;
+        size_t take = std::min( blk_cnt - skip, max_recs - cnt );
+        std::memcpy( buff + cnt * _reclen, block.data() + skip * _reclen, take * _reclen );
+        cnt += take;
+    }
+    return cnt;
+}
+
+void SortedRun::remove()
+{
+    BucketFileCache::instance().forget( this );
+    std::filesystem::remove( _fspec );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// RunWriter
+//
+RunWriter::RunWriter(const std::string& fspec, size_t key_len, size_t val_len,
+                     size_t expected_cnt, uint32_t bloom_bits_per_key,
+                     uint16_t codec)
+: _fspec(fspec)
+, _keylen(key_len)
+, _reclen(key_len + val_len)
+, _reccnt(0)
+, _off(0)
+, _block_cnt(0)
+, _lineage{0, 0, 0}
+, _ok(true)
+{
+    if ( bloom_bits_per_key != 0 )
+        _bloom = BloomFilter( expected_cnt, bloom_bits_per_key );
+    std::memset( &_footer, 0x00, sizeof(_footer) );
+    std::memcpy( _footer.magic, RUN_MAGIC, sizeof(_footer.magic) );
+    _footer.version    = RUN_VERSION;
+    _footer.codec      = codec;
+    _footer.key_len    = key_len;
+    _footer.val_len    = val_len;
+    _footer.block_recs = RUN_BLOCK_RECS;
+    _block.reserve( RUN_BLOCK_RECS * _reclen );
+    _fp = std::fopen( fspec.c_str(), "w" );
+    _ok = _fp != nullptr;
+}
+
+RunWriter::~RunWriter()
+{
+    if ( _fp != nullptr )
+        std::fclose( _fp );
+}
+
+bool RunWriter::add(ucharptr_c rec)
+{
+    if ( _block.empty() )
+    {
+        // first key of the block goes into the index
+        _index.insert( _index.end(), rec, rec + _keylen );
+        RunBlockInfo bi{ _off, 0, 0 };
+        _index.insert( _index.end(), (uchar *)&bi, (uchar *)&bi + sizeof(bi) );
+    }
+    _block.insert( _block.end(), rec, rec + _reclen );
+    _bloom.add( rec, _keylen );
+    _reccnt++;
+    if ( _block.size() == RUN_BLOCK_RECS * _reclen )
+        return write_block();
+    return _ok;
+}
+
+bool RunWriter::write_block()
+{
+    if ( _block.empty() )
+        return _ok;
+    size_t len = pack_block();
+    const uchar *p = ( len < _block.size() ) ? _packed.data() : _block.data();
+    if ( len >= _block.size() )
+        len = _block.size();
+    _ok = _ok && std::fwrite( p, 1, len, _fp ) == len;
+    RunBlockInfo bi{ _off, (uint32_t)len, (uint32_t)( _block.size() / _reclen ) };
+    std::memcpy( _index.data() + _block_cnt * ( _keylen + sizeof(bi) ) + _keylen, &bi, sizeof(bi) );
+    _off += len;
+    _block_cnt++;
+    _block.clear();
+    return _ok;
+}
+
+// compress the block into _packed. Returns the packed size - if that
+// isn't smaller than the block, the block is written raw.
+size_t RunWriter::pack_block()
+{
+    if ( _footer.codec != RUN_CODEC_LZ4 )
+        return _block.size();
+    size_t rec_cnt = _block.size() / _reclen;
+    std::vector<uchar> delta( _block );
+    std::vector<uchar> shuffled( _block.size() );
+    lz4::delta_encode( delta.data(), rec_cnt, _reclen, _keylen );
+    lz4::shuffle( delta.data(), shuffled.data(), rec_cnt, _reclen );
+    _packed.resize( lz4::compress_bound( shuffled.size() ) );
+    size_t len = lz4::compress( shuffled.data(), shuffled.size(), _packed.data(), _packed.size() );
+    return ( len == 0 ) ? _block.size() : len;
+}
+
+bool RunWriter::finish()
+{
+    write_block();
+    _footer.rec_cnt    = _reccnt;
+    _footer.block_cnt  = _block_cnt;
+    _footer.index_off  = _off;
+    _footer.bloom_off  = _off + _index.size();
+    _footer.bloom_bits = _bloom.bit_cnt();
+    _footer.bloom_k    = _bloom.hash_cnt();
+    _ok = _ok
+       && std::fwrite( _index.data(), 1, _index.size(), _fp ) == _index.size()
+       && std::fwrite( _bloom.data(), 1, _bloom.byte_cnt(), _fp ) == _bloom.byte_cnt()
+       && std::fwrite( &_lineage, sizeof(_lineage), 1, _fp ) == 1
+       && std::fwrite( &_footer, sizeof(_footer), 1, _fp ) == 1;
+    _ok = ( std::fclose( _fp ) == 0 ) && _ok;
+    _fp = nullptr;
+    return _ok;
+}
+
+} // namespace dreid
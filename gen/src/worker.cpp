@@ -1,8 +1,11 @@
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <mutex>
+#include <shared_mutex>
 #include <signal.h>
 #include <sstream>
 #include <thread>
@@ -10,6 +13,10 @@
 #include <stxxl/algorithm>
 
 #include "worker.h"
+#include "dht_cache.h"
+#include "dht_tiers.h"
+#include "dq_front.h"
+#include "frontier_set.h"
 
 namespace dreid {
 
@@ -85,21 +92,169 @@ void add_tier_stats(TierStats& add)
     }
 }
 
-std::mutex unresolved_mtx;
+// held shared to use the queues, exclusive to swap them
+std::shared_mutex unresolved_mtx;
 
+#ifdef RESOLVED_TIER_WINDOW
+dht_tiers<PositionPacked, PosInfo> dht_resolved(RESOLVED_TIER_WINDOW);
+#else
 dht<PositionPacked, PosInfo> dht_resolved;
+#endif
 dht<PosRefRec, NAUGHT_TYPE>  dht_resolved_ref;
 dht<PositionPacked, PosInfo> dht_pawn_n1;
 dht<PosRefRec, NAUGHT_TYPE>  dht_pawn_n1_ref;
 
-DiskQueue dq_unr0(WORK_FILE_PATH, "unresolved0", sizeof( PositionRec ));
-DiskQueue dq_unr1(WORK_FILE_PATH, "unresolved1", sizeof( PositionRec ));
-DiskQueue *dq_get = &dq_unr0;
-DiskQueue *dq_put = &dq_unr1;
+#ifdef CACHE_RESOLVED_POSITIONS
+// recently resolved positions are kept in memory and only spilled to
+// dht_resolved once the cache is full
+dht_cache<PositionPacked, PosInfo, decltype(dht_resolved)> resolved_cache(dht_resolved);
+#define RESOLVED resolved_cache
+#else
+#define RESOLVED dht_resolved
+#endif
+
+#if defined(COMPRESS_DISK_QUEUE)
+const DqMode dq_mode = DQ_COMPRESSED;
+#elif defined(MAP_DISK_QUEUE)
+const DqMode dq_mode = DQ_MAPPED;
+#else
+const DqMode dq_mode = DQ_BUFFERED;
+#endif
+DiskQueue dq_unr0(WORK_FILE_PATH, "unresolved0", sizeof( PositionRec ), dq_mode);
+DiskQueue dq_unr1(WORK_FILE_PATH, "unresolved1", sizeof( PositionRec ), dq_mode);
+#ifdef SORT_DISK_QUEUE
+// frontier records are written in resolved bucket order, so what is
+// popped comes in runs that hit the same buckets
+uint64_t frontier_order(const unsigned char *rec)
+{
+    return DiskHashTable::bucket_order((ucharptr)rec, sizeof(PositionPacked));
+}
+#endif
+
+// the frontier is pushed and popped in memory, and only goes to disk
+// once the ring in front of each queue is full
+QueueFront qf_unr0(dq_unr0, DISK_QUEUE_FRONT_RECS);
+QueueFront qf_unr1(dq_unr1, DISK_QUEUE_FRONT_RECS);
+QueueFront *dq_get = &qf_unr0;
+QueueFront *dq_put = &qf_unr1;
+
+// positions popped from dq_get but not yet expanded - the queues are
+// not swapped until every one of them has pushed its children
+std::atomic<uint64_t> g_held{0};
+
+// a worker's share of the frontier. The children it finds are kept in
+// its own tier queue for the next tier (only overflow goes to dq_put),
+// and once the queues are swapped it works through them first. Workers
+// that run dry steal from the others. A tier is only started once the
+// last one is done, so no worker gets ahead of the rest.
+struct WorkBatch
+{
+    std::vector<PositionRec> recs;      // popped, being worked
+    size_t                   cnt  = 0;
+    size_t                   next = 0;
+    std::mutex               mtx;
+    std::deque<PositionRec>  tier[2];   // tier[g_parity] is being worked
+
+    WorkBatch() : recs(WORK_BATCH_RECS) {}
+};
+
+// guarded by unresolved_mtx
+std::vector<WorkBatch*> g_batches;
+int g_parity = 0;
+
+#ifdef QUEUED_SET_BYTES
+// what has been queued for each tier, indexed like WorkBatch::tier
+frontier_set<PositionPacked, PositionId> queued[2];
+#endif
+
+// take up to a batch of the current tier from a worker's queue - its
+// own from the front, or (stealing) at most half of another's from the
+// back
+size_t take_local(WorkBatch& from, WorkBatch& batch, bool steal)
+{
+    std::lock_guard<std::mutex> lock(from.mtx);
+    auto& q = from.tier[g_parity];
+    size_t cnt = std::min( q.size(), batch.recs.size() );
+    if ( steal )
+        cnt = std::min( cnt, ( q.size() + 1 ) / 2 );
+    for ( size_t i(0); i < cnt; ++i )
+    {
+        if ( steal )
+        {
+            batch.recs[i] = q.back();
+            q.pop_back();
+        }
+        else
+        {
+            batch.recs[i] = q.front();
+            q.pop_front();
+        }
+    }
+    return cnt;
+}
+
+// queue children for the next tier - locally while there's room
+void put_local(WorkBatch& batch, std::vector<PositionRec>& children)
+{
+    size_t cnt(0);
+    BeginDummyScope
+        std::lock_guard<std::mutex> lock(batch.mtx);
+        auto& q = batch.tier[g_parity ^ 1];
+        cnt = std::min( children.size(), LOCAL_FRONTIER_RECS - std::min( q.size(), (size_t)LOCAL_FRONTIER_RECS ) );
+        q.insert(q.end(), children.begin(), children.begin() + cnt);
+    EndDummyScope
+    if ( cnt < children.size() )
+        dq_put->push_n((dq_data_t)(children.data() + cnt), children.size() - cnt);
+}
+
+// fill the batch from this worker's queue, then the shared queue, then
+// the other workers' queues - call with unresolved_mtx held
+size_t next_batch(WorkBatch& batch)
+{
+    size_t cnt = take_local(batch, batch, false);
+    if ( cnt == 0 )
+        cnt = dq_get->pop_n( (dq_data_t)batch.recs.data(), batch.recs.size() );
+    for ( size_t i(0); cnt == 0 && i < g_batches.size(); ++i )
+        if ( g_batches[i] != &batch )
+            cnt = take_local(*g_batches[i], batch, true);
+    return cnt;
+}
+
+// is anything of the current tier still queued anywhere - call with
+// unresolved_mtx held
+bool tier_queued()
+{
+    if ( dq_get->size() != 0 )
+        return true;
+    for ( auto b : g_batches )
+    {
+        std::lock_guard<std::mutex> lock(b->mtx);
+        if ( !b->tier[g_parity].empty() )
+            return true;
+    }
+    return false;
+}
 
 std::mutex mtx_stats;
 Stats stats;
 
+// workers count into their own TierStats and fold them in here, once a
+// position
+void add_stats(const TierStats& add)
+{
+    std::lock_guard<std::mutex> lock(mtx_stats);
+    stats.col_cnt  += add.coll_cnt;
+    stats.capt_cnt += add.capt_cnt;
+    stats.cm_cnt   += add.cm_cnt;
+    stats.sm_cnt   += add.sm_cnt;
+}
+
+Stats get_stats()
+{
+    std::lock_guard<std::mutex> lock(mtx_stats);
+    return stats;
+}
+
 void print_stats()
 {
     std::stringstream ss;
@@ -142,8 +297,8 @@ void load_stats_file(int level, std::string fspec)
 
     if ( stats.alt_queue )
     {
-        dq_get = &dq_unr1;
-        dq_put = &dq_unr0;
+        dq_get = &qf_unr1;
+        dq_put = &qf_unr0;
     }
 
     std::fclose(fp);
@@ -193,17 +348,32 @@ void set_stop_handler()
 
 void insert_unresolved(PositionPacked& pp, PosInfo& pi)
 {
-    std::lock_guard<std::mutex> lock(unresolved_mtx);
+    std::shared_lock<std::shared_mutex> lock(unresolved_mtx);
     PositionRec pr(pp,pi);
     dq_put->push( (const dq_data_t)&pr );
 }
 
 bool open_tables(int level)
 {
+    // resolved is searched far more often than it is read back, so
+    // keep its keys apart from the PosInfo values
+    dht_resolved    .set_storage_mode(DHT_STORAGE_COLUMNS);
     dht_resolved    .open(WORK_FILE_PATH, "resolved", level);
     dht_resolved_ref.open(WORK_FILE_PATH, "resolved_ref", level);
     dht_pawn_n1     .open(WORK_FILE_PATH, "pawn_init", level - 1);
     dht_pawn_n1_ref .open(WORK_FILE_PATH, "pawn_init_ref", level - 1);
+#ifdef CACHE_RESOLVED_POSITIONS
+    resolved_cache  .set_budget(RESOLVED_CACHE_BYTES);
+#endif
+#ifdef QUEUED_SET_BYTES
+    queued[0]       .set_budget(QUEUED_SET_BYTES / 2);
+    queued[1]       .set_budget(QUEUED_SET_BYTES / 2);
+#endif
+
+#ifdef SORT_DISK_QUEUE
+    dq_unr0         .set_sort_key(frontier_order);
+    dq_unr1         .set_sort_key(frontier_order);
+#endif
 
     if ( dq_get->size() == 0 && dq_put->size() == 0 )
     {
@@ -216,26 +386,91 @@ bool open_tables(int level)
     return true;
 }
 
-bool get_unresolved(PositionRec& pr)
+// push any buffered appends to disk
+void flush_tables()
+{
+    dht_resolved    .flush();
+    dht_resolved_ref.flush();
+    dht_pawn_n1     .flush();
+    dht_pawn_n1_ref .flush();
+}
+
+// spill anything held in memory and flush - call once all workers are done
+void close_tables()
+{
+#ifdef CACHE_RESOLVED_POSITIONS
+    DhtCacheStats cs = resolved_cache.stats();
+    uint64_t lookups = cs.hits + cs.misses;
+    std::cout << "Resolved cache " << cs.size << '/' << cs.capacity
+              << " hits " << cs.hits << '/' << lookups
+              << " (" << ( lookups ? 100.0 * cs.hits / lookups : 0.0 ) << "%)"
+              << " spilled " << cs.spills << std::endl;
+    resolved_cache.spill();
+#endif
+#ifdef RESOLVED_TIER_WINDOW
+    DhtTierStats ts = dht_resolved.stats();
+    std::cout << "Resolved tiers " << ts.hot_tiers << " hot, " << ts.cold_runs << " archives"
+              << " hot hits " << ts.hot_hits << " cold hits " << ts.cold_hits
+              << " cold probes " << ts.cold_probes << " bloom skips " << ts.bloom_skips << std::endl;
+#endif
+#ifdef QUEUED_SET_BYTES
+    FrontierSetStats qs0 = queued[0].stats();
+    FrontierSetStats qs1 = queued[1].stats();
+    std::cout << "Queued set added " << qs0.adds + qs1.adds
+              << " duplicates " << qs0.dups + qs1.dups
+              << " let through " << qs0.passed + qs1.passed
+              << " fingerprinted shards " << qs0.printed + qs1.printed << std::endl;
+#endif
+    std::cout << "Frontier spilled " << qf_unr0.spilled() + qf_unr1.spilled()
+              << " refilled " << qf_unr0.refilled() + qf_unr1.refilled() << std::endl;
+    flush_tables();
+    // the rings are only in memory
+    qf_unr0.spill();
+    qf_unr1.spill();
+}
+
+// take the next position from the batch (popping another batch when it
+// runs out) and claim it in the resolved table. The handle names the
+// new record so the worker can fill it in without a search (cached
+// records have none, and are filled in by key.)
+bool get_unresolved(PositionRec& pr, DiskHashTable::Handle& handle, WorkBatch& batch)
 {
     bool retried = false;
     while (true)
     {
         for (int retry(0); retry < 3; ++retry)
         {
-            std::unique_lock<std::mutex> lock(unresolved_mtx);
-            if ( dq_get->pop( (dq_data_t)&pr ))
+            std::shared_lock<std::shared_mutex> lock(unresolved_mtx);
+            if ( batch.next == batch.cnt )
+            {
+                batch.cnt  = next_batch(batch);
+                batch.next = 0;
+                g_held += batch.cnt;
+            }
+            if ( batch.next < batch.cnt )
             {
-                PosInfo ppi;
-                if (dht_resolved.search(pr.pp, ppi))
+                pr = batch.recs[batch.next++];
+#ifdef RESOLVED_TIER_WINDOW
+                // the first position of a new tier moves the window
+                dht_resolved.set_tier(pr.pi.distance);
+#endif
+                PosInfo ppi = pr.pi;
+#ifdef CACHE_RESOLVED_POSITIONS
+                if (!RESOLVED.insert_or_get(pr.pp, ppi))
+#else
+                if (!RESOLVED.insert_or_get(pr.pp, ppi, handle))
+#endif
                 {
                     PosRefRec prr(pr.pi.parent, pr.pi.move, ppi.id);
                     dht_resolved_ref.append(prr);
-                    stats.col_cnt++;
+                    BeginDummyScope
+                        std::lock_guard<std::mutex> stats_lock(mtx_stats);
+                        stats.col_cnt++;
+                    EndDummyScope
+                    g_held--;
                     retry--;
                     continue;
                 }
-                dht_resolved.insert(pr.pp, pr.pi);
                 return true;
             }
             else
@@ -246,6 +481,15 @@ bool get_unresolved(PositionRec& pr)
             }
         }
 
+        if ( g_held > 0 )
+        {
+            // others are still expanding this tier
+            if ( stop )
+                return false;
+            retried = false;
+            continue;
+        }
+
         if (retried)
         {
             // if we've already swapped the queues, then there's
@@ -255,10 +499,21 @@ bool get_unresolved(PositionRec& pr)
         }
 
         BeginDummyScope
-            std::unique_lock<std::mutex> lock(unresolved_mtx);
+            std::unique_lock<std::shared_mutex> lock(unresolved_mtx);
+            if ( g_held > 0 || tier_queued() )
+                continue;
             std::swap(dq_get, dq_put);
-            stats.alt_queue = dq_get == &dq_unr1;
+#ifdef QUEUED_SET_BYTES
+            // the tier just finished - its set is reused for the next
+            queued[g_parity].clear();
+#endif
+            g_parity ^= 1;
+            stats.alt_queue = dq_get == &qf_unr1;
             retried = true;
+            // tier boundary
+            flush_tables();
+            qf_unr0.flush();
+            qf_unr1.flush();
         EndDummyScope
     }
 }
@@ -271,12 +526,26 @@ void worker(int level)
     MoveList moves;
     moves.reserve(50);
 
+    // children of the position being expanded, split by piece count
+    MoveList                    mvs, n1_mvs;
+    std::vector<PositionPacked> keys, n1_keys;
+    std::vector<PosInfo>        vals, n1_vals, piFound;
+    std::vector<PositionRec>    children;
+    FoundList                   found;
+    WorkBatch                   batch;
+
+    BeginDummyScope
+        std::unique_lock<std::shared_mutex> lock(unresolved_mtx);
+        g_batches.push_back(&batch);
+    EndDummyScope
+
     int loop_cnt{0};
     int retry_cnt{0};
     while (!stop)
     {
         PositionRec prBase;
-        if ( !get_unresolved(prBase) )
+        DiskHashTable::Handle handle;
+        if ( !get_unresolved(prBase, handle, batch) )
             break;
 
         retry_cnt = 0;
@@ -293,13 +562,11 @@ void worker(int level)
         prBase.pi.egr = checkEndOfGame(sub_board, moves, s);
         if ( prBase.pi.egr == EGR_13A_CHECKMATE )
         {
-            stats.cm_cnt++;
             tstats.cm_cnt++;
             std::cout << std::this_thread::get_id() << " checkmate:" << sub_board.getPosition().fen_string() << std::endl;
         }
         else if ( prBase.pi.egr == EGR_14A_STALEMATE )
         {
-            stats.sm_cnt++;
             tstats.sm_cnt++;
             std::cout << std::this_thread::get_id() << " stalemate:" << sub_board.getPosition().fen_string() << std::endl;
         }
@@ -312,6 +579,12 @@ void worker(int level)
         else
         {
             short distance = prBase.pi.distance + 1;
+            n1_mvs.clear();
+            n1_keys.clear();
+            n1_vals.clear();
+            mvs.clear();
+            keys.clear();
+            vals.clear();
             for (MovePtr mv : moves)
             {
                 Board brdPrime(prBase.pp);
@@ -324,7 +597,6 @@ void worker(int level)
                     PosInfo(get_position_id(level), prBase.pi, mv->pack())
                 };
                 prPrime.pi.distance = distance;
-                PosInfo piFound;
 
                 // 50-move rule: drawn game if no pawn move or capture in the last 50 moves.
                 // hence, if this is a pawn move or a capture, reset the counter.
@@ -334,46 +606,90 @@ void worker(int level)
                 // }
                 if (brdPrime.gi().getPieceCnt() == level-1)
                 {
-                    stats.capt_cnt++;
                     tstats.capt_cnt++;
-                    if ( dht_pawn_n1.search(prPrime.pp, piFound ) )
+                    n1_mvs.push_back(mv);
+                    n1_keys.push_back(prPrime.pp);
+                    n1_vals.push_back(prPrime.pi);
+                }
+                else if(brdPrime.gi().getPieceCnt() == level)
+                {
+                    mvs.push_back(mv);
+                    keys.push_back(prPrime.pp);
+                    vals.push_back(prPrime.pi);
+                }
+                else
+                {
+                    std::cout << "ERROR! too many captures "
+                              << brdPrime.gi().getPieceCnt()
+                              << ' ' << brdPrime.getPosition().fen_string()
+                              << std::endl;
+                    // stop = true;
+                }
+            }   // end for()
+
+            // resolve all the children of this position at once - one
+            // pass over each bucket they hash to.
+            if ( !n1_keys.empty() )
+            {
+                dht_pawn_n1.insert_many(n1_keys, n1_vals, found);
+                for (size_t i(0); i < n1_keys.size(); ++i)
+                {
+                    if ( !found[i] )
                     {
-                        PosRefRec prr( prBase.pi.id, mv, piFound.id );
+                        // already known - n1_vals[i] is the existing record
+                        PosRefRec prr( prBase.pi.id, n1_mvs[i], n1_vals[i].id );
                         dht_pawn_n1_ref.append(prr);
                     }
-                    else
-                    {
-                        dht_pawn_n1.append( prPrime.pp, prPrime.pi );
-                    }
                 }
-                else if(brdPrime.gi().getPieceCnt() == level)
+            }
+
+            if ( !keys.empty() )
+            {
+                piFound.resize(vals.size());
+                children.clear();
+                RESOLVED.search_many(keys, piFound, found);
+                for (size_t i(0); i < keys.size(); ++i)
                 {
-                    if ( dht_resolved.search( prPrime.pp, piFound ) )
+                    if ( found[i] )
                     {
-                        PosRefRec prr(prBase.pi.id, mv, piFound.id);
+                        PosRefRec prr(prBase.pi.id, mvs[i], piFound[i].id);
                         dht_resolved_ref.append(prr);
-                        stats.col_cnt++;
                         tstats.coll_cnt++;
                     }
                     else
                     {
-                        dq_put->push((const dq_data_t)&prPrime);
+#ifdef QUEUED_SET_BYTES
+                        // queued already, by another parent in this tier
+                        // or the tier being worked?
+                        PositionId qid = vals[i].id;
+                        if ( queued[g_parity].search(keys[i], qid)
+                         || !queued[g_parity ^ 1].insert_or_get(keys[i], qid) )
+                        {
+                            PosRefRec prr(prBase.pi.id, mvs[i], qid);
+                            dht_resolved_ref.append(prr);
+                            tstats.coll_cnt++;
+                            continue;
+                        }
+#endif
+                        children.emplace_back(keys[i], vals[i]);
                         tstats.move_cnt++;
                     }
                 }
-                else
-                {
-                    std::cout << "ERROR! too many captures "
-                              << brdPrime.gi().getPieceCnt()
-                              << ' ' << brdPrime.getPosition().fen_string()
-                              << std::endl;
-                    // stop = true;
-                }
-            }   // end for()
+                if ( !children.empty() )
+                    put_local(batch, children);
+            }
         }
 
-        dht_resolved.update(prBase.pp, prBase.pi);
+#ifdef CACHE_RESOLVED_POSITIONS
+        RESOLVED.update(prBase.pp, prBase.pi);
+#else
+        if ( !RESOLVED.update(handle, prBase.pi) )
+            RESOLVED.update(prBase.pp, prBase.pi);
+#endif
+        g_held--;
         add_tier_stats(tstats);
+        add_stats(tstats);
+        Stats st = get_stats();
         // std::cout << "base,parent,mov/p/c/5/1,move,dist,coll_cnt,init_cnt,res_cnt,get,put,unr1,fifty,FEN\n";
         ss.str(std::string());
         ss.flags(std::ios::hex);
@@ -384,11 +700,11 @@ void worker(int level)
         ss.width(ow);
         ss  << ',' << dq_get->size()
             << ',' << dq_put->size()
-            << ',' << stats.col_cnt
+            << ',' << st.col_cnt
             << ',' << Move::unpack(prBase.pi.move)
             << ',' << prBase.pi.distance
-            << ',' << stats.capt_cnt
-            << ',' << dht_resolved.size()
+            << ',' << st.capt_cnt
+            << ',' << RESOLVED.size()
             // << std::flush;
         // ss.width(2);
             << ',' << std::setw(2) << tstats.move_cnt
@@ -400,6 +716,23 @@ void worker(int level)
         std::cout << ss.str();
     }
 
+    BeginDummyScope
+        // hand back what was never started, and this worker's queues
+        std::unique_lock<std::shared_mutex> lock(unresolved_mtx);
+        if ( batch.next < batch.cnt )
+        {
+            dq_get->push_n((dq_data_t)(batch.recs.data() + batch.next), batch.cnt - batch.next);
+            g_held -= batch.cnt - batch.next;
+        }
+        for ( int t(0); t < 2; ++t )
+        {
+            std::vector<PositionRec> recs(batch.tier[t].begin(), batch.tier[t].end());
+            if ( !recs.empty() )
+                ( t == g_parity ? dq_get : dq_put )->push_n((dq_data_t)recs.data(), recs.size());
+        }
+        g_batches.erase( std::find( g_batches.begin(), g_batches.end(), &batch ) );
+    EndDummyScope
+
     ss.str(std::string());
     ss << std::this_thread::get_id() << " stopping\n";
     std::cout << ss.str();
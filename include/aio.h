@@ -0,0 +1,97 @@
+// AsyncIO
+//
+// Batched positional reads and writes. Requests are queued with
+// prep_read()/prep_write(), handed over together with submit(), and
+// their completions collected with wait(). On Linux this runs on an
+// io_uring so up to depth requests are in flight at once; where the
+// ring can't be set up (old kernel, seccomp) every request is simply
+// done with pread/pwrite at submit time and the interface is the same.
+//
+// Short transfers are resubmitted internally, so a completion reports
+// either the full length, a short count at end of file, or -errno.
+//
+// An AsyncIO is not thread-safe - give each thread its own.
+//
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <sys/types.h>
+
+namespace dreid {
+
+#define AIO_QUEUE_DEPTH 64
+
+struct AioCompletion
+{
+    uint64_t tag;
+    ssize_t  result;    // bytes transferred, or -errno
+};
+
+class AsyncIO
+{
+private:
+    struct Op
+    {
+        int      fd;
+        uint8_t *buf;
+        size_t   len;
+        off_t    off;
+        size_t   done;
+        bool     write;
+        uint64_t tag;
+    };
+
+    unsigned               _depth;
+    int                    _ring;       // -1 when falling back to pread/pwrite
+    std::vector<Op>        _ops;        // one slot per in-flight request
+    std::vector<unsigned>  _free;       // unused slots
+    std::deque<unsigned>   _queued;     // prepared, not yet submitted
+    std::deque<AioCompletion> _done;    // completed, not yet collected
+    size_t                 _inflight;
+
+    // ring mappings
+    void     *_sq_ptr;
+    size_t    _sq_len;
+    void     *_cq_ptr;
+    size_t    _cq_len;
+    void     *_sqes;
+    size_t    _sqes_len;
+    unsigned *_sq_head;
+    unsigned *_sq_tail;
+    unsigned *_sq_mask;
+    unsigned *_sq_array;
+    unsigned *_cq_head;
+    unsigned *_cq_tail;
+    unsigned *_cq_mask;
+    void     *_cqes;
+
+public:
+    AsyncIO(unsigned depth = AIO_QUEUE_DEPTH, bool use_ring = true);
+    ~AsyncIO();
+
+    bool     uring()    const { return _ring != -1; }
+    unsigned depth()    const { return _depth; }
+    // requests prepared, in flight or finished that haven't been collected
+    size_t   pending()  const { return _queued.size() + _inflight + _done.size(); }
+    bool     full()     const { return _free.empty(); }
+
+    // queue a request. Returns false if depth requests are outstanding.
+    bool   prep_read (int fd, void *buf, size_t len, off_t off, uint64_t tag);
+    bool   prep_write(int fd, const void *buf, size_t len, off_t off, uint64_t tag);
+    // start everything prepared so far
+    size_t submit();
+    // collect at least min_cnt completions (fewer if nothing is pending)
+    size_t wait(std::vector<AioCompletion>& done, size_t min_cnt = 1);
+
+private:
+    bool   setup_ring();
+    void   teardown_ring();
+    bool   prep(int fd, uint8_t *buf, size_t len, off_t off, bool write, uint64_t tag);
+    void   push_sqe(unsigned slot);
+    size_t reap();
+    void   finish(unsigned slot, ssize_t res);
+    void   run_sync(unsigned slot);
+};
+
+} // namespace dreid
@@ -0,0 +1,45 @@
+// BloomFilter
+//
+// Plain bit-array Bloom filter over raw byte keys. A negative answer is
+// definite, a positive one only means "maybe". Used to skip sorted runs
+// and cold archives that cannot hold a key.
+//
+// The bits can be saved alongside the data they describe and loaded
+// back with the same hash count.
+//
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace dreid {
+
+class BloomFilter
+{
+private:
+    std::vector<uint64_t> _bits;
+    uint64_t              _nbits;
+    uint32_t              _k;       // number of probes per key
+
+public:
+    BloomFilter();
+    // size the filter for key_cnt keys at bits_per_key
+    BloomFilter(uint64_t key_cnt, uint32_t bits_per_key);
+
+    void add(const unsigned char *key, size_t len);
+    bool maybe_contains(const unsigned char *key, size_t len) const;
+    void clear();
+
+    bool     empty()    const { return _nbits == 0; }
+    uint64_t bit_cnt()  const { return _nbits; }
+    uint32_t hash_cnt() const { return _k; }
+    size_t   byte_cnt() const { return _bits.size() * sizeof(uint64_t); }
+
+    // raw access for persisting the filter
+    const unsigned char *data() const { return (const unsigned char *)_bits.data(); }
+    void assign(const unsigned char *bits, uint64_t nbits, uint32_t k);
+
+    static uint64_t hash(const unsigned char *key, size_t len, uint64_t seed = 0);
+};
+
+} // namespace dreid
@@ -8,7 +8,13 @@
 //#define ENFORCE_14F_50_MOVE_RULE
 
 // uncomment to cache resolved positions
-//#define CACHE_RESOLVED_POSITIONS
+#define CACHE_RESOLVED_POSITIONS
+// RAM given to the resolved position cache
+#define RESOLVED_CACHE_BYTES (1024ULL*1024*1024*4)    // 4 GiB
+
+// resolved positions are only kept searchable for this many distance
+// tiers, older ones are archived (comment out to keep every tier hot)
+#define RESOLVED_TIER_WINDOW 5
 
 // uncomment to cache pawn-move positions rather than shunt to files
 //#define CACHE_PAWN_MOVE_POSITIONS
@@ -20,3 +26,26 @@
 // #define SEGREGATE_PAWN_MOVES
 
 #define USE_DISK_QUEUE
+
+// comment out to use buffered io rather than mapping the disk queues
+#define MAP_DISK_QUEUE
+
+// uncomment to LZ4 compress new disk queues (never mapped). Queues
+// already on disk keep the layout they were created with.
+//#define COMPRESS_DISK_QUEUE
+
+// comment out to write the disk queues in the order pushed rather than
+// in resolved bucket order
+#define SORT_DISK_QUEUE
+
+// records held in memory in front of each disk queue
+#define DISK_QUEUE_FRONT_RECS (1024*64)
+
+// positions a worker pops from the frontier at a time
+#define WORK_BATCH_RECS 64
+// next-tier positions a worker keeps for itself before using the disk queue
+#define LOCAL_FRONTIER_RECS 4096
+
+// RAM given to the sets of positions queued for the current and next
+// tiers, so each is only queued once (comment out to queue duplicates)
+#define QUEUED_SET_BYTES (1024ULL*1024*1024*2)    // 2 GiB
@@ -9,83 +9,333 @@
 //
 //
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <list>
 #include <map>
 #include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <span>
 #include <string>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include "aio.h"
 #include "dreid.h"
 #include "md5.h"
 
 namespace dreid {
 
-#define BUCKET_ID_WIDTH 3
+// Buckets start out with BUCKET_ID_WIDTH hex digits of the key hash.
+// A bucket that grows past the split threshold is split into sixteen
+// buckets one digit longer (extendible hashing on hex digits), up to
+// BUCKET_ID_MAX_WIDTH digits. The split prefixes are persisted in the
+// table's .dir file.
+#define BUCKET_ID_WIDTH     3
+#define BUCKET_ID_MAX_WIDTH 8
+#define BUCKET_SPLIT_RECS   (1024*64)
 const unsigned short BUCKET_LO  = 0;
 const unsigned short BUCKET_HI  = 1 << (4 * BUCKET_ID_WIDTH );
 
+// maximum number of bucket files held open across all tables
+#define BUCKET_FILE_CACHE_SIZE 512
+
+// bytes read at a time by iterators and full-table scans
+#define ITER_BUFF_SIZE 1024*256
+
+// LSM storage: a bucket's log is compacted into a sorted run once it
+// holds LSM_LOG_RECS records, and a bucket's runs are merged into one
+// once there are more than LSM_MAX_RUNS of them. Runs carry a Bloom
+// filter of LSM_BLOOM_BITS bits per key (0 for none.)
+#define LSM_LOG_RECS   4096
+#define LSM_MAX_RUNS   4
+#define LSM_BLOOM_BITS 10
+
+enum DhtStorageMode {
+    DHT_STORAGE_LOG,    // unsorted append-only bucket files
+    DHT_STORAGE_LSM,    // append log plus immutable sorted runs
+    DHT_STORAGE_COLUMNS // key file plus a parallel value file
+};
+
+// record number argument meaning "not a columnar key block"
+#define RECNO_NONE ((size_t)-1)
+
 typedef unsigned char   uchar;
 typedef uchar         * ucharptr;
 typedef const ucharptr  ucharptr_c;
 typedef std::shared_ptr<uchar[]> BuffPtr;
+typedef std::vector<size_t>      IndexList;
+typedef std::vector<bool>        FoundList;
+typedef std::vector<std::string> BucketIdList;
+typedef std::set<std::string>    BucketIdSet;
 
 typedef std::string (*dht_bucket_id_func)(ucharptr_c, size_t);
 
+class SortedRun;
+struct RunLineage;
+typedef std::shared_ptr<SortedRun> SortedRunPtr;
+
+// The manifest is written when a table is closed and removed when it is
+// opened, so a manifest on disk always describes a cleanly closed table
+// and open() can trust it instead of listing and stat'ing every bucket.
+// Layout: DhtManifestHeader, split_cnt split ids, then bucket_cnt
+// DhtManifestBucket records.
+#define DHT_MANIFEST_MAGIC   "DHTM"
+#define DHT_MANIFEST_VERSION 2
+#define DHT_DEFAULT_HASHER   "md5"
+
+#pragma pack(1)
+
+struct DhtManifestHeader
+{
+    char     magic[4];
+    uint16_t version;
+    uint32_t key_len;
+    uint32_t val_len;
+    char     hasher[16];
+    uint16_t storage;       // DhtStorageMode
+    uint32_t split_cnt;
+    uint32_t bucket_cnt;
+    uint64_t rec_cnt;
+};
+
+struct DhtManifestBucket
+{
+    char     id[BUCKET_ID_MAX_WIDTH];   // not NUL-terminated when full
+    uint64_t rec_cnt;
+    uint64_t log_cnt;       // records in the bucket file proper
+};
+
+#pragma pack()
+
+// Operation counters. Each bucket keeps its own; table totals are the
+// sum over the live buckets plus whatever buckets retired by splits
+// had counted.
+struct DhtStats
+{
+    uint64_t searches;      // keys looked up (inserts look up too)
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t recs_compared; // records examined by searches
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t appends;
+    uint64_t updates;
+    uint64_t lock_waits;    // bucket lock acquisitions that had to block
+    uint64_t lock_wait_ns;  // time spent blocked on them
+    uint64_t opens;         // bucket file opened (again) by the file cache
+    uint64_t run_probes;    // sorted runs searched (LSM)
+    uint64_t bloom_skips;   // sorted runs skipped by their filter (LSM)
+
+    DhtStats& operator+=(const DhtStats& o);
+};
+
+struct DhtBucketStats
+{
+    std::string id;
+    size_t      rec_cnt;
+    size_t      run_cnt;
+    DhtStats    stats;
+};
+
 typedef uchar NAUGHT_TYPE;
 static NAUGHT_TYPE  NAUGHT   = '\0';
 static NAUGHT_TYPE *P_NAUGHT = &NAUGHT;
 
+// BucketFileCache
+//
+// Bounded LRU of open bucket file descriptors shared by every
+// DiskHashTable. A bucket pins its descriptor for the duration of an
+// operation (possibly several times over by concurrent readers), and
+// only unpinned files are eligible to be closed when the cache is full.
+// Hot buckets therefore stay open while cold ones are recycled,
+// without running into the process file limit (EMFILE.)
+class BucketFileCache
+{
+public:
+    struct Stats
+    {
+        size_t hits;        // acquire found the file already open
+        size_t misses;      // acquire had to open the file
+        size_t evictions;   // files closed to make room
+        size_t open_cnt;    // files currently open
+        size_t capacity;
+    };
+
+private:
+    typedef const void*          OwnerId;
+    typedef std::list<OwnerId>   LruList;
+
+    struct Entry
+    {
+        int               fd;
+        int               pins;
+        LruList::iterator lru;      // valid only when pins == 0
+    };
+
+    std::mutex                           _mtx;
+    std::unordered_map<OwnerId, Entry>   _map;
+    LruList                              _lru;      // unpinned, most recent at front
+    size_t                               _capacity;
+    size_t                               _hits;
+    size_t                               _misses;
+    size_t                               _evictions;
+
+    BucketFileCache();
+    void evict_nolock();
+
+public:
+    static BucketFileCache& instance();
+
+    int        acquire(OwnerId owner, const std::string& fspec, bool create = true, bool *opened = nullptr);
+    void       release(OwnerId owner);
+    void       forget(OwnerId owner);
+    void       capacity(size_t cap);
+    Stats      stats();
+};
+
 class DiskHashTable
 {
     struct BucketFile
     {
+        // pin the bucket's descriptor for the life of the guard
         struct file_guard
         {
             BucketFile& _bf;
-            bool        _was_open;
-            file_guard(BucketFile& bf) : _bf(bf)
-            {
-                _was_open = _bf._fp != nullptr;
-                if ( !_was_open )
-                    _bf.open();
-            }
+            bool        _values;
+            int         _fd;
+            file_guard(BucketFile& bf, bool values = false)
+            : _bf(bf), _values(values), _fd(bf.open(values))
+            {}
 
             ~file_guard()
             {
-                if ( !_was_open )
-                    _bf.close();
+                if ( _fd != -1 )
+                    _bf.close(_values);
             }
+
+            operator int() const { return _fd; }
         };
 
-        static std::map<size_t, BuffPtr> buff_map;
+        typedef std::chrono::steady_clock Clock;
 
-        std::mutex  _mtx;
-        std::FILE*  _fp;
+        // DhtStats, bumped by concurrent readers
+        struct Counters
+        {
+            std::atomic<uint64_t> searches{0};
+            std::atomic<uint64_t> hits{0};
+            std::atomic<uint64_t> misses{0};
+            std::atomic<uint64_t> recs_compared{0};
+            std::atomic<uint64_t> bytes_read{0};
+            std::atomic<uint64_t> bytes_written{0};
+            std::atomic<uint64_t> appends{0};
+            std::atomic<uint64_t> updates{0};
+            std::atomic<uint64_t> lock_waits{0};
+            std::atomic<uint64_t> lock_wait_ns{0};
+            std::atomic<uint64_t> opens{0};
+            std::atomic<uint64_t> run_probes{0};
+            std::atomic<uint64_t> bloom_skips{0};
+
+            DhtStats snapshot() const;
+            void     reset();
+            void     found(size_t hit_cnt, size_t key_cnt);
+        };
+
+        // readers share the lock and use positional reads, so any number
+        // of them can scan the bucket at once. Appends, updates and
+        // flushes take it exclusively.
+        std::shared_mutex _mtx;
         std::string _fspec;
         size_t      _keylen;
         size_t      _vallen;
-        size_t      _reccnt;
+        size_t      _reccnt;    // all records - runs, file and _wbuf
+        size_t      _logcnt;    // records in the file and _wbuf
         size_t      _reclen;
+        // write-back buffer of appended records not yet on disk. These
+        // logically follow the last record in the file.
+        std::vector<uchar> _wbuf;
+        Clock::time_point  _wbuf_since;
+        // In LSM mode the file is only the mutable tier. Compaction
+        // sorts it into an immutable run, and runs are merged as they
+        // pile up. Lookups try the file, then runs newest to oldest, so
+        // an update of a record held in a run is appended to the file
+        // and shadows the old version until the runs are merged.
+        bool        _lsm;
+        std::vector<SortedRunPtr> _runs;    // oldest first
+        uint32_t    _run_seq;               // next run number
+        // In columnar mode the file holds only keys, and the values sit
+        // in a parallel file at the same record numbers. Searches scan
+        // the keys and read a value only on a hit.
+        bool        _columnar;
+        std::string _valspec;
+        // bumped whenever the record numbers of the file stop meaning
+        // what they did (log compacted, bucket split), so stale handles
+        // are turned away
+        uint64_t    _gen;
+        Counters    _ctr;
 
         BucketFile( std::string fspec,
                     size_t key_len,
                     size_t val_len = 0);
+        BucketFile( std::string fspec,
+                    size_t key_len,
+                    size_t val_len,
+                    size_t rec_cnt);
         ~BucketFile();
-        bool open();
-        bool close();
+        int  open(bool values = false);
+        void close(bool values = false);
+        void set_columnar(bool recount);
+        // take _mtx, counting the time spent waiting for it
+        std::shared_lock<std::shared_mutex> read_lock();
+        std::unique_lock<std::shared_mutex> write_lock();
         off_t search(ucharptr_c key, ucharptr   val = P_NAUGHT);
         bool  append(ucharptr_c key, ucharptr_c val = P_NAUGHT);
         bool  update(ucharptr_c key, ucharptr_c val = P_NAUGHT);
         bool  read(size_t recno, ucharptr key, ucharptr val);
+        size_t read_block(size_t recno, ucharptr buff, size_t max_recs);
+        bool  flush();
+        bool  flush_if_older(Clock::time_point cutoff);
+        // flush, then wait until the file is on disk
+        bool  sync();
 
-        size_t seek();
         BuffPtr get_file_buff();
 
+        size_t search_many(ucharptr_c keys, IndexList& idx, ucharptr vals, FoundList& found);
+        size_t insert_many(ucharptr_c keys, IndexList& idx, ucharptr vals, FoundList& inserted);
+        bool  insert_or_get(ucharptr_c key, ucharptr val, size_t& recno, uint64_t& gen);
+        bool  update_at(size_t recno, uint64_t gen, ucharptr_c val);
+
         off_t search_nolock(ucharptr_c key, ucharptr val = P_NAUGHT);
+        size_t search_many_nolock(ucharptr_c keys, IndexList& idx, ucharptr vals, FoundList& found);
+        size_t search_tail_nolock(ucharptr_c keys, IndexList& idx, ucharptr vals, FoundList& found);
+        size_t match_nolock(ucharptr_c recs, size_t rec_cnt, ucharptr_c keys, IndexList& idx, ucharptr vals, FoundList& found, size_t key_recno = RECNO_NONE);
+        bool  read_value_nolock(size_t recno, ucharptr val);
+        size_t read_columns_nolock(int fd, size_t recno, size_t cnt, ucharptr buff);
         bool  append_nolock(ucharptr_c key, ucharptr_c val = P_NAUGHT);
+        void  buffer_nolock(ucharptr_c key, ucharptr_c val = P_NAUGHT);
+        bool  flush_due() const;
         bool  update_nolock(ucharptr_c key, ucharptr_c val = P_NAUGHT);
+        bool  flush_nolock();
+        size_t file_reccnt() const { return _logcnt - _wbuf.size() / _reclen; }
+        // bytes per record in the file proper
+        size_t file_stride() const { return _columnar ? _keylen : _reclen; }
+
+        void  attach_run(SortedRunPtr run, uint32_t seq);
+        std::string run_fspec(uint32_t seq) const;
+        bool  compact(size_t max_runs, uint32_t bloom_bits, uint16_t codec);
+        bool  compact_log_nolock(uint32_t bloom_bits, uint16_t codec);
+        bool  merge_runs_nolock(uint32_t bloom_bits, uint16_t codec);
+        void  remove_runs();
+        bool  drop_compacted_log(const RunLineage& lineage);
     };
 
 public:
@@ -93,15 +343,49 @@ public:
     typedef std::map<std::string, BucketFilePtr> BucketFilePtrMap;
     typedef BucketFilePtrMap::const_iterator     BucketFilePtrMapCItr;
 
+    // Names the slot of a record that insert_or_get added, so its value
+    // can be rewritten without searching for it. A handle goes stale
+    // once its bucket is split or its log compacted, and update() then
+    // returns false - update by key instead.
+    struct Handle
+    {
+        std::weak_ptr<BucketFile> bucket;
+        uint64_t                  gen   = 0;
+        size_t                    recno = 0;
+    };
+
 protected:
-    BucketFilePtrMap   fp_map;
-    size_t             keylen;
-    size_t             vallen;
-    size_t             reclen;
-    std::string        path;
-    std::string        name;
-    size_t             reccnt;
-    dht_bucket_id_func buckfunc;
+    BucketFilePtrMap    fp_map;
+    std::shared_mutex   map_mtx;    // guards fp_map
+    size_t              keylen;
+    size_t              vallen;
+    size_t              reclen;
+    std::string         path;
+    std::string         name;
+    std::atomic<size_t> reccnt;
+    dht_bucket_id_func  buckfunc;
+    std::string         hasher_id;
+    std::atomic<std::chrono::steady_clock::rep> last_sweep;
+    // every table operation holds split_mtx shared, so a split (which
+    // holds it exclusively) never pulls a bucket out from under anyone.
+    // split_set is only changed while splitting.
+    std::shared_mutex   split_mtx;
+    BucketIdSet         split_set;
+    size_t              split_recs;
+    // LSM mode - buckets are queued for the table's compaction thread
+    // once their logs fill up.
+    DhtStorageMode      storage;
+    size_t              lsm_log_recs;
+    size_t              lsm_max_runs;
+    uint32_t            lsm_bloom_bits;
+    uint16_t            lsm_codec;
+    std::thread             compactor;
+    std::mutex              compact_mtx;
+    std::condition_variable compact_cv;
+    std::deque<std::string> compact_queue;
+    BucketIdSet             compact_pending;
+    bool                    compact_stop;
+    DhtStats            retired;    // counters of buckets removed by splits
 
 public:
     DiskHashTable();
@@ -113,14 +397,99 @@ public:
         const std::string  base_name,
         int                level,
         size_t             key_len,
-        size_t             val_len = 0,
-        dht_bucket_id_func bucket_func = default_hasher);
+        size_t             val_len = 0);
+    // flush everything and write the manifest. Called by the destructor.
+    bool close();
 
     size_t size() const {return reccnt;}
     bool search(ucharptr_c key, ucharptr val = nullptr);
     bool insert(ucharptr_c key, ucharptr_c val = nullptr);
     bool append(ucharptr_c key, ucharptr_c val = nullptr);
     bool update(ucharptr_c key, ucharptr_c val = nullptr);
+    // Insert the record unless the key is already there, as one step
+    // under the bucket lock. Returns true and a handle to the new record
+    // if it was added, or false with the existing value copied to val.
+    bool insert_or_get(ucharptr_c key, ucharptr val, Handle& handle);
+    // rewrite the value of the record named by the handle in place
+    bool update(const Handle& handle, ucharptr_c val);
+    // write all buffered appends to disk - call at tier boundaries and
+    // before shutdown.
+    bool flush();
+
+    // Batched forms of search and insert. keys holds a run of packed
+    // keys and vals a parallel run of packed values (or is empty for
+    // tables without values.) Keys are grouped by bucket and each group
+    // is answered with a single pass over its bucket. found/inserted
+    // receive one flag per key, in input order.
+    //
+    // search_many copies the value of each found key into vals.
+    // insert_many appends each absent key, and for keys that were
+    // already present copies the existing value into vals.
+    size_t search_many(std::span<const uchar> keys, std::span<uchar> vals, FoundList& found);
+    size_t insert_many(std::span<const uchar> keys, std::span<uchar> vals, FoundList& inserted);
+
+    // Asynchronous forms of search_many and append. The bucket reads of
+    // a search are all put on the caller's AsyncIO ring together, so one
+    // thread keeps up to aio.depth() reads in flight instead of one.
+    // Appends are buffered as usual, and the buffers that are due are
+    // written out through the ring in one go (columnar buckets, which
+    // need two writes, are flushed directly.) The ring must not have
+    // anything else pending.
+    size_t search_many_async(AsyncIO& aio, std::span<const uchar> keys, std::span<uchar> vals, FoundList& found);
+    size_t append_many_async(AsyncIO& aio, std::span<const uchar> keys, std::span<const uchar> vals);
+
+    // operation counters for the whole table and for each bucket
+    DhtStats stats();
+    std::vector<DhtBucketStats> bucket_stats();
+    void reset_stats();
+    // bucket count by size class: slot 0 holds buckets of 0 or 1
+    // records, slot n those of [2^n, 2^(n+1)) records
+    std::vector<size_t> size_histogram();
+
+    // Hand every record to fn in blocks of cnt packed records. Buckets
+    // are divided into disjoint ranges of roughly equal record counts,
+    // one range per thread. Returns the number of records visited.
+    typedef std::function<void(ucharptr_c recs, size_t cnt)> BlockFunc;
+    size_t for_each_block(BlockFunc fn, size_t threads = 1);
+
+    // Choose the hasher that maps keys to buckets before open(). The id
+    // (up to 16 characters) is kept in the manifest, and a table built
+    // with another hasher won't open. A table closed without a manifest
+    // can't be checked.
+    bool set_hasher(dht_bucket_id_func func, const std::string& id);
+
+    // buckets holding more than recs records are split (0 disables)
+    void set_split_threshold(size_t recs) { split_recs = recs; }
+
+    // choose the storage layout before open(). A table that was written
+    // in LSM or columnar mode always opens in that mode, and a log table
+    // can't be opened as columnar. Tables without values are never
+    // split into columns.
+    void set_storage_mode(DhtStorageMode mode) { storage = mode; }
+    DhtStorageMode storage_mode() const { return storage; }
+    void set_lsm_options(size_t log_recs, size_t max_runs, uint32_t bloom_bits);
+    // write new runs as compressed blocks (delta-encoded keys, LZ4).
+    // Runs already on disk keep whatever format they were written in.
+    void set_run_compression(bool on);
+    // LSM mode - fold every bucket's log and runs into a single run
+    bool compact();
+    // split every oversized bucket until none remain - used to convert
+    // existing tables offline.
+    size_t rehash();
+
+    // return the live bucket ids of a table. Files left behind by an
+    // interrupted split are ignored, or deleted if prune is set.
+    static BucketIdList list_buckets(
+        const std::string path,
+        const std::string base,
+        bool prune = false);
+
+    // read the header of a closed table's manifest - lets tools open a
+    // table without knowing its record layout.
+    static bool read_manifest_header(
+        const std::string path,
+        const std::string base,
+        DhtManifestHeader& hdr);
 
     static std::string get_bucket_fspec(
         const std::string path,
@@ -128,10 +497,37 @@ public:
         const std::string bucket,
         bool *exists = nullptr);
 
+    // where a key falls among the buckets of a table with the default
+    // hasher - keys sorted by it are grouped by bucket, however far the
+    // buckets have split
+    static uint64_t bucket_order( ucharptr_c key, size_t keylen );
+
+    static BucketFileCache::Stats file_cache_stats();
+    static void set_file_cache_size(size_t cap);
+
 private:
     std::string calc_bucket_id( ucharptr_c key );
+    std::map<std::string, IndexList> group_by_bucket( ucharptr_c keys, size_t cnt );
+    void maybe_split( const std::string& bucket, BucketFilePtr bp );
+    bool split_bucket( const std::string& bucket );
+    bool write_directory();
+    static BucketIdSet read_directory( const std::string path, const std::string base );
+    static std::string get_directory_fspec( const std::string path, const std::string base );
+    bool load_manifest();
+    bool write_manifest();
+    static std::string get_manifest_fspec( const std::string path, const std::string base );
+    void add_bucket( const std::string& bucket, size_t rec_cnt );
+    BucketFilePtr make_bucket( const std::string& fspec, const size_t* rec_cnt = nullptr );
     BucketFilePtr get_bucket( const std::string& bucket, bool must_exist = false );
+    void load_runs( bool prune );
+    void check_columns( bool has_buckets );
+    static void remove_bucket_files( const std::string& fspec );
+    void maybe_compact( const std::string& bucket, BucketFilePtr bp );
+    void compact_bucket( const std::string& bucket, size_t max_runs );
+    void compact_loop();
+    void stop_compactor();
     std::string get_bucket_fspec( const std::string& bucket, bool* exists = nullptr );
+    void sweep_write_buffers();
 protected:
     static std::string default_hasher(ucharptr_c key, size_t keylen);
 };
@@ -148,40 +544,50 @@ public:
     // For this iterator, we want to return consecutive records
     // in the dht across file boundaries (i.e., the last record
     // in one bucket is followed by the first record in the next
-    // bucket and vise versa.) But, we don't want to actually
-    // retrieve any record before unless the iterator is
-    // dereferenced (* or ->).
+    // bucket.) Records are read a block at a time, so a pass
+    // over the table costs one read per ITER_BUFF_SIZE bytes
+    // rather than one per record. Copies of an iterator share
+    // the block buffer, so only the latest copy can be advanced.
     class iterator : public std::iterator<
         std::input_iterator_tag,
         KeyVal,
-        KeyVal,
+        std::ptrdiff_t,
         const KeyVal*,
-        KeyVal>
+        const KeyVal&>
     {
         friend dht;
     private:
-        BucketFilePtrMap&    _map;
+        BucketFilePtrMap*    _map;
         BucketFilePtrMapCItr _buck;
-        long                 _recno;
-        bool                 _read;
+        size_t               _recno;    // bucket recno of the block start
+        size_t               _pos;      // current record in the block
+        size_t               _cnt;      // records in the block
+        size_t               _reclen;
+        std::shared_ptr<std::vector<uchar>> _buff;
         KeyVal               _keyval;
     public:
-        iterator(BucketFilePtrMap& m, BucketFilePtrMapCItr pos)
-        : _map(m), _buck(pos), _recno(0), _read(false)
-        {}
+        iterator(BucketFilePtrMap& m, BucketFilePtrMapCItr pos, size_t reclen)
+        : _map(&m), _buck(pos), _recno(0), _pos(0), _cnt(0), _reclen(reclen)
+        {
+            if ( _buck != _map->end() )
+            {
+                size_t recs = std::max( (size_t)ITER_BUFF_SIZE / _reclen, (size_t)1 );
+                _buff = std::make_shared<std::vector<uchar>>( recs * _reclen );
+                fill();
+            }
+        }
 
         iterator& operator++()
         {
-            if ( _recno >= _buck->second->_reccnt )
+            if ( ++_pos < _cnt )
             {
-                ++_buck;
-                _recno = 0;
+                unpack();
             }
             else
             {
-                ++_recno;
+                _recno += _cnt;
+                fill();
             }
-            _read = false;
             return *this;
         }
 
@@ -192,66 +598,93 @@ public:
             return ret;
         }
 
-        iterator& operator--()
+        bool operator==(const iterator& other) const
         {
-            if ( _recno == 0 )
-            {
-                --_buck;
-                _recno = _buck->second->_reccnt - 1;
-            }
-            else
-            {
-                --_recno;
-            }
-            _read = false;
-            return *this;
+            return _buck == other._buck
+                && ( _buck == _map->end() || _recno + _pos == other._recno + other._pos );
         }
 
-        iterator operator--(int)
+        bool operator!=(const iterator& other) const
         {
-            iterator ret = *this;
-            --(*this);
-            return ret;
+            return !(*this == other);
         }
 
-        bool operator==(const iterator& other) const
+        const KeyVal& operator*() const
         {
-            return _buck == other._buck && _recno == other._recno;
+            return _keyval;
         }
 
-        bool operator!=(const iterator& other) const
+        const KeyVal* operator->() const
         {
-            return !(*this == other);
+            return &_keyval;
         }
 
-        const KeyVal* operator->()
+    private:
+        // read the block at _recno, moving on past the end of the bucket
+        void fill()
         {
-            if ( !_read )
+            _pos = 0;
+            while ( _buck != _map->end() )
             {
-                _buck->second->read( _recno, (ucharptr)&_keyval.first, (ucharptr)&_keyval.second );
-                _read = true;
+                _cnt = _buck->second->read_block( _recno, _buff->data(), _buff->size() / _reclen );
+                if ( _cnt > 0 )
+                {
+                    unpack();
+                    return;
+                }
+                ++_buck;
+                _recno = 0;
             }
-            return &_keyval;
+            _cnt   = 0;
+            _recno = 0;
+        }
+
+        void unpack()
+        {
+            ucharptr p = _buff->data() + _pos * _reclen;
+            std::memcpy( (ucharptr)&_keyval.first, p, sizeof(K) );
+            if ( _reclen > sizeof(K) )
+                std::memcpy( (ucharptr)&_keyval.second, p + sizeof(K), sizeof(V) );
         }
     };
 
     iterator begin()
     {
-        return iterator{fp_map, fp_map.begin()};
+        return iterator{fp_map, fp_map.begin(), reclen};
     }
     iterator end()
     {
-        return iterator{fp_map, fp_map.end()};
+        return iterator{fp_map, fp_map.end(), reclen};
+    }
+
+    // call fn(key, val) for every record, with the buckets divided into
+    // disjoint ranges across threads. fn is called concurrently, and
+    // must not add to this table (splits are held off until the pass
+    // is done.)
+    template <class Fn>
+    size_t parallel_for_each(Fn fn, size_t threads)
+    {
+        return for_each_block( [&](ucharptr_c recs, size_t cnt)
+        {
+            KeyVal kv;
+            ucharptr p = recs;
+            for ( size_t i(0); i < cnt; ++i, p += reclen )
+            {
+                std::memcpy( (ucharptr)&kv.first, p, sizeof(K) );
+                if ( vallen != 0 )
+                    std::memcpy( (ucharptr)&kv.second, p + sizeof(K), sizeof(V) );
+                fn( kv.first, kv.second );
+            }
+        }, threads );
     }
 
     bool open(
         const std::string  path_name,
         const std::string  base_name,
-        int                level,
-        dht_bucket_id_func bucket_func = default_hasher)
+        int                level)
     {
         size_t vsize = (typeid(V) == typeid(NAUGHT_TYPE)) ? 0 : sizeof(V);
-        return DiskHashTable::open(path_name, base_name, level, sizeof(K), vsize, bucket_func);
+        return DiskHashTable::open(path_name, base_name, level, sizeof(K), vsize);
     }
 
     bool search(K& key)
@@ -286,6 +719,48 @@ public:
     {
         return DiskHashTable::update((ucharptr_c)&key, (ucharptr_c)&val);
     }
+    bool insert_or_get(K& key, V& val, Handle& handle)
+    {
+        return DiskHashTable::insert_or_get((ucharptr_c)&key, (ucharptr)&val, handle);
+    }
+    bool update(const Handle& handle, V& val)
+    {
+        return DiskHashTable::update(handle, (ucharptr_c)&val);
+    }
+    size_t search_many(std::span<const K> keys, std::span<V> vals, FoundList& found)
+    {
+        return DiskHashTable::search_many(key_bytes(keys), val_bytes(vals), found);
+    }
+    size_t insert_many(std::span<const K> keys, std::span<V> vals, FoundList& inserted)
+    {
+        return DiskHashTable::insert_many(key_bytes(keys), val_bytes(vals), inserted);
+    }
+    size_t search_many_async(AsyncIO& aio, std::span<const K> keys, std::span<V> vals, FoundList& found)
+    {
+        return DiskHashTable::search_many_async(aio, key_bytes(keys), val_bytes(vals), found);
+    }
+    size_t append_many_async(AsyncIO& aio, std::span<const K> keys, std::span<const V> vals)
+    {
+        return DiskHashTable::append_many_async(aio, key_bytes(keys), val_bytes(vals));
+    }
+
+private:
+    std::span<const uchar> key_bytes(std::span<const K> keys)
+    {
+        return std::span<const uchar>((const uchar *)keys.data(), keys.size_bytes());
+    }
+    std::span<uchar> val_bytes(std::span<V> vals)
+    {
+        if ( vallen == 0 )
+            return std::span<uchar>();
+        return std::span<uchar>((ucharptr)vals.data(), vals.size_bytes());
+    }
+    std::span<const uchar> val_bytes(std::span<const V> vals)
+    {
+        if ( vallen == 0 )
+            return std::span<const uchar>();
+        return std::span<const uchar>((const uchar *)vals.data(), vals.size_bytes());
+    }
 };
 
 } // namespace dreid
\ No newline at end of file
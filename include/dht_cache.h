@@ -0,0 +1,276 @@
+// dht_cache
+//
+// Memory-budgeted write-back tier in front of a dht<K,V> (or anything
+// with the same interface, such as dht_tiers<K,V>.) Records are
+// kept in a sharded in-memory hash map, and only once a shard has used
+// up its share of the budget are its oldest records spilled to the
+// table. Collisions cluster within a few tiers, so most lookups of a
+// position that was just resolved never touch the disk.
+//
+// A record is in the cache or in the table, never both - whatever is
+// spilled was absent from the table when it was cached. Everything
+// still cached is spilled by spill() (and the destructor), so the table
+// is complete once the cache is gone.
+//
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "bloom.h"
+#include "dht.h"
+
+namespace dreid {
+
+#define DHT_CACHE_SHARDS         64
+#define DHT_CACHE_ENTRY_OVERHEAD 48     // map node, bucket slot and fifo slot
+#define DHT_CACHE_SPILL_RECS     256    // most records spilled at a time
+
+struct DhtCacheStats
+{
+    uint64_t hits;      // lookups answered from memory
+    uint64_t misses;    // lookups that went to the table
+    uint64_t inserts;
+    uint64_t spills;    // records moved to the table
+    size_t   size;      // records held in memory
+    size_t   capacity;
+};
+
+template<class K, class V, class Table = dht<K,V>>
+class dht_cache
+{
+    struct KeyHash
+    {
+        size_t operator()(const K& k) const
+        {
+            return BloomFilter::hash((const unsigned char *)&k, sizeof(K));
+        }
+    };
+
+    struct KeyEq
+    {
+        bool operator()(const K& a, const K& b) const
+        {
+            return !std::memcmp(&a, &b, sizeof(K));
+        }
+    };
+
+    struct Shard
+    {
+        std::mutex                                mtx;
+        std::unordered_map<K, V, KeyHash, KeyEq>  map;
+        std::deque<K>                             fifo;     // oldest at front
+    };
+
+    Table&                _table;
+    Shard                 _shards[DHT_CACHE_SHARDS];
+    size_t                _shard_cap;
+    std::atomic<uint64_t> _hits{0};
+    std::atomic<uint64_t> _misses{0};
+    std::atomic<uint64_t> _inserts{0};
+    std::atomic<uint64_t> _spills{0};
+
+    Shard& shard_of(const K& key)
+    {
+        // the low bits pick the map bucket, so use the high ones here
+        return _shards[ ( KeyHash()(key) >> 58 ) % DHT_CACHE_SHARDS ];
+    }
+
+    // move the oldest records of a full shard to the table
+    void spill_nolock(Shard& s, size_t cnt)
+    {
+        for ( size_t i(0); i < cnt && !s.fifo.empty(); ++i )
+        {
+            K key = s.fifo.front();
+            s.fifo.pop_front();
+            auto itr = s.map.find(key);
+            if ( itr == s.map.end() )
+                continue;
+            _table.append(key, itr->second);
+            s.map.erase(itr);
+            _spills++;
+        }
+    }
+
+    void add_nolock(Shard& s, K& key, V& val)
+    {
+        if ( s.map.size() >= _shard_cap )
+            spill_nolock(s, std::clamp( _shard_cap / 8, (size_t)1, (size_t)DHT_CACHE_SPILL_RECS ));
+        s.map.emplace(key, val);
+        s.fifo.push_back(key);
+        _inserts++;
+    }
+
+public:
+    dht_cache(Table& table, size_t budget = 0)
+    : _table(table)
+    {
+        set_budget(budget);
+    }
+
+    ~dht_cache()
+    {
+        spill();
+    }
+
+    // RAM to spend, in bytes. Shrinking the budget takes effect as
+    // records are added.
+    void set_budget(size_t budget)
+    {
+        size_t per = sizeof(K) * 2 + sizeof(V) + DHT_CACHE_ENTRY_OVERHEAD;
+        _shard_cap = std::max( budget / per / DHT_CACHE_SHARDS, (size_t)1 );
+        for ( auto& s : _shards )
+        {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            s.map.reserve( std::min( _shard_cap, (size_t)1024*64 ) );
+        }
+    }
+
+    size_t size()
+    {
+        return _table.size() + cached();
+    }
+
+    size_t cached()
+    {
+        size_t cnt(0);
+        for ( auto& s : _shards )
+        {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            cnt += s.map.size();
+        }
+        return cnt;
+    }
+
+    bool search(K& key, V& val)
+    {
+        Shard& s = shard_of(key);
+        BeginDummyScope
+            std::lock_guard<std::mutex> lock(s.mtx);
+            auto itr = s.map.find(key);
+            if ( itr != s.map.end() )
+            {
+                _hits++;
+                val = itr->second;
+                return true;
+            }
+        EndDummyScope
+        _misses++;
+        return _table.search(key, val);
+    }
+
+    bool insert(K& key, V& val)
+    {
+        return insert_or_get(key, val);
+    }
+
+    // add the record unless the key is already cached or in the table,
+    // in which case the existing value is copied to val. The shard stays
+    // locked through the table search, so two threads can't both add
+    // the same key. That search is disk I/O, and every other key of the
+    // shard (1/DHT_CACHE_SHARDS of them) waits behind it - a known cost
+    // of keeping the check and the add one step. Cached records have no
+    // slot on disk, so there is no handle to hand out - update them by
+    // key.
+    bool insert_or_get(K& key, V& val)
+    {
+        Shard& s = shard_of(key);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        auto itr = s.map.find(key);
+        if ( itr != s.map.end() )
+        {
+            _hits++;
+            val = itr->second;
+            return false;
+        }
+        _misses++;
+        if ( _table.search(key, val) )
+            return false;
+        add_nolock(s, key, val);
+        return true;
+    }
+
+    bool update(K& key, V& val)
+    {
+        Shard& s = shard_of(key);
+        BeginDummyScope
+            std::lock_guard<std::mutex> lock(s.mtx);
+            auto itr = s.map.find(key);
+            if ( itr != s.map.end() )
+            {
+                itr->second = val;
+                return true;
+            }
+        EndDummyScope
+        return _table.update(key, val);
+    }
+
+    // answer what the cache can, then look the rest up in the table in
+    // one batch
+    size_t search_many(std::span<const K> keys, std::span<V> vals, FoundList& found)
+    {
+        found.assign(keys.size(), false);
+        IndexList        miss;
+        std::vector<K>   miss_keys;
+        size_t hits(0);
+        for ( size_t i(0); i < keys.size(); ++i )
+        {
+            Shard& s = shard_of(keys[i]);
+            std::lock_guard<std::mutex> lock(s.mtx);
+            auto itr = s.map.find(keys[i]);
+            if ( itr != s.map.end() )
+            {
+                vals[i]  = itr->second;
+                found[i] = true;
+                hits++;
+            }
+            else
+            {
+                miss.push_back(i);
+                miss_keys.push_back(keys[i]);
+            }
+        }
+        _hits   += hits;
+        _misses += miss.size();
+        if ( miss.empty() )
+            return hits;
+
+        std::vector<V> miss_vals(miss.size());
+        FoundList      miss_found;
+        hits += _table.search_many(miss_keys, miss_vals, miss_found);
+        for ( size_t j(0); j < miss.size(); ++j )
+        {
+            if ( miss_found[j] )
+            {
+                vals[ miss[j] ]  = miss_vals[j];
+                found[ miss[j] ] = true;
+            }
+        }
+        return hits;
+    }
+
+    // move everything to the table and flush it
+    bool spill()
+    {
+        for ( auto& s : _shards )
+        {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            spill_nolock(s, s.fifo.size());
+            s.map.clear();
+            s.fifo.clear();
+        }
+        return _table.flush();
+    }
+
+    DhtCacheStats stats()
+    {
+        return DhtCacheStats{ _hits, _misses, _inserts, _spills, cached(), _shard_cap * DHT_CACHE_SHARDS };
+    }
+};
+
+} // namespace dreid
@@ -0,0 +1,520 @@
+// dht_tiers
+//
+// A dht<K,V> split by distance tier. Only the last few tiers are kept in
+// hot, searchable tables (one per tier.) Once a tier falls out of the
+// window its table is sorted into compressed cold archives - sorted runs
+// with a Bloom filter - and deleted. Collisions cluster within a few
+// tiers, so lookups mostly end in the hot tables, and the cold archives
+// are only read when their filter can't rule a key out.
+//
+// Records are added to the current tier, which set_tier() advances.
+// Lookups try the hot tiers newest first, then the archives newest
+// first, so an update of an archived record (which is added to the
+// current tier) shadows the old version.
+//
+// Layout under <root><level>/: a table directory <base>_t<tier> per hot
+// tier, and the archives in <base>_cold/ as t<tier>.<seq>. A tier is
+// only deleted once all its archives are in place, so a tier found both
+// hot and archived was being archived when the program stopped, and is
+// archived again. A plain <base> table left by a run from before tiers
+// is archived on open as the oldest tier (TIER_LEGACY).
+//
+// Archiving is done by the thread that moves the window, without the
+// table lock - a tier out of the window is no longer written, so it is
+// read unlocked and only swapped for its archives under the lock. Until
+// then it is still searched, and updates to it go to the current tier.
+//
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <span>
+#include <sstream>
+#include <type_traits>
+#include <vector>
+
+#include "dht.h"
+#include "sorted_run.h"
+
+namespace dreid {
+
+#define TIER_ARCHIVE_RECS  (1024*1024)      // most records per cold archive
+#define TIER_BLOOM_BITS    10
+#define TIER_LEGACY        -1               // a table written before tiers
+
+struct DhtTierStats
+{
+    uint64_t hot_hits;
+    uint64_t cold_hits;     // keys only found in an archive
+    uint64_t cold_probes;   // archives searched
+    uint64_t bloom_skips;   // archives ruled out by their filter
+    size_t   hot_tiers;
+    size_t   cold_runs;
+};
+
+template<class K, class V>
+class dht_tiers
+{
+    typedef std::unique_ptr<dht<K,V>> TablePtr;
+
+    static constexpr size_t VALLEN = std::is_same_v<V, NAUGHT_TYPE> ? 0 : sizeof(V);
+    static constexpr size_t RECLEN = sizeof(K) + VALLEN;
+
+    struct Archive
+    {
+        int          tier;
+        unsigned     seq;
+        SortedRunPtr run;
+    };
+
+    std::string            _root;
+    std::string            _base;
+    int                    _level;
+    size_t                 _window;
+    DhtStorageMode         _mode;
+    // taken exclusively only to move to a new tier or swap one for its
+    // archives
+    std::shared_mutex      _mtx;
+    std::mutex             _archive_mtx;    // one thread archives at a time
+    std::map<int, TablePtr> _hot;
+    std::set<int>          _retiring;       // hot tiers out of the window
+    std::vector<Archive>   _cold;       // oldest first
+    std::atomic<int>       _tier;
+    std::atomic<uint64_t>  _hot_hits{0};
+    std::atomic<uint64_t>  _cold_hits{0};
+    std::atomic<uint64_t>  _cold_probes{0};
+    std::atomic<uint64_t>  _bloom_skips{0};
+
+public:
+    // window - tiers kept hot, including the current one
+    dht_tiers(size_t window)
+    : _level(0)
+    , _window(std::max( window, (size_t)1 ))
+    , _mode(DHT_STORAGE_LOG)
+    , _tier(-1)
+    {}
+
+    void set_storage_mode(DhtStorageMode mode) { _mode = mode; }
+
+    bool open(const std::string root, const std::string base, int level)
+    {
+        _root  = root;
+        _base  = base;
+        _level = level;
+        std::filesystem::create_directories( cold_dir() );
+        bool legacy = std::filesystem::is_directory( level_dir() + _base );
+
+        // find the hot tiers
+        std::string lead = _base + "_t";
+        for ( auto& entry : std::filesystem::directory_iterator( level_dir() ) )
+        {
+            std::string fname = entry.path().filename().string();
+            if ( !entry.is_directory() || fname.rfind( lead, 0 ) != 0
+              || fname.size() == lead.size()
+              || fname.find_first_not_of( "0123456789", lead.size() ) != std::string::npos )
+                continue;
+            open_tier( std::stoi( fname.substr( lead.size() ) ) );
+        }
+
+        // and the archives, dropping those of tiers still hot
+        std::map<std::pair<int, unsigned>, std::string> found;
+        for ( auto& entry : std::filesystem::directory_iterator( cold_dir() ) )
+        {
+            std::string fname = entry.path().filename().string();
+            int tier;
+            unsigned seq;
+            char tail;
+            if ( std::sscanf( fname.c_str(), "t%d.%u%c", &tier, &seq, &tail ) != 2 || _hot.contains( tier )
+              || ( tier == TIER_LEGACY && legacy ) )
+                std::filesystem::remove( entry.path() );
+            else
+                found[ {tier, seq} ] = entry.path().string();
+        }
+        for ( auto& f : found )
+        {
+            SortedRunPtr run = std::make_shared<SortedRun>( f.second, sizeof(K), VALLEN );
+            if ( run->load() )
+                _cold.push_back( Archive{ f.first.first, f.first.second, run } );
+        }
+
+        if ( legacy && !archive_legacy() )
+            return false;
+
+        int tier = _hot.empty() ? 0 : _hot.rbegin()->first;
+        if ( _hot.empty() )
+            open_tier( tier );
+        _tier = tier;
+        return archive_tiers( retire() );
+    }
+
+    // make tier the current one, archiving the tiers that fall out of
+    // the window. Earlier tiers are ignored.
+    bool set_tier(int tier)
+    {
+        if ( tier <= _tier )
+            return true;
+        BeginDummyScope
+            std::unique_lock<std::shared_mutex> lock( _mtx );
+            if ( tier <= _tier )
+                return true;
+            open_tier( tier );
+            _tier = tier;
+        EndDummyScope
+        return archive_tiers( retire() );
+    }
+
+    int tier() const { return _tier; }
+
+    // shadowed versions of archived records are counted too
+    size_t size()
+    {
+        std::shared_lock<std::shared_mutex> lock( _mtx );
+        size_t cnt(0);
+        for ( auto& h : _hot )
+            cnt += h.second->size();
+        for ( auto& a : _cold )
+            cnt += a.run->size();
+        return cnt;
+    }
+
+    bool search(K& key, V& val)
+    {
+        std::shared_lock<std::shared_mutex> lock( _mtx );
+        return search_nolock( key, val, -1 );
+    }
+
+    bool insert(K& key, V& val)
+    {
+        DiskHashTable::Handle handle;
+        return insert_or_get( key, val, handle );
+    }
+
+    // the current tier's insert_or_get is atomic, and no other tier is
+    // ever inserted into, so the older tiers only need a look first
+    bool insert_or_get(K& key, V& val, DiskHashTable::Handle& handle)
+    {
+        std::shared_lock<std::shared_mutex> lock( _mtx );
+        if ( search_nolock( key, val, _tier ) )
+            return false;
+        return _hot[ _tier ]->insert_or_get( key, val, handle );
+    }
+
+    bool append(K& key, V& val)
+    {
+        std::shared_lock<std::shared_mutex> lock( _mtx );
+        return _hot[ _tier ]->append( key, val );
+    }
+
+    // a record that has gone cold, or is going, is shadowed by a copy in
+    // the current tier
+    bool update(K& key, V& val)
+    {
+        std::shared_lock<std::shared_mutex> lock( _mtx );
+        V old;
+        for ( auto itr = _hot.rbegin(); itr != _hot.rend(); ++itr )
+        {
+            if ( !_retiring.contains( itr->first ) )
+            {
+                if ( itr->second->update( key, val ) )
+                    return true;
+            }
+            else if ( itr->second->search( key, old ) )
+                return _hot[ _tier ]->append( key, val );
+        }
+        if ( !search_cold_nolock( key, old ) )
+            return false;
+        return _hot[ _tier ]->append( key, val );
+    }
+
+    // Handles are only ever handed out by the current tier, and no other
+    // tier is written to, so any table can apply them.
+    bool update(const DiskHashTable::Handle& handle, V& val)
+    {
+        std::shared_lock<std::shared_mutex> lock( _mtx );
+        return _hot[ _tier ]->update( handle, val );
+    }
+
+    size_t search_many(std::span<const K> keys, std::span<V> vals, FoundList& found)
+    {
+        std::shared_lock<std::shared_mutex> lock( _mtx );
+        found.assign( keys.size(), false );
+        IndexList      left( keys.size() );
+        for ( size_t i(0); i < left.size(); ++i )
+            left[i] = i;
+        std::vector<K> sub_keys;
+        std::vector<V> sub_vals;
+        FoundList      sub_found;
+        size_t hits(0);
+        for ( auto itr = _hot.rbegin(); itr != _hot.rend() && !left.empty(); ++itr )
+        {
+            sub_keys.clear();
+            for ( auto i : left )
+                sub_keys.push_back( keys[i] );
+            sub_vals.resize( sub_keys.size() );
+            size_t n = itr->second->search_many( sub_keys, sub_vals, sub_found );
+            if ( n == 0 )
+                continue;
+            hits += n;
+            IndexList still;
+            for ( size_t j(0); j < left.size(); ++j )
+            {
+                if ( sub_found[j] )
+                {
+                    vals[ left[j] ]  = sub_vals[j];
+                    found[ left[j] ] = true;
+                }
+                else
+                    still.push_back( left[j] );
+            }
+            left.swap( still );
+        }
+        _hot_hits += hits;
+        for ( auto i : left )
+        {
+            K key = keys[i];
+            if ( search_cold_nolock( key, vals[i] ) )
+            {
+                found[i] = true;
+                hits++;
+            }
+        }
+        return hits;
+    }
+
+    bool flush()
+    {
+        std::shared_lock<std::shared_mutex> lock( _mtx );
+        bool ok = true;
+        for ( auto& h : _hot )
+            ok = h.second->flush() && ok;
+        return ok;
+    }
+
+    DhtTierStats stats()
+    {
+        std::shared_lock<std::shared_mutex> lock( _mtx );
+        return DhtTierStats{ _hot_hits, _cold_hits, _cold_probes, _bloom_skips, _hot.size(), _cold.size() };
+    }
+
+private:
+    std::string level_dir() const
+    {
+        std::stringstream ss;
+        ss << _root << _level << '/';
+        return ss.str();
+    }
+
+    std::string cold_dir() const
+    {
+        return level_dir() + _base + "_cold/";
+    }
+
+    std::string tier_name(int tier) const
+    {
+        char sfx[16];
+        std::sprintf( sfx, "_t%04d", tier );
+        return _base + sfx;
+    }
+
+    void open_tier(int tier)
+    {
+        TablePtr t = std::make_unique<dht<K,V>>();
+        t->set_storage_mode( _mode );
+        t->open( _root, tier_name( tier ), _level );
+        _hot[ tier ] = std::move( t );
+    }
+
+    // hot tiers newest first, skipping skip_tier, then the archives
+    bool search_nolock(K& key, V& val, int skip_tier)
+    {
+        for ( auto itr = _hot.rbegin(); itr != _hot.rend(); ++itr )
+        {
+            if ( itr->first != skip_tier && itr->second->search( key, val ) )
+            {
+                _hot_hits++;
+                return true;
+            }
+        }
+        return search_cold_nolock( key, val );
+    }
+
+    bool search_cold_nolock(K& key, V& val)
+    {
+        ucharptr out = ( VALLEN != 0 ) ? (ucharptr)&val : nullptr;
+        for ( auto itr = _cold.rbegin(); itr != _cold.rend(); ++itr )
+        {
+            if ( !itr->run->maybe_contains( (ucharptr_c)&key ) )
+            {
+                _bloom_skips++;
+                continue;
+            }
+            _cold_probes++;
+            if ( itr->run->search( (ucharptr_c)&key, out ) != -1 )
+            {
+                _cold_hits++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // mark the hot tiers that have fallen out of the window, and return
+    // them for archiving
+    std::vector<int> retire()
+    {
+        std::unique_lock<std::shared_mutex> lock( _mtx );
+        std::vector<int> tiers;
+        for ( auto& h : _hot )
+        {
+            if ( h.first + (int)_window > _tier )
+                break;
+            if ( _retiring.insert( h.first ).second )
+                tiers.push_back( h.first );
+        }
+        return tiers;
+    }
+
+    // swap each retired tier for its archives. A tier that can't be
+    // archived is left hot, and retired again with the next tier.
+    bool archive_tiers(const std::vector<int>& tiers)
+    {
+        std::lock_guard<std::mutex> serial( _archive_mtx );
+        bool ok = true;
+        for ( int tier : tiers )
+        {
+            dht<K,V> *table;
+            BeginDummyScope
+                std::shared_lock<std::shared_mutex> lock( _mtx );
+                table = _hot[ tier ].get();
+            EndDummyScope
+            std::vector<Archive> runs;
+            bool done = write_archives( *table, tier, runs );
+
+            TablePtr gone;
+            BeginDummyScope
+                std::unique_lock<std::shared_mutex> lock( _mtx );
+                _retiring.erase( tier );
+                if ( done )
+                {
+                    add_cold_nolock( runs );
+                    gone = std::move( _hot[ tier ] );
+                    _hot.erase( tier );
+                }
+            EndDummyScope
+            if ( !done )
+            {
+                std::cout << "Error archiving tier " << tier << " of " << _base << " - tier left hot" << std::endl;
+                ok = false;
+                continue;
+            }
+            gone.reset();
+            std::filesystem::remove_all( level_dir() + tier_name( tier ) );
+        }
+        return ok;
+    }
+
+    // archive the table of a run from before tiers - only from open()
+    bool archive_legacy()
+    {
+        std::vector<Archive> runs;
+        bool done;
+        BeginDummyScope
+            dht<K,V> table;
+            table.set_storage_mode( _mode );
+            table.open( _root, _base, _level );
+            done = write_archives( table, TIER_LEGACY, runs );
+        EndDummyScope
+        if ( !done )
+        {
+            std::cout << "Error archiving " << _base << " - unable to open its tiers" << std::endl;
+            return false;
+        }
+        add_cold_nolock( runs );
+        std::filesystem::remove_all( level_dir() + _base );
+        std::cout << "Archived untiered table " << _base << std::endl;
+        return true;
+    }
+
+    // archives are ordered by tier, then sequence
+    void add_cold_nolock(std::vector<Archive>& runs)
+    {
+        _cold.insert( _cold.end(), runs.begin(), runs.end() );
+        std::stable_sort( _cold.begin(), _cold.end(), []( const Archive& a, const Archive& b )
+        {
+            return a.tier < b.tier;
+        });
+    }
+
+    // Sort a table into archives of up to TIER_ARCHIVE_RECS records.
+    // Within an archive the newest version of a key wins. Archives are
+    // written under temporary names and only renamed once all of them
+    // are complete and on disk.
+    bool write_archives(dht<K,V>& table, int tier, std::vector<Archive>& runs)
+    {
+        std::vector<uchar>       recs;
+        std::vector<std::string> tmps;
+        bool ok = true;
+        auto write = [&]()
+        {
+            size_t cnt = recs.size() / RECLEN;
+            if ( cnt == 0 || !ok )
+                return;
+            IndexList order( cnt );
+            for ( size_t i(0); i < cnt; ++i )
+                order[i] = i;
+            std::stable_sort( order.begin(), order.end(), [&]( size_t a, size_t b )
+            {
+                return std::memcmp( recs.data() + a * RECLEN, recs.data() + b * RECLEN, sizeof(K) ) < 0;
+            });
+            char name[32];
+            std::sprintf( name, "t%d.%u.tmp", tier, (unsigned)tmps.size() );
+            tmps.push_back( cold_dir() + name );
+            RunWriter w( tmps.back(), sizeof(K), VALLEN, cnt, TIER_BLOOM_BITS, RUN_CODEC_LZ4 );
+            for ( size_t i(0); ok && i < cnt; ++i )
+            {
+                ucharptr_c rec = recs.data() + order[i] * RECLEN;
+                if ( i + 1 < cnt && !std::memcmp( rec, recs.data() + order[i + 1] * RECLEN, sizeof(K) ) )
+                    continue;   // a newer version follows
+                ok = w.add( rec );
+            }
+            ok = w.finish() && ok;
+            recs.clear();
+        };
+
+        table.for_each_block( [&]( ucharptr_c p, size_t cnt )
+        {
+            recs.insert( recs.end(), p, p + cnt * RECLEN );
+            if ( recs.size() >= (size_t)TIER_ARCHIVE_RECS * RECLEN )
+                write();
+        });
+        write();
+        for ( auto& t : tmps )
+            ok = ok && sync_path( t );
+        if ( !ok )
+        {
+            for ( auto& t : tmps )
+                std::filesystem::remove( t );
+            return false;
+        }
+
+        // the renames are on disk before the tier is dropped
+        for ( unsigned seq(0); seq < tmps.size(); ++seq )
+        {
+            std::string fspec = tmps[seq].substr( 0, tmps[seq].size() - 4 );
+            std::error_code ec;
+            std::filesystem::rename( tmps[seq], fspec, ec );
+            SortedRunPtr run = std::make_shared<SortedRun>( fspec, sizeof(K), VALLEN );
+            if ( ec || !run->load() )
+                return false;
+            runs.push_back( Archive{ tier, seq, run } );
+        }
+        return sync_path( cold_dir() );
+    }
+};
+
+} // namespace dreid
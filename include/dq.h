@@ -17,8 +17,45 @@
 // - fpos_t of the start of the block
 // - fpos_t of the first unused rec in the block
 //
+// Records are not written or read one at a time. The tail of the push
+// block is gathered in memory and written a buffer at a time, and the
+// pop block is read ahead a buffer at a time, so the files are only
+// touched when a buffer fills or empties, a block rolls over, or at a
+// checkpoint (flush.) Records pushed but not yet written are popped
+// straight from the push buffer.
 //
+// New blocks are given their space with fallocate rather than written
+// out, and a consumed block's space is punched out of the file, so the
+// .dat only holds what is still queued. Free blocks at the end of the
+// file are cut off.
 //
+// In mapped mode the push and pop blocks are memory-mapped instead, so
+// a push or pop is a memcpy into or out of the mapping. The kernel is
+// told the blocks are read sequentially, and the pages of the pop block
+// are dropped as they are consumed. The files are the same either way.
+//
+// The idx is only a snapshot. Each change to the block lists (and each
+// checkpoint) is appended to a journal, .jnl, as one fixed-size entry,
+// and the journal is replayed over the snapshot on open. Only once the
+// journal has grown long is a new snapshot written (to a temp file,
+// then renamed) and the journal emptied. Entries carry a sequence
+// number, so a journal that outlives its snapshot is not applied twice,
+// and a checksum, so a torn last entry is dropped. The journal is
+// fsync'd every few entries and at each checkpoint.
+//
+// A compressed queue stores each buffer's worth of records as a frame:
+// the records are XOR-ed against their predecessor, byte-shuffled and
+// LZ4 compressed (see lz4block.h), and decompressed a frame at a time
+// on pop. Every frame has a slot in the block big enough for the worst
+// case, and what it doesn't use is never written, so the file is sparse
+// and records are still found by number. The tail frame is kept in the
+// push buffer and rewritten whole until it fills. Compressed queues
+// are never mapped.
+//
+// Given a sort key, each run of records is sorted by it just before it
+// is written (a push buffer, or a buffer's worth of the mapped block),
+// leaving out any already popped or already written. Records within a
+// run are then no longer first in first out.
 //
 
 #pragma once
@@ -26,15 +63,24 @@
 #include <filesystem>
 #include <list>
 #include <mutex>
+#include <vector>
 
 namespace dreid {
 
 typedef uint64_t        dq_block_id_t;
 typedef uint64_t        dq_rec_no_t;
 typedef unsigned char * dq_data_t;
+typedef uint64_t (*dq_sort_key_func)(const unsigned char *rec);
 
 const dq_block_id_t BLOCK_NIL = -1;
 
+enum DqMode
+{
+    DQ_BUFFERED,
+    DQ_MAPPED,
+    DQ_COMPRESSED       // only when the queue is created
+};
+
 #pragma pack(1)
 
 struct IndexRec
@@ -68,8 +114,45 @@ struct QueueHeader
     QueueRecPos   _pop;
 };
 
+// one change to the index
+struct JournalRec
+{
+    uint64_t      _seq;
+    uint32_t      _type;
+    dq_block_id_t _block;
+    QueueRecPos   _push;        // positions after the change
+    QueueRecPos   _pop;
+    dq_rec_no_t   _rec_cnt;
+    uint32_t      _check;
+};
+
+// ahead of each compressed frame
+struct FrameHeader
+{
+    uint32_t _len;              // compressed bytes that follow
+    uint32_t _rec_cnt;
+};
+
 #pragma pack()
 
+enum JournalType
+{
+    JNL_CHECKPOINT,     // positions only
+    JNL_NEW_BLOCK,      // block added at the end of the file
+    JNL_REUSE_BLOCK,    // block taken off the free chain
+    JNL_FREE_BLOCK,     // block consumed, put on the free chain
+    JNL_TRIM            // free blocks from block on cut from the file
+};
+
+// a block mapped into memory
+struct QueueMap
+{
+    unsigned char *base;    // start of the mapping (page aligned)
+    size_t         len;
+    unsigned char *recs;    // first record of the block
+    dq_block_id_t  block;
+};
+
 class QueueFile
 {
 protected:
@@ -94,14 +177,37 @@ class DiskQueue
 private:
     std::string _path;
     std::string _name;
+    std::string _fspec;             // path/name/name, less the extension
     QueueHeader _header;
     QueueFile   _idx;
+    QueueFile   _jnl;
+    uint64_t    _jnl_seq;           // last entry applied
+    uint64_t    _jnl_cnt;           // entries in the journal
+    unsigned    _sync_recs;
+    unsigned    _unsynced;
     QueueFile   _dat;
     BlockList   _alloc;
     BlockList   _free;
+    dq_rec_no_t _buf_recs;          // records per buffer
+    std::vector<unsigned char> _push_buf;
+    dq_rec_no_t _push_buf_start;    // push block recno of _push_buf[0]
+    std::vector<unsigned char> _pop_buf;
+    dq_rec_no_t _pop_buf_start;     // pop block recno of _pop_buf[0]
+    dq_rec_no_t _pop_buf_cnt;
+    bool        _mapped;
+    QueueMap    _push_map;
+    QueueMap    _pop_map;
+    dq_rec_no_t _pop_drop;          // pop block recno of the first page not dropped
+    dq_sort_key_func _sort_key;
+    dq_rec_no_t _sort_from;         // push block recno of the first record not sorted (mapped)
+    std::vector<unsigned char> _sort_buf;
+    dq_rec_no_t _frame_recs;        // records per compressed frame (0 - not compressed)
+    dq_rec_no_t _frame_slot;        // bytes set aside for each frame
+    std::vector<unsigned char> _frame_raw;
+    std::vector<unsigned char> _frame_buf;
 
 public:
-    DiskQueue(std::string path, std::string name, dq_rec_no_t reclen);
+    DiskQueue(std::string path, std::string name, dq_rec_no_t reclen, DqMode mode = DQ_BUFFERED);
     virtual ~DiskQueue();
     bool empty()
     {
@@ -110,8 +216,43 @@ public:
     };
     void push(const dq_data_t data);
     bool pop(dq_data_t data);
+    // push or pop a run of cnt (at most max) records, taking the lock once
+    void push_n(const dq_data_t data, dq_rec_no_t cnt);
+    dq_rec_no_t pop_n(dq_data_t data, dq_rec_no_t max);
     dq_rec_no_t size() { return _header._rec_cnt; }
+    dq_rec_no_t rec_len() { return _header._rec_len; }
+    bool compressed() { return _frame_recs != 0; }
+    // write buffered records and journal the positions - a checkpoint
+    void flush();
+    // fsync the journal every recs entries (0 - only at checkpoints)
+    void set_sync_interval(unsigned recs) { _sync_recs = recs; }
+    // sort each run by func before it is written (nullptr - don't)
+    void set_sort_key(dq_sort_key_func func) { _sort_key = func; }
 private:
+    void init_buffers();
+    void init_frames(dq_rec_no_t frame_recs);
+    off_t frame_pos(dq_block_id_t block, dq_rec_no_t rec);
+    void write_frame_nolock();
+    dq_rec_no_t read_frame_nolock(dq_block_id_t block, dq_rec_no_t rec, unsigned char *recs);
+    void load_push_frame();
+    void flush_push_nolock();
+    void sync_data_nolock();
+    dq_rec_no_t unpopped_from(dq_rec_no_t rec);
+    void sort_recs(unsigned char *recs, dq_rec_no_t cnt);
+    void sort_mapped_nolock();
+    dq_rec_no_t push_run_nolock(const unsigned char *data, dq_rec_no_t cnt);
+    dq_rec_no_t pop_run_nolock(unsigned char *data, dq_rec_no_t max);
+    void next_push_block_nolock();
+    void next_pop_block_nolock();
+    void reserve_block(dq_block_id_t block);
+    void release_block(dq_block_id_t block);
+    void trim_nolock();
+    bool map_block(QueueMap& map, dq_block_id_t block);
+    void unmap_block(QueueMap& map);
+    void drop_pages(QueueMap& map, dq_rec_no_t from, dq_rec_no_t to);
+    void unmap_nolock(const char *why);
+    void journal(JournalType type, dq_block_id_t block = BLOCK_NIL);
+    void replay_journal();
     void write_index();
     void read_index();
 };
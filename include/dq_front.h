@@ -0,0 +1,71 @@
+// QueueFront
+//
+// A bounded lock-free ring in front of a DiskQueue. Records are pushed
+// to and popped from the ring, and only go to disk once it is full.
+// When the ring runs dry it is refilled from disk a batch at a time.
+//
+// While anything is on disk, new records go to disk behind it, so the
+// queue as a whole stays first-in first-out - the ring always holds
+// the oldest records.
+//
+// The ring is a sequence-numbered slot array (Vyukov's bounded MPMC
+// queue), so any number of threads can push and pop at once without
+// a lock. Only the disk side is serialised.
+//
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "dq.h"
+
+namespace dreid {
+
+#define DQ_FRONT_RECS   (1024*64)       // default ring size, records
+
+class QueueFront
+{
+private:
+    DiskQueue&                 _dq;
+    dq_rec_no_t                _reclen;
+    size_t                     _mask;           // ring size - 1
+    std::unique_ptr<std::atomic<size_t>[]> _seq;
+    std::vector<unsigned char> _recs;
+    alignas(64) std::atomic<size_t> _head;      // next slot to pop
+    alignas(64) std::atomic<size_t> _tail;      // next slot to push
+    alignas(64) std::atomic<dq_rec_no_t> _overflow;     // records not in the ring
+    std::mutex                 _refill_mtx;
+    std::vector<unsigned char> _batch;          // refill staging, half a ring
+    std::vector<unsigned char> _carry;          // popped from disk, no room in the ring
+    dq_rec_no_t                _carry_pos;
+    std::atomic<uint64_t>      _spilled;
+    std::atomic<uint64_t>      _refilled;
+
+public:
+    // the ring is rounded up to a power of two records
+    QueueFront(DiskQueue& dq, size_t recs = DQ_FRONT_RECS);
+    void push(const dq_data_t data);
+    bool pop(dq_data_t data);
+    void push_n(const dq_data_t data, dq_rec_no_t cnt);
+    // may return fewer than max even though more are queued
+    dq_rec_no_t pop_n(dq_data_t data, dq_rec_no_t max);
+    dq_rec_no_t size();
+    bool empty() { return size() == 0; }
+    // checkpoint the disk queue
+    void flush();
+    // move the ring to disk and flush - only while no one else is using
+    // the queue. The ring goes behind what is already on disk, so the
+    // order within the queue is not kept across a spill.
+    void spill();
+    uint64_t spilled()  { return _spilled; }
+    uint64_t refilled() { return _refilled; }
+private:
+    bool ring_push(const unsigned char *data);
+    bool ring_pop(unsigned char *data);
+    dq_rec_no_t take_overflow(unsigned char *data, dq_rec_no_t max);
+    dq_rec_no_t refill(dq_data_t data, dq_rec_no_t max);
+};
+
+} // namespace dreid
@@ -0,0 +1,208 @@
+// frontier_set
+//
+// The positions queued for a tier, so a position reached by several
+// parents is only queued once - later parents just record an edge to
+// the one that was queued. Sharded like dht_cache.
+//
+// Each shard keeps whole keys until it has used up its share of the
+// budget, then swaps them for 64-bit fingerprints (a second hash of the
+// key.) Fingerprints take less room but can mistake a new position for
+// a queued one - about n / 2^64 per lookup with n fingerprints held. A
+// shard that fills up with fingerprints stops adding, and whatever it
+// lets through is caught when it is popped, as before.
+//
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "bloom.h"
+
+namespace dreid {
+
+#define FRONTIER_SET_SHARDS          64
+#define FRONTIER_SET_ENTRY_OVERHEAD  32     // map node and bucket slot
+#define FRONTIER_SET_PRINT_SEED      0x9e3779b97f4a7c15ULL
+
+enum FrontierSetMode
+{
+    FS_EXACT,           // whole keys
+    FS_FINGERPRINT,     // 64-bit fingerprints
+    FS_FULL             // fingerprints, no longer adding
+};
+
+struct FrontierSetStats
+{
+    uint64_t adds;      // keys added
+    uint64_t dups;      // keys found already queued
+    uint64_t passed;    // keys let through by a full shard
+    size_t   size;      // keys and fingerprints held
+    size_t   printed;   // shards using fingerprints
+};
+
+template<class K, class V>
+class frontier_set
+{
+    struct KeyHash
+    {
+        size_t operator()(const K& k) const
+        {
+            return BloomFilter::hash((const unsigned char *)&k, sizeof(K));
+        }
+    };
+
+    struct KeyEq
+    {
+        bool operator()(const K& a, const K& b) const
+        {
+            return !std::memcmp(&a, &b, sizeof(K));
+        }
+    };
+
+    struct Shard
+    {
+        std::mutex                                mtx;
+        FrontierSetMode                           mode = FS_EXACT;
+        std::unordered_map<K, V, KeyHash, KeyEq>  keys;
+        std::unordered_map<uint64_t, V>           prints;
+    };
+
+    Shard                 _shards[FRONTIER_SET_SHARDS];
+    size_t                _key_cap;
+    size_t                _print_cap;
+    std::atomic<uint64_t> _adds{0};
+    std::atomic<uint64_t> _dups{0};
+    std::atomic<uint64_t> _passed{0};
+
+    Shard& shard_of(const K& key)
+    {
+        // the low bits pick the map bucket, so use the high ones here
+        return _shards[ ( KeyHash()(key) >> 58 ) % FRONTIER_SET_SHARDS ];
+    }
+
+    static uint64_t print_of(const K& key)
+    {
+        return BloomFilter::hash((const unsigned char *)&key, sizeof(K), FRONTIER_SET_PRINT_SEED);
+    }
+
+    // the shard's keys are using their share - swap them for fingerprints
+    void to_prints_nolock(Shard& s)
+    {
+        s.prints.reserve(s.keys.size());
+        for ( auto& kv : s.keys )
+            s.prints.emplace(print_of(kv.first), kv.second);
+        std::unordered_map<K, V, KeyHash, KeyEq>().swap(s.keys);
+        s.mode = ( s.prints.size() >= _print_cap ) ? FS_FULL : FS_FINGERPRINT;
+    }
+
+public:
+    frontier_set(size_t budget = 0)
+    {
+        set_budget(budget);
+    }
+
+    // RAM to spend, in bytes
+    void set_budget(size_t budget)
+    {
+        size_t per_key   = sizeof(K)        + sizeof(V) + FRONTIER_SET_ENTRY_OVERHEAD;
+        size_t per_print = sizeof(uint64_t) + sizeof(V) + FRONTIER_SET_ENTRY_OVERHEAD;
+        _key_cap   = std::max( budget / per_key   / FRONTIER_SET_SHARDS, (size_t)1 );
+        _print_cap = std::max( budget / per_print / FRONTIER_SET_SHARDS, (size_t)1 );
+    }
+
+    // add the key unless it is already queued, in which case its value
+    // is copied to val. Returns true if the key is to be queued.
+    bool insert_or_get(const K& key, V& val)
+    {
+        Shard& s = shard_of(key);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        if ( s.mode == FS_EXACT )
+        {
+            auto [itr, added] = s.keys.try_emplace(key, val);
+            if ( !added )
+            {
+                val = itr->second;
+                _dups++;
+                return false;
+            }
+            if ( s.keys.size() >= _key_cap )
+                to_prints_nolock(s);
+            _adds++;
+            return true;
+        }
+
+        uint64_t print = print_of(key);
+        if ( s.mode == FS_FULL )
+        {
+            auto itr = s.prints.find(print);
+            if ( itr != s.prints.end() )
+            {
+                val = itr->second;
+                _dups++;
+                return false;
+            }
+            _passed++;
+            return true;
+        }
+
+        auto [itr, added] = s.prints.try_emplace(print, val);
+        if ( !added )
+        {
+            val = itr->second;
+            _dups++;
+            return false;
+        }
+        if ( s.prints.size() >= _print_cap )
+            s.mode = FS_FULL;
+        _adds++;
+        return true;
+    }
+
+    bool search(const K& key, V& val)
+    {
+        Shard& s = shard_of(key);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        if ( s.mode == FS_EXACT )
+        {
+            auto itr = s.keys.find(key);
+            if ( itr == s.keys.end() )
+                return false;
+            val = itr->second;
+            return true;
+        }
+        auto itr = s.prints.find(print_of(key));
+        if ( itr == s.prints.end() )
+            return false;
+        val = itr->second;
+        return true;
+    }
+
+    // forget everything - the tier has been worked
+    void clear()
+    {
+        for ( auto& s : _shards )
+        {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            std::unordered_map<K, V, KeyHash, KeyEq>().swap(s.keys);
+            std::unordered_map<uint64_t, V>().swap(s.prints);
+            s.mode = FS_EXACT;
+        }
+    }
+
+    FrontierSetStats stats()
+    {
+        FrontierSetStats st{ _adds, _dups, _passed, 0, 0 };
+        for ( auto& s : _shards )
+        {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            st.size += s.keys.size() + s.prints.size();
+            if ( s.mode != FS_EXACT )
+                st.printed++;
+        }
+        return st;
+    }
+};
+
+} // namespace dreid
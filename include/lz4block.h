@@ -0,0 +1,42 @@
+// lz4block - LZ4 block format codec
+//
+// A small, dependency-free implementation of the LZ4 block format
+// (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md): greedy
+// single-probe matching on the compression side, bounds-checked on the
+// decompression side so a damaged block fails instead of overrunning.
+// Output is readable by the reference LZ4_decompress_safe() and vice
+// versa.
+//
+// Also here: the record transforms applied before compressing blocks
+// of fixed-length sorted records. Consecutive keys are XOR-ed against
+// their predecessor (sorted keys share long prefixes, which turn into
+// zeroes), then the block is byte-shuffled so byte n of every record
+// is stored together - LZ4 only finds matches of 4+ bytes, and the
+// columns are far more repetitive than the rows.
+//
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace dreid {
+namespace lz4 {
+
+// worst case compressed size of n input bytes
+size_t  compress_bound(size_t n);
+// compress n bytes of src into dst. Returns the compressed size, or 0
+// if it doesn't fit in cap bytes.
+size_t  compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+// decompress n bytes of src into dst. Returns the decompressed size,
+// or -1 if the block is damaged or doesn't fit in cap bytes.
+ssize_t decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+// XOR each record's key with the previous record's key, in place
+void delta_encode(uint8_t *recs, size_t rec_cnt, size_t rec_len, size_t key_len);
+void delta_decode(uint8_t *recs, size_t rec_cnt, size_t rec_len, size_t key_len);
+// transpose rec_cnt records of rec_len bytes into byte columns and back
+void shuffle  (const uint8_t *src, uint8_t *dst, size_t rec_cnt, size_t rec_len);
+void unshuffle(const uint8_t *src, uint8_t *dst, size_t rec_cnt, size_t rec_len);
+
+} // namespace lz4
+} // namespace dreid
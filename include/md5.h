@@ -60,6 +60,7 @@ public:
   void update(const char *buf, size_type length);
   MD5& finalize();
   std::string hexdigest() const;
+  const unsigned char *rawdigest() const;
   friend std::ostream& operator<<(std::ostream&, MD5 md5);
 
 private:
@@ -0,0 +1,157 @@
+// SortedRun
+//
+// An immutable file of fixed-length records sorted by key (memcmp
+// order), written in blocks of RUN_BLOCK_RECS records. The first key of
+// each block is kept in memory as a sparse index, so a lookup is a
+// Bloom filter probe, a binary search of the index and a single block
+// read.
+//
+// Blocks are stored raw, or with RUN_CODEC_LZ4 delta-encoded, shuffled
+// and LZ4 compressed (see lz4block.h). A block that doesn't shrink is
+// stored raw; a block is compressed when its length is less than its
+// record count times the record length.
+//
+// File layout:
+//   block 0 .. block n-1
+//   index   - per block: first key, file offset, byte length, rec count
+//   bloom   - filter bits (may be empty)
+//   RunLineage (version 2 on)
+//   RunFooter
+//
+// The lineage says what the run replaced when it was written, so the
+// leftovers of a compaction or merge cut short by a crash are known
+// for what they are when the table is opened again.
+//
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bloom.h"
+#include "dht.h"
+
+namespace dreid {
+
+#define RUN_BLOCK_RECS    64
+#define RUN_MAGIC         "DHTR"
+#define RUN_VERSION       2       // 1 - no lineage
+
+#define RUN_CODEC_RAW     0
+#define RUN_CODEC_LZ4     1
+
+#pragma pack(1)
+
+struct RunFooter
+{
+    char     magic[4];
+    uint16_t version;
+    uint16_t codec;         // block encoding - 0 is raw records
+    uint32_t key_len;
+    uint32_t val_len;
+    uint64_t rec_cnt;
+    uint32_t block_recs;
+    uint32_t block_cnt;
+    uint64_t index_off;
+    uint64_t bloom_off;
+    uint64_t bloom_bits;
+    uint32_t bloom_k;
+};
+
+struct RunLineage
+{
+    uint32_t merged_below;  // runs with a lower sequence were merged into this one (0 - none)
+    uint64_t log_cnt;       // log records compacted into this run (0 - none)
+    uint64_t log_check;     // hash of those records as they were in the log
+};
+
+struct RunBlockInfo
+{
+    uint64_t off;
+    uint32_t len;
+    uint32_t rec_cnt;
+};
+
+#pragma pack()
+
+class SortedRun
+{
+private:
+    std::string               _fspec;
+    size_t                    _keylen;
+    size_t                    _vallen;
+    size_t                    _reclen;
+    size_t                    _reccnt;
+    uint16_t                  _codec;
+    RunLineage                _lineage;
+    std::vector<uchar>        _first_keys;  // block_cnt packed keys
+    std::vector<RunBlockInfo> _blocks;
+    std::vector<size_t>       _block_recno; // recno of each block's first record
+    BloomFilter               _bloom;
+
+public:
+    SortedRun(const std::string& fspec, size_t key_len, size_t val_len);
+    ~SortedRun();
+
+    bool load();
+    // return the run-relative record number of key, or -1
+    // bytes_read, if given, is increased by the bytes read from disk
+    off_t  search(ucharptr_c key, ucharptr val = nullptr, size_t *bytes_read = nullptr);
+    bool   maybe_contains(ucharptr_c key) const;
+    size_t size()      const { return _reccnt; }
+    size_t block_cnt() const { return _blocks.size(); }
+    const std::string& fspec() const { return _fspec; }
+    const RunLineage& lineage() const { return _lineage; }
+    // decode one block into buff (which must hold RUN_BLOCK_RECS records)
+    size_t read_block(size_t blk, ucharptr buff, size_t *bytes_read = nullptr);
+    // read up to max_recs records starting at run-relative recno
+    size_t read_recs(size_t recno, ucharptr buff, size_t max_recs);
+    // close and delete the run file
+    void   remove();
+
+private:
+    int  open();
+    void close();
+};
+
+// write a run one record at a time. Records must arrive in strictly
+// increasing key order.
+class RunWriter
+{
+private:
+    std::string               _fspec;
+    std::FILE*                _fp;
+    size_t                    _keylen;
+    size_t                    _reclen;
+    uint64_t                  _reccnt;
+    uint64_t                  _off;
+    std::vector<uchar>        _block;
+    std::vector<uchar>        _packed;      // compressed copy of _block
+    size_t                    _block_cnt;
+    std::vector<uchar>        _index;
+    BloomFilter               _bloom;
+    RunLineage                _lineage;
+    RunFooter                 _footer;
+    bool                      _ok;
+
+public:
+    RunWriter(const std::string& fspec, size_t key_len, size_t val_len,
+              size_t expected_cnt, uint32_t bloom_bits_per_key,
+              uint16_t codec = RUN_CODEC_RAW);
+    ~RunWriter();
+    bool add(ucharptr_c rec);
+    // say what the run replaces - before finish()
+    void set_lineage(const RunLineage& lineage) { _lineage = lineage; }
+    bool finish();
+    uint64_t size() const { return _reccnt; }
+
+private:
+    bool write_block();
+    size_t pack_block();
+};
+
+// wait until a file (or a directory's entries) is on disk
+bool sync_path(const std::string& fspec);
+// sync tmp, rename it to fspec and sync the directory
+bool sync_rename(const std::string& tmp, const std::string& fspec);
+
+} // namespace dreid
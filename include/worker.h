@@ -14,6 +14,8 @@ void save_stats_file(std::string fspec, time_t tapt);
 void insert_unresolved(PositionPacked& pp, PosInfo& pi);
 void set_stop_handler();
 bool open_tables(int level);
+void flush_tables();
+void close_tables();
 void worker(int level);
 
 } // namespace dreid